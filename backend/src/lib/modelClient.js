@@ -0,0 +1,72 @@
+// src/lib/modelClient.js
+import net from "node:net";
+
+/**
+ * Client for a resident `slang_trainer --query-socket` server. One connection is kept open and
+ * reused; requests are answered in order, one JSON line each.
+ */
+let connection = null;
+
+function connect(socketPath) {
+  const socket = net.createConnection(socketPath);
+  const pending = [];
+  let buffered = "";
+  const conn = { socket, pending, socketPath };
+
+  const fail = (err) => {
+    if (connection === conn) connection = null;
+    while (pending.length) {
+      const request = pending.shift();
+      clearTimeout(request.timer);
+      request.reject(err);
+    }
+    socket.destroy();
+  };
+
+  socket.setEncoding("utf8");
+  socket.setNoDelay(true);
+  socket.unref(); // an idle connection should not keep the process alive
+  socket.on("data", (chunk) => {
+    buffered += chunk;
+    let newline;
+    while ((newline = buffered.indexOf("\n")) !== -1) {
+      const line = buffered.slice(0, newline);
+      buffered = buffered.slice(newline + 1);
+      const request = pending.shift();
+      if (!request) continue;
+      clearTimeout(request.timer);
+      try {
+        request.resolve(JSON.parse(line));
+      } catch (err) {
+        request.reject(err);
+      }
+    }
+  });
+  socket.on("error", fail);
+  socket.on("close", () => fail(new Error(`[model] Connection to ${socketPath} closed`)));
+  return conn;
+}
+
+/**
+ * Sends one query line (e.g. "PHRASE no cap", "TOP toronto 5") and resolves with the parsed reply.
+ * Lookups that miss resolve with `{ error }` rather than rejecting.
+ */
+export function queryModel(command, { socketPath = process.env.SLANG_MODEL_SOCKET, timeoutMs = 250 } = {}) {
+  if (!socketPath) return Promise.reject(new Error("[model] SLANG_MODEL_SOCKET is not set"));
+  if (!connection || connection.socketPath !== socketPath) connection = connect(socketPath);
+  const conn = connection;
+  return new Promise((resolve, reject) => {
+    const request = { resolve, reject };
+    request.timer = setTimeout(() => {
+      // Replies are matched by order, so a lost reply poisons the connection; start over.
+      if (connection === conn) connection = null;
+      conn.socket.destroy(new Error(`[model] No reply from ${socketPath}`));
+    }, timeoutMs);
+    conn.pending.push(request);
+    conn.socket.write(`${command.replace(/[\r\n]+/g, " ")}\n`);
+  });
+}
+
+export function modelServerEnabled() {
+  return Boolean(process.env.SLANG_MODEL_SOCKET);
+}
@@ -0,0 +1,149 @@
+// src/lib/modelFile.js
+import fs from "node:fs";
+
+/**
+ * Reader for the binary model `slang_trainer --model-bin` writes (layout: ModelFileHeader in
+ * slang_core.cpp). The file is loaded as one Buffer and only the looked-up phrase's record is
+ * decoded, so there is no JSON.parse of the whole model and no object graph in the heap. Records come
+ * back in the model JSON's phrase record shape, like the query server's `PHRASE` reply.
+ */
+const MAGIC = "SLGMODEL";
+const VERSION = 1;
+const HEADER_SIZE = 200;
+const FLAG_EMBEDDING_NEIGHBORS = 1;
+const RECORD_SIZE = 64;
+const TOKEN_SIZE = 24;
+const LINK_SIZE = 16;
+
+// Open models by path, with the mtime and size of the file they were read from.
+const models = new Map();
+
+function section(buf, at) {
+  return { offset: Number(buf.readBigUInt64LE(at)), size: Number(buf.readBigUInt64LE(at + 8)) };
+}
+
+// The file keeps the doubles the model JSON prints with four decimals, and the JSON rounds their
+// exact values half to even (std::to_chars). toFixed rounds exact values too, but takes a tie upwards.
+function round4(value) {
+  const digits = value.toFixed(30);
+  const point = digits.indexOf(".");
+  if (/^50*$/.test(digits.slice(point + 5))) {
+    const scaled = Math.trunc(value * 1e4);
+    return (scaled % 2 === 0 ? scaled : scaled + Math.sign(value)) / 1e4;
+  }
+  return Number(value.toFixed(4));
+}
+
+export function openModelFile(path) {
+  const buf = fs.readFileSync(path);
+  if (buf.length < HEADER_SIZE || buf.toString("latin1", 0, 8) !== MAGIC) {
+    throw new Error(`[model] ${path} is not a slang_trainer model file`);
+  }
+  if (buf.readUInt32LE(8) !== VERSION) throw new Error(`[model] Unsupported model file version in ${path}`);
+  const phraseCount = buf.readUInt32LE(24);
+  const hasNeighbors = (buf.readUInt32LE(40) & FLAG_EMBEDDING_NEIGHBORS) !== 0;
+  const stringOffsets = section(buf, 48);
+  const stringData = section(buf, 64);
+  const records = section(buf, 80);
+  const regions = section(buf, 96);
+  const tokens = section(buf, 112);
+  const links = section(buf, 128);
+  const end = [stringOffsets, stringData, records, regions, tokens, links].reduce(
+    (max, s) => Math.max(max, s.offset + s.size),
+    0,
+  );
+  if (end > buf.length) throw new Error(`[model] ${path} is truncated`);
+
+  const stringAt = (id) => {
+    const at = stringOffsets.offset + id * 8;
+    const begin = Number(buf.readBigUInt64LE(at));
+    const end = Number(buf.readBigUInt64LE(at + 8));
+    return buf.subarray(stringData.offset + begin, stringData.offset + end);
+  };
+
+  // Phrase strings are stored in byte order, which is Buffer.compare's order.
+  const find = (phrase) => {
+    const key = Buffer.from(phrase, "utf8");
+    let lo = 0;
+    let hi = phraseCount;
+    while (lo < hi) {
+      const mid = (lo + hi) >>> 1;
+      const order = Buffer.compare(stringAt(mid), key);
+      if (order === 0) return mid;
+      if (order < 0) lo = mid + 1;
+      else hi = mid;
+    }
+    return -1;
+  };
+
+  const text = (id) => stringAt(id).toString("utf8");
+  const linkList = (begin, count, scoreName) => {
+    const out = [];
+    for (let i = 0; i < count; i += 1) {
+      const at = links.offset + (begin + i) * LINK_SIZE;
+      out.push({ phrase: text(buf.readUInt32LE(at)), [scoreName]: round4(buf.readDoubleLE(at + 8)) });
+    }
+    return out;
+  };
+
+  const lookup = (phrase) => {
+    const index = find(phrase);
+    if (index < 0) return null;
+    const at = records.offset + index * RECORD_SIZE;
+    const record = { phrase, count: Number(buf.readBigUInt64LE(at)), avgScore: round4(buf.readDoubleLE(at + 8)) };
+    const cluster = buf.readInt32LE(at + 32);
+    if (cluster >= 0) record.cluster = cluster;
+    record.quality = { confidence: round4(buf.readDoubleLE(at + 16)), evidence: round4(buf.readDoubleLE(at + 24)) };
+
+    const regionBegin = buf.readUInt32LE(at + 36);
+    record.regions = [];
+    for (let i = 0; i < buf.readUInt32LE(at + 40); i += 1) {
+      const entry = regions.offset + (regionBegin + i) * 16;
+      record.regions.push({ region: text(buf.readUInt32LE(entry)), count: Number(buf.readBigUInt64LE(entry + 8)) });
+    }
+    const tokenBegin = buf.readUInt32LE(at + 44);
+    record.topContextTokens = [];
+    for (let i = 0; i < buf.readUInt32LE(at + 48); i += 1) {
+      const entry = tokens.offset + (tokenBegin + i) * TOKEN_SIZE;
+      record.topContextTokens.push({
+        token: text(buf.readUInt32LE(entry)),
+        count: Number(buf.readBigUInt64LE(entry + 8)),
+        pmi: round4(buf.readDoubleLE(entry + 16)),
+      });
+    }
+    const linkBegin = buf.readUInt32LE(at + 52);
+    const relatedCount = buf.readUInt32LE(at + 56);
+    const neighborCount = buf.readUInt32LE(at + 60);
+    record.relatedPhrases = linkList(linkBegin, relatedCount, "score");
+    if (hasNeighbors) {
+      record.embeddingNeighbors = linkList(linkBegin + relatedCount, neighborCount, "similarity");
+    }
+    return record;
+  };
+
+  return { phraseCount, lookup };
+}
+
+/**
+ * Looks a phrase up in the model file at SLANG_MODEL_FILE, which is opened again whenever its mtime
+ * or size changes, so a retrained model is picked up without a restart. Resolves to the phrase's
+ * record, or `{ error }` when the model does not have it, matching `queryModel("PHRASE ...")`.
+ */
+export function lookupModelPhrase(phrase, { path = process.env.SLANG_MODEL_FILE } = {}) {
+  if (!path) return Promise.reject(new Error("[model] SLANG_MODEL_FILE is not set"));
+  try {
+    const { mtimeMs, size } = fs.statSync(path);
+    let cached = models.get(path);
+    if (!cached || cached.mtimeMs !== mtimeMs || cached.size !== size) {
+      cached = { model: openModelFile(path), mtimeMs, size };
+      models.set(path, cached);
+    }
+    return Promise.resolve(cached.model.lookup(phrase) || { error: "unknown phrase" });
+  } catch (err) {
+    return Promise.reject(err);
+  }
+}
+
+export function modelFileEnabled() {
+  return Boolean(process.env.SLANG_MODEL_FILE);
+}
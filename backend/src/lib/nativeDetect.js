@@ -0,0 +1,103 @@
+// src/lib/nativeDetect.js
+import { spawn } from "node:child_process";
+import path from "node:path";
+import readline from "node:readline";
+import { detectSlang, dict } from "./detect.js";
+
+/**
+ * Slang detection through the compiled `slang_detect --serve` matcher when SLANG_DETECT_BIN points at
+ * it (SLANG_DETECT_STATE optionally adds the trained phrases), falling back to `detectSlang`.
+ * Dictionary hits are the same entry objects `detectSlang` returns; trained phrases come back as
+ * `{ phrase, count, source: "model" }` when `includeTrained` is set. If the matcher cannot start,
+ * exits, or sends no reply for `timeoutMs` (1000 by default), the pending messages are detected with `detectSlang`.
+ */
+let detector = null;
+
+function startDetector() {
+  const args = ["--serve", "--dictionary", path.join(process.cwd(), "src/data/slang.seed.json")];
+  if (process.env.SLANG_DETECT_STATE) args.push("--state-in", process.env.SLANG_DETECT_STATE);
+  const child = spawn(process.env.SLANG_DETECT_BIN, args, { stdio: ["pipe", "pipe", "inherit"] });
+  const pending = [];
+  const proc = { child, pending, timer: null, done: false };
+
+  proc.fail = (err) => {
+    if (detector === proc) detector = null;
+    clearTimeout(proc.timer);
+    if (!proc.done) console.warn(`${err.message}; falling back to detectSlang`);
+    proc.done = true;
+    while (pending.length) pending.shift().reject(err);
+    child.kill();
+  };
+  readline.createInterface({ input: child.stdout }).on("line", (line) => {
+    const request = pending.shift();
+    if (!request) return;
+    arm(proc);
+    try {
+      request.resolve(JSON.parse(line));
+    } catch (err) {
+      request.reject(err);
+    }
+  });
+  child.on("error", (err) => proc.fail(new Error(`[detect] slang_detect failed: ${err.message}`)));
+  child.on("exit", (code) => proc.fail(new Error(`[detect] slang_detect exited with code ${code}`)));
+  child.stdin.on("error", (err) => proc.fail(new Error(`[detect] slang_detect failed: ${err.message}`)));
+  return proc;
+}
+
+// Waits `timeoutMs` for the next reply while any are pending. Replies are matched by order, so a
+// matcher that stalls is killed rather than waited on, and a new one is started for the next message.
+function arm(proc) {
+  clearTimeout(proc.timer);
+  if (!proc.pending.length) return;
+  proc.timer = setTimeout(
+    () => proc.fail(new Error(`[detect] No reply from slang_detect in ${proc.timeoutMs} ms`)),
+    proc.timeoutMs
+  );
+}
+
+function matchLine(text, { regionPref, timeoutMs = 1000 } = {}) {
+  if (!detector) detector = startDetector();
+  const proc = detector;
+  proc.timeoutMs = timeoutMs;
+  // One message per line: the matcher treats tabs and newlines as word breaks anyway.
+  const line = `${regionPref || ""}\t${(text || "").replace(/[\t\r\n]+/g, " ")}\n`;
+  return new Promise((resolve, reject) => {
+    proc.pending.push({ resolve, reject });
+    if (proc.pending.length === 1) arm(proc);
+    proc.child.stdin.write(line);
+  });
+}
+
+function toEntries(matches, includeTrained) {
+  const entries = dict();
+  return matches
+    .filter((m) => includeTrained || m.entry !== undefined)
+    .map((m) => (m.entry !== undefined ? entries[m.entry] : { phrase: m.phrase, count: m.count, source: "model" }));
+}
+
+export async function detectSlangAsync(text, opts = {}) {
+  if (!process.env.SLANG_DETECT_BIN) return detectSlang(text, opts);
+  try {
+    return toEntries(await matchLine(text, opts), opts.includeTrained);
+  } catch {
+    return detectSlang(text, opts);
+  }
+}
+
+export async function detectSlangBatch(texts, opts = {}) {
+  if (!process.env.SLANG_DETECT_BIN) return texts.map((text) => detectSlang(text, opts));
+  try {
+    const results = await Promise.all(texts.map((text) => matchLine(text, opts)));
+    return results.map((matches) => toEntries(matches, opts.includeTrained));
+  } catch {
+    return texts.map((text) => detectSlang(text, opts));
+  }
+}
+
+// Ends the matcher process (it exits at end of input); the next detection starts a new one.
+export function closeDetector() {
+  if (!detector) return;
+  detector.done = true;
+  detector.child.stdin.end();
+  detector = null;
+}
@@ -1,8 +1,11 @@
 // src/lib/rag.js
 import SlangEntry from "../models/SlangEntry.js";
+import { modelServerEnabled, queryModel } from "./modelClient.js";
+import { lookupModelPhrase, modelFileEnabled } from "./modelFile.js";
 
 export async function buildHints(detected, regionPref) {
   if (!detected?.length) return [];
+  if (modelFileEnabled() || modelServerEnabled()) return buildModelHints(detected, regionPref);
   const phrases = [...new Set(detected.map((e) => e.phrase))];
   const rows = await SlangEntry.find({ phrase: { $in: phrases } })
     .select("phrase meanings regions")
@@ -15,3 +18,23 @@ export async function buildHints(detected, regionPref) {
     region: regionPref && r.regions?.includes(regionPref) ? regionPref : r.regions?.[0] || "global",
   }));
 }
+
+// Same hints from the trained model, read from the binary model file (SLANG_MODEL_FILE) or asked of the
+// resident query server (SLANG_MODEL_SOCKET): glosses come from the detected dictionary entries,
+// regions and related phrases from what the model saw.
+async function buildModelHints(detected, regionPref) {
+  const entries = [...new Map(detected.map((e) => [e.phrase, e])).values()].slice(0, 10);
+  const lookup = modelFileEnabled() ? lookupModelPhrase : (phrase) => queryModel(`PHRASE ${phrase}`);
+  const records = await Promise.all(entries.map((e) => lookup(e.phrase)));
+
+  return entries.map((e, i) => {
+    const record = records[i]?.error ? null : records[i];
+    const seen = (record?.regions || []).map((r) => r.region);
+    return {
+      phrase: e.phrase,
+      gloss: e.meanings?.[0] || "",
+      region: regionPref && seen.includes(regionPref) ? regionPref : seen[0] || e.regions?.[0] || "global",
+      related: (record?.relatedPhrases || []).slice(0, 3).map((r) => r.phrase),
+    };
+  });
+}
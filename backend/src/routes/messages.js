@@ -2,7 +2,7 @@ import express from "express";
 import { z } from "zod";
 import Message from "../models/Message.js";
 import { cacheKey } from "../lib/hash.js";
-import { detectSlang } from "../lib/detect.js";
+import { detectSlangAsync } from "../lib/nativeDetect.js";
 import { normalizeText } from "../lib/normalize.js";
 import { composeFallback } from "../lib/compose.js";
 import { scanSafety } from "../lib/safety.js";
@@ -26,7 +26,7 @@ router.post("/", async (req, res) => {
 
   // translate (reuse your translate logic or call the /api/translate internally)
   const normalized = normalizeText(text);
-  const detected = detectSlang(normalized, { regionPref });
+  const detected = await detectSlangAsync(normalized, { regionPref });
   const key = cacheKey({ text: normalized, regionPref });
   let base = await TransCache.findOne({ key }).lean();
   const safety = scanSafety(text);
@@ -2,9 +2,12 @@ import express from "express";
 import { z } from "zod";
 import { GoogleGenerativeAI } from "@google/generative-ai";
 
-import { detectSlang } from "../lib/detect.js"; // your dictionary matcher
+import { detectSlangAsync } from "../lib/nativeDetect.js"; // your dictionary matcher
 import { composeFallback } from "../lib/compose.js"; // rule-based composer
 import { scanSafety } from "../lib/safety.js"; // simple content scan
+import { buildHints } from "../lib/rag.js"; // trained-model hints
+import { modelServerEnabled } from "../lib/modelClient.js";
+import { modelFileEnabled } from "../lib/modelFile.js";
 
 const abbrev = { fr: "for real", idc: "i don't care", ngl: "not gonna lie", imo: "in my opinion", tbh: "to be honest" };
 const emoji = { "💀": "extremely funny", "🔥": "amazing", "🙏": "please", "😂": "very funny" };
@@ -52,7 +55,7 @@ router.post("/", async (req, res) => {
 
   // 3) detect slang (use normalized text for better matches)
   const textNorm = normalizeText(text);
-  const detected = detectSlang(textNorm, { regionPref });
+  const detected = await detectSlangAsync(textNorm, { regionPref });
 
   // 4) try LLM (guarded), else 5) fallback composer
   let out;
@@ -64,7 +67,10 @@ router.post("/", async (req, res) => {
     const timer = setTimeout(() => controller.abort(), 1600);
 
     const model = genAI.getGenerativeModel({ model: "gemini-2.5-flash" });
-    const prompt = buildPrompt({ text, audience, context, regionPref, detected });
+    const hints = modelFileEnabled() || modelServerEnabled()
+      ? await buildHints(detected, regionPref).catch(() => dictionaryHints(detected))
+      : dictionaryHints(detected);
+    const prompt = buildPrompt({ text, audience, context, regionPref, hints });
 
     // Ask for JSON directly
     const result = await model.generateContent(
@@ -112,14 +118,16 @@ router.post("/", async (req, res) => {
   return res.json(out);
 });
 
-function buildPrompt({ text, audience, context, regionPref, detected }) {
-  // pass hints from your dictionary to improve LLM reliability
-  const hints = (detected || []).map((e) => ({
+// pass hints from your dictionary to improve LLM reliability
+function dictionaryHints(detected) {
+  return (detected || []).map((e) => ({
     phrase: e.phrase,
     region: Array.isArray(e.regions) && e.regions.length ? e.regions[0] : "global",
     gloss: Array.isArray(e.meanings) && e.meanings.length ? e.meanings[0] : "",
   }));
+}
 
+function buildPrompt({ text, audience, context, regionPref, hints }) {
   return `
         You are a culturally sensitive slang translator.
         Return strict JSON with keys:
@@ -0,0 +1,185 @@
+// Times each slang_trainer stage separately on one contexts TSV and reports the results as JSON, so
+// runs can be compared across versions. Model options are the trainer's own (--threads, --clusters,
+// --kmeans, ...); the model and state are written to scratch files in the temp directory.
+#include "slang_core.h"
+
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using namespace slang;
+
+namespace {
+
+struct BenchOptions {
+  std::size_t repetitions = 3;
+  std::string label;
+  std::string resultsPath;
+};
+
+struct StageTimes {
+  std::string name;
+  std::vector<double> seconds;
+};
+
+// Splits out the benchmark's own flags; everything else is left for the trainer's parseOptions.
+BenchOptions parseBenchOptions(int argc, char **argv) {
+  BenchOptions opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--repetitions" && i + 1 < argc) {
+      opts.repetitions = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--label" && i + 1 < argc) {
+      opts.label = argv[++i];
+    } else if (arg == "--results" && i + 1 < argc) {
+      opts.resultsPath = argv[++i];
+    } else if (arg == "--help" || arg == "-h") {
+      std::cout << "Usage: slang_bench --input contexts.tsv [--repetitions 3] [--label name] [--results bench.json] "
+                   "[slang_trainer model options]\n";
+      std::exit(0);
+    }
+  }
+  if (opts.repetitions == 0) {
+    throw std::runtime_error("--repetitions must be positive.");
+  }
+  return opts;
+}
+
+// Runs fn and appends its wall time to stage `name`, creating the stage on first use.
+template <typename Fn> void timeStage(std::vector<StageTimes> &stages, const std::string &name, Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  auto it = std::find_if(stages.begin(), stages.end(), [&](const StageTimes &stage) { return stage.name == name; });
+  if (it == stages.end()) {
+    stages.push_back({name, {}});
+    it = stages.end() - 1;
+  }
+  it->seconds.push_back(elapsed.count());
+}
+
+double median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  std::size_t mid = values.size() / 2;
+  return values.size() % 2 ? values[mid] : 0.5 * (values[mid - 1] + values[mid]);
+}
+
+void writeResults(std::ostream &out, const BenchOptions &bench, const Options &options, std::uint64_t inputBytes,
+                  const CorpusStats &corpus, const Profiler &sizes, const std::vector<StageTimes> &stages) {
+  OutputBuffer buf;
+  auto seconds = [&](double value) { buf.fixed(value, 6); };
+  buf.raw("{\n  \"tool\": \"slang_bench\",\n  \"label\": \"").escaped(bench.label).raw("\",\n");
+  buf.raw("  \"input\": \"").escaped(options.inputPath).raw("\",\n");
+  buf.raw("  \"inputBytes\": ").integer(inputBytes).raw(",\n");
+  buf.raw("  \"threads\": ").integer(options.threads).raw(",\n");
+  buf.raw("  \"repetitions\": ").integer(bench.repetitions).raw(",\n");
+  buf.raw("  \"options\": {\"minCount\": ").integer(options.minCount);
+  buf.raw(", \"embeddingFeatures\": ").integer(options.embeddingFeatures);
+  buf.raw(", \"clusters\": ").integer(options.clusterCount);
+  buf.raw(", \"clusterIterations\": ").integer(options.clusterIterations);
+  buf.raw(", \"kmeans\": \"").escaped(options.kmeansMode).raw("\"");
+  buf.raw(", \"relatedLimit\": ").integer(options.relatedLimit);
+  buf.raw(", \"embeddingNeighbors\": ").integer(options.embeddingNeighbors);
+  buf.raw(", \"stateFormat\": \"").escaped(options.stateFormat).raw("\"},\n");
+  buf.raw("  \"corpus\": {\"contexts\": ").integer(corpus.totals.totalContexts);
+  buf.raw(", \"phrases\": ").integer(corpus.phrases.size());
+  buf.raw(", \"tokens\": ").integer(corpus.tokens.size());
+  buf.raw(", \"regions\": ").integer(corpus.regions.size()).raw("},\n");
+  buf.raw("  \"tables\": {");
+  for (std::size_t t = 0; t < sizes.tables.size(); ++t) {
+    buf.raw(t > 0 ? ", \"" : "\"").escaped(sizes.tables[t].name).raw("\": ").integer(sizes.tables[t].bytes);
+  }
+  buf.raw("},\n");
+  buf.raw("  \"kmeansDistanceEvaluations\": ").integer(sizes.kmeansDistanceEvaluations).raw(",\n");
+  buf.raw("  \"stages\": [\n");
+  for (std::size_t s = 0; s < stages.size(); ++s) {
+    const StageTimes &stage = stages[s];
+    buf.raw(s > 0 ? ",\n" : "").raw("    {\"name\": \"").escaped(stage.name).raw("\", \"seconds\": [");
+    for (std::size_t i = 0; i < stage.seconds.size(); ++i) {
+      if (i > 0)
+        buf.raw(", ");
+      seconds(stage.seconds[i]);
+    }
+    buf.raw("], \"min\": ");
+    seconds(*std::min_element(stage.seconds.begin(), stage.seconds.end()));
+    buf.raw(", \"median\": ");
+    seconds(median(stage.seconds));
+    buf.raw("}");
+  }
+  buf.raw("\n  ]\n}\n");
+  buf.flushTo(out);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  try {
+    BenchOptions bench = parseBenchOptions(argc, argv);
+    Options options = parseOptions(argc, argv);
+    if (options.serve) {
+      throw std::runtime_error("slang_bench does not run the resident daemon.");
+    }
+    const std::filesystem::path scratch = std::filesystem::temp_directory_path();
+    const std::string tag = std::to_string(::getpid());
+    options.outputPath = (scratch / ("slang_bench_model_" + tag + ".json")).string();
+    options.graphOutputPath.clear();
+    options.annIndexPath.clear();
+    const std::string statePath = (scratch / ("slang_bench_state_" + tag + ".dat")).string();
+    const std::uint64_t inputBytes = std::filesystem::file_size(options.inputPath);
+
+    std::vector<StageTimes> stages;
+    Profiler sizes; // table footprints and k-means work from the last repetition
+    CorpusStats corpus;
+    std::ostringstream log;
+    for (std::size_t rep = 0; rep < bench.repetitions; ++rep) {
+      corpus = CorpusStats();
+      timeStage(stages, "ingest", [&] { ingestFile(options.inputPath, options.threads, corpus, options.memoryBudget); });
+      profileCorpusTables(sizes, corpus);
+      Model model;
+      timeStage(stages, "pmi_summary", [&] { model.features = summarizeAll(corpus, options.minCount, options.threads); });
+      timeStage(stages, "embedding", [&] {
+        model.embeddingTokens = selectEmbeddingTokens(corpus, options.embeddingFeatures);
+        model.embeddings =
+            buildEmbeddings(corpus, model.embeddingTokens, options.minCount, options.minPmi, options.threads,
+                            embeddingFormat(options));
+      });
+      timeStage(stages, "kmeans", [&] { model.clusters = clusterEmbeddings(options, corpus, model); });
+      sizes.kmeansDistanceEvaluations = model.clusters.distanceEvaluations;
+      timeStage(stages, "related_phrases", [&] {
+        TokenIndex tokenIndex = buildTokenIndex(corpus);
+        model.related = buildRelatedGraph(corpus, tokenIndex, options.minCount, options.relatedLimit, options.threads);
+      });
+      if (options.embeddingNeighbors > 0) {
+        timeStage(stages, "embedding_neighbors", [&] { buildEmbeddingNeighbors(options, corpus, model); });
+      }
+      timeStage(stages, "json_write", [&] { writeModelOutputs(options, corpus, model, log); });
+      timeStage(stages, "state_save", [&] { saveState(statePath, corpus, options.stateFormat); });
+      timeStage(stages, "state_load", [&] {
+        CorpusStats loaded;
+        loadState(statePath, loaded);
+      });
+    }
+    std::filesystem::remove(options.outputPath);
+    std::filesystem::remove(statePath);
+
+    for (const auto &stage : stages) {
+      std::cerr << std::left << std::setw(20) << stage.name << std::fixed << std::setprecision(4)
+                << median(stage.seconds) << " s (median of " << stage.seconds.size() << ")\n";
+    }
+    if (bench.resultsPath.empty()) {
+      writeResults(std::cout, bench, options, inputBytes, corpus, sizes, stages);
+    } else {
+      std::ofstream out(bench.resultsPath);
+      if (!out) {
+        throw std::runtime_error("Failed to open results file: " + bench.resultsPath);
+      }
+      writeResults(out, bench, options, inputBytes, corpus, sizes, stages);
+    }
+  } catch (const std::exception &ex) {
+    std::cerr << "Error: " << ex.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,5263 @@
+#include "slang_core.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <cmath>
+#include <csignal>
+#include <deque>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <queue>
+#include <random>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(SLANG_TRAINER_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(SLANG_TRAINER_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+namespace slang {
+
+const std::unordered_set<std::string_view> STOP_WORDS = {
+    "a",      "about",  "after",  "again",   "all",    "also",   "am",     "an",     "and",    "any",
+    "are",    "around", "as",     "at",      "back",   "be",     "because","been",   "before", "being",
+    "but",    "by",     "can",    "come",    "could",  "day",    "did",    "do",     "does",   "done",
+    "dont",   "down",   "even",   "every",   "few",    "find",   "first",  "for",    "from",   "get",
+    "give",   "go",     "going",  "good",    "got",    "had",    "has",    "have",   "having", "he",
+    "her",    "here",   "hers",   "high",    "him",    "his",    "how",    "i",      "if",     "in",
+    "into",   "is",     "isnt",   "it",      "its",    "just",   "keep",   "know",   "last",   "like",
+    "little", "long",   "look",   "lot",     "made",   "make",   "many",   "may",    "me",     "might",
+    "more",   "most",   "much",   "must",    "my",     "need",   "no",     "not",    "now",    "of",
+    "off",    "on",     "once",   "one",     "only",   "or",     "other",  "our",    "out",    "over",
+    "people", "really", "right",  "same",    "see",    "she",    "should", "since",  "so",     "some",
+    "still",  "such",   "take",   "than",    "that",   "the",    "their",  "them",   "then",   "there",
+    "these",  "they",   "thing",  "think",   "this",   "those",  "though", "through","time",   "to",
+    "too",    "up",     "us",     "very",    "want",   "was",    "way",    "we",     "well",   "were",
+    "what",   "when",   "which",  "who",     "why",    "will",   "with",   "without","would",  "year",
+    "you",    "your",   "youre"};
+
+std::uint32_t internPhrase(CorpusStats &corpus, std::string_view phrase) {
+  std::uint32_t id = corpus.phrases.intern(phrase);
+  if (id == corpus.stats.size())
+    corpus.stats.emplace_back();
+  return id;
+}
+
+// The slice counting `region`'s contexts, created on first use.
+CorpusStats &regionSlice(CorpusStats &corpus, std::uint32_t region) {
+  while (corpus.regionSlices.size() <= region) {
+    CorpusStats slice;
+    slice.phrases.borrowed = slice.tokens.borrowed = slice.regions.borrowed = true;
+    corpus.regionSlices.push_back(std::move(slice));
+  }
+  return corpus.regionSlices[region];
+}
+
+// Repoints a borrowed interner's views at the same strings in `owner`, which must hold all of them.
+void rebaseViews(StringInterner &borrowed, const StringInterner &owner) {
+  for (auto &view : borrowed.strings)
+    view = owner.str(owner.find(view));
+}
+
+void compactAll(CorpusStats &corpus) {
+  for (auto &stat : corpus.stats) {
+    stat.regionCounts.compact();
+    stat.tokenCounts.compact();
+  }
+  for (auto &slice : corpus.regionSlices)
+    compactAll(slice);
+}
+
+// Ids of `table` in string order.
+std::vector<std::uint32_t> sortedIds(const StringInterner &table) {
+  std::vector<std::uint32_t> ordered(table.size());
+  for (std::uint32_t id = 0; id < ordered.size(); ++id) {
+    ordered[id] = id;
+  }
+  std::sort(ordered.begin(), ordered.end(),
+            [&](std::uint32_t a, std::uint32_t b) { return table.str(a) < table.str(b); });
+  return ordered;
+}
+
+// Phrase ids in string order so outputs do not depend on ingest order.
+std::vector<std::uint32_t> sortedPhraseIds(const CorpusStats &corpus) { return sortedIds(corpus.phrases); }
+
+// Per-worker counter on its own cache line, so workers can count without contending.
+struct alignas(64) WorkerCount {
+  std::uint64_t value = 0;
+};
+
+// Calls fn(worker, i) for every i in [0, count) on up to `threads` workers (worker < threads).
+// Items are handed out in small chunks so uneven per-item costs still balance.
+template <typename Fn> void parallelFor(std::size_t count, std::size_t threads, Fn fn) {
+  threads = std::max<std::size_t>(1, std::min(threads, count));
+  if (threads == 1) {
+    for (std::size_t i = 0; i < count; ++i) {
+      fn(std::size_t{0}, i);
+    }
+    return;
+  }
+  const std::size_t grain = std::max<std::size_t>(1, count / (threads * 16));
+  std::atomic<std::size_t> next{0};
+  std::exception_ptr error;
+  std::mutex errorMutex;
+  std::vector<std::thread> workers;
+  workers.reserve(threads);
+  for (std::size_t w = 0; w < threads; ++w) {
+    workers.emplace_back([&, w]() {
+      try {
+        for (std::size_t begin; (begin = next.fetch_add(grain)) < count;) {
+          for (std::size_t i = begin; i < std::min(count, begin + grain); ++i) {
+            fn(w, i);
+          }
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (!error)
+          error = std::current_exception();
+        next = count;
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
+
+constexpr std::size_t TSV_COLUMNS = 5;
+using TsvRow = std::array<std::string_view, TSV_COLUMNS>;
+
+// Splits the first TSV_COLUMNS columns of `line` into views; the last column ends at the next tab.
+// Returns how many columns were found.
+std::size_t splitTsv(std::string_view line, TsvRow &columns) {
+  std::size_t found = 0;
+  std::size_t start = 0;
+  while (found < TSV_COLUMNS) {
+    std::size_t tab = line.find('\t', start);
+    if (tab == std::string_view::npos) {
+      columns[found++] = line.substr(start);
+      break;
+    }
+    columns[found++] = line.substr(start, tab - start);
+    start = tab + 1;
+  }
+  return found;
+}
+
+// How the tokenizer treats a non-ASCII code point. Words are runs of one script class, so "ㅋㅋlol"
+// is two tokens; Han ideographs and hiragana carry no word breaks in the text, so each one is a
+// token of its own.
+enum class CharClass : std::uint8_t { Separator, Word, Hangul, Katakana, Ideograph };
+
+CharClass classifyCodePoint(std::uint32_t cp) {
+  if (cp < 0xC0)
+    return cp == 0xAA || cp == 0xB5 || cp == 0xBA ? CharClass::Word : CharClass::Separator; // Latin-1 symbols
+  if (cp == 0xD7 || cp == 0xF7)
+    return CharClass::Separator;
+  if (cp < 0x0600)
+    return CharClass::Word;
+  if (cp < 0x0700) { // Arabic
+    const bool punctuation = cp == 0x060C || cp == 0x061B || cp == 0x061F || (cp >= 0x066A && cp <= 0x066D) ||
+                             cp == 0x06D4;
+    return punctuation ? CharClass::Separator : CharClass::Word;
+  }
+  if ((cp >= 0x1100 && cp <= 0x11FF) || (cp >= 0x3130 && cp <= 0x318F) || (cp >= 0xA960 && cp <= 0xA97F) ||
+      (cp >= 0xAC00 && cp <= 0xD7FF))
+    return CharClass::Hangul;
+  if ((cp >= 0x2000 && cp <= 0x2BFF) || (cp >= 0x2E00 && cp <= 0x303F))
+    return CharClass::Separator; // punctuation, symbols, arrows, CJK punctuation
+  if (cp >= 0x3040 && cp <= 0x309F)
+    return CharClass::Ideograph; // hiragana
+  if ((cp >= 0x30A0 && cp <= 0x30FF) || (cp >= 0x31F0 && cp <= 0x31FF) || (cp >= 0xFF66 && cp <= 0xFF9F))
+    return cp == 0x30FB ? CharClass::Separator : CharClass::Katakana;
+  if ((cp >= 0x3400 && cp <= 0x4DBF) || (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+      (cp >= 0x20000 && cp <= 0x3FFFF))
+    return CharClass::Ideograph;
+  if (cp >= 0xE000 && cp <= 0xF8FF)
+    return CharClass::Separator; // private use
+  if (cp >= 0xFE00 && cp <= 0xFE6F)
+    return CharClass::Separator; // variation selectors, vertical and small punctuation
+  if (cp >= 0xFF00 && cp <= 0xFFEF) { // fullwidth forms: letters and digits are words
+    const bool alnum = (cp >= 0xFF10 && cp <= 0xFF19) || (cp >= 0xFF21 && cp <= 0xFF3A) || (cp >= 0xFF41 && cp <= 0xFF5A);
+    return alnum || (cp >= 0xFFA0 && cp <= 0xFFDC) ? CharClass::Word : CharClass::Separator;
+  }
+  if (cp == 0xFEFF || cp >= 0xFFF0 || (cp >= 0x1F000 && cp <= 0x1FAFF))
+    return CharClass::Separator; // byte order mark, specials, emoji
+  return CharClass::Word;
+}
+
+// Lower-case form of the capital letters whose lower case has the same UTF-8 length (Latin-1,
+// Latin Extended-A and Additional, the Vietnamese horned vowels, Greek and Cyrillic); others are
+// returned as is.
+std::uint32_t foldCodePoint(std::uint32_t cp) {
+  if (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7)
+    return cp + 0x20;
+  if (cp >= 0x100 && cp <= 0x17F) {
+    if (cp == 0x130 || cp == 0x131 || cp == 0x138 || cp == 0x149 || cp == 0x17F)
+      return cp;
+    if (cp == 0x178)
+      return 0xFF;
+    const bool oddCapitals = (cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E);
+    return (cp % 2 == 1) == oddCapitals ? cp + 1 : cp;
+  }
+  if (cp == 0x1A0 || cp == 0x1AF) // Vietnamese horned O and U
+    return cp + 1;
+  if (cp >= 0x391 && cp <= 0x3A9 && cp != 0x3A2)
+    return cp + 0x20;
+  if (cp >= 0x410 && cp <= 0x42F)
+    return cp + 0x20;
+  if (cp >= 0x400 && cp <= 0x40F)
+    return cp + 0x50;
+  if (((cp >= 0x1E00 && cp <= 0x1E95) || (cp >= 0x1EA0 && cp <= 0x1EFF)) && cp % 2 == 0)
+    return cp + 1;
+  return cp;
+}
+
+// Decodes the UTF-8 sequence at text[i]; returns its length, or 0 for a malformed, overlong or
+// surrogate sequence.
+std::size_t decodeUtf8(std::string_view text, std::size_t i, std::uint32_t &cp) {
+  const auto byte = [&](std::size_t k) { return static_cast<unsigned char>(text[i + k]); };
+  const unsigned char lead = byte(0);
+  std::size_t length;
+  std::uint32_t min;
+  if (lead >= 0xC2 && lead <= 0xDF) {
+    length = 2, cp = lead & 0x1F, min = 0x80;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    length = 3, cp = lead & 0x0F, min = 0x800;
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    length = 4, cp = lead & 0x07, min = 0x10000;
+  } else {
+    return 0;
+  }
+  if (i + length > text.size())
+    return 0;
+  for (std::size_t k = 1; k < length; ++k) {
+    if ((byte(k) & 0xC0) != 0x80)
+      return 0;
+    cp = (cp << 6) | (byte(k) & 0x3F);
+  }
+  if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+    return 0;
+  return length;
+}
+
+void encodeUtf8(std::uint32_t cp, std::size_t length, char *out) {
+  if (length == 2) {
+    out[0] = static_cast<char>(0xC0 | (cp >> 6));
+  } else if (length == 3) {
+    out[0] = static_cast<char>(0xE0 | (cp >> 12));
+    out[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+  } else {
+    out[0] = static_cast<char>(0xF0 | (cp >> 18));
+    out[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+  }
+  out[length - 1] = static_cast<char>(0x80 | (cp & 0x3F));
+}
+
+constexpr std::size_t TOKEN_BLOCK = 16;
+
+// For a block of TOKEN_BLOCK pure-ASCII bytes: writes its lower-case form to `out` and returns a
+// mask of its alphanumeric bytes (bit k for byte k). Returns -1, writing nothing, when the block
+// holds a non-ASCII byte or there is no vector path.
+int asciiWordMask(const char *in, char *out) {
+#if defined(__SSE2__)
+  const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+  if (_mm_movemask_epi8(bytes) != 0)
+    return -1;
+  // Signed compares are safe once every byte is below 0x80.
+  auto within = [&](char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(static_cast<char>(lo - 1))),
+                         _mm_cmplt_epi8(bytes, _mm_set1_epi8(static_cast<char>(hi + 1))));
+  };
+  const __m128i upper = within('A', 'Z');
+  const __m128i word = _mm_or_si128(_mm_or_si128(upper, within('a', 'z')), within('0', '9'));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                   _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+  return _mm_movemask_epi8(word);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t bytes = vld1q_u8(reinterpret_cast<const std::uint8_t *>(in));
+  if (vmaxvq_u8(bytes) >= 0x80)
+    return -1;
+  auto within = [&](std::uint8_t lo, std::uint8_t hi) {
+    return vandq_u8(vcgeq_u8(bytes, vdupq_n_u8(lo)), vcleq_u8(bytes, vdupq_n_u8(hi)));
+  };
+  const uint8x16_t upper = within('A', 'Z');
+  const uint8x16_t word = vorrq_u8(vorrq_u8(upper, within('a', 'z')), within('0', '9'));
+  vst1q_u8(reinterpret_cast<std::uint8_t *>(out), vorrq_u8(bytes, vandq_u8(upper, vdupq_n_u8(0x20))));
+  static const std::uint8_t lanes[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  const uint8x16_t bits = vandq_u8(word, vld1q_u8(lanes));
+  return vaddv_u8(vget_low_u8(bits)) | (vaddv_u8(vget_high_u8(bits)) << 8);
+#else
+  (void)in;
+  (void)out;
+  return -1;
+#endif
+}
+
+// Splits `text` into lower-cased words in `buffer` and appends a view per word to `tokens`. ASCII
+// words are alphanumeric runs; other scripts follow classifyCodePoint, and malformed UTF-8 bytes
+// separate words. Pure-ASCII blocks are classified and lower-cased TOKEN_BLOCK bytes at a time.
+// The views point into `buffer` and stay valid until the next call.
+void tokenize(std::string_view text, std::string &buffer, std::vector<std::string_view> &tokens) {
+  tokens.clear();
+  if (buffer.size() < text.size()) {
+    buffer.resize(text.size());
+  }
+  std::size_t start = std::string_view::npos;
+  CharClass current = CharClass::Separator;
+  auto finish = [&](std::size_t end) {
+    if (start != std::string_view::npos)
+      tokens.emplace_back(buffer.data() + start, end - start);
+    start = std::string_view::npos;
+  };
+  std::size_t i = 0;
+  while (i < text.size()) {
+    const int mask = i + TOKEN_BLOCK <= text.size() ? asciiWordMask(text.data() + i, &buffer[i]) : -1;
+    if (mask >= 0) {
+      if (current != CharClass::Word)
+        finish(i);
+      current = CharClass::Word;
+      for (unsigned k = 0; k < TOKEN_BLOCK;) {
+        // Bits above the block are clear in `mask` and set in `gaps`, so both scans stop there.
+        const unsigned gaps = ~static_cast<unsigned>(mask);
+        const unsigned rest = (start == std::string_view::npos ? static_cast<unsigned>(mask) : gaps) >> k;
+        if (rest == 0)
+          break;
+        k += static_cast<unsigned>(__builtin_ctz(rest));
+        if (k >= TOKEN_BLOCK)
+          break;
+        if (start == std::string_view::npos) {
+          start = i + k;
+        } else {
+          finish(i + k);
+        }
+      }
+      i += TOKEN_BLOCK;
+      continue;
+    }
+    const unsigned char ch = static_cast<unsigned char>(text[i]);
+    if (ch < 0x80) {
+      const bool word = (ch >= '0' && ch <= '9') || ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z');
+      if (!word || current != CharClass::Word)
+        finish(i);
+      if (word) {
+        buffer[i] = static_cast<char>(ch >= 'A' && ch <= 'Z' ? ch | 0x20 : ch);
+        if (start == std::string_view::npos)
+          start = i;
+      }
+      current = word ? CharClass::Word : CharClass::Separator;
+      i += 1;
+      continue;
+    }
+    std::uint32_t cp = 0;
+    const std::size_t length = decodeUtf8(text, i, cp);
+    const CharClass kind = length == 0 ? CharClass::Separator : classifyCodePoint(cp);
+    if (kind != current || kind == CharClass::Ideograph)
+      finish(i);
+    current = kind;
+    if (kind == CharClass::Separator) {
+      i += length == 0 ? 1 : length;
+      continue;
+    }
+    encodeUtf8(foldCodePoint(cp), length, &buffer[i]);
+    if (start == std::string_view::npos)
+      start = i;
+    i += length;
+  }
+  finish(text.size());
+}
+
+// Whether a token is long enough to count as context: three letters, counted in code points, where a
+// Hangul syllable block counts as two (it spells two or three jamo). A Han character is a token of its
+// own and a word in itself, so it always counts; a lone kana, like "ok" or "да", is mostly a particle.
+bool longEnoughToken(std::string_view token) {
+  std::size_t letters = 0;
+  for (std::size_t i = 0; i < token.size() && letters < 3;) {
+    std::uint32_t cp = static_cast<unsigned char>(token[i]);
+    const std::size_t length = cp < 0x80 ? 1 : std::max<std::size_t>(1, decodeUtf8(token, i, cp));
+    const bool hiragana = cp >= 0x3040 && cp <= 0x309F;
+    if (classifyCodePoint(cp) == CharClass::Ideograph && !hiragana)
+      return true;
+    letters += cp >= 0xAC00 && cp <= 0xD7A3 ? 2 : 1;
+    i += length;
+  }
+  return letters >= 3;
+}
+
+std::uint32_t internToken(CorpusStats &corpus, std::string_view token) {
+  std::uint32_t id = corpus.tokens.intern(token);
+  if (id == corpus.contextToken.size()) {
+    corpus.contextToken.push_back(longEnoughToken(token) && STOP_WORDS.find(token) == STOP_WORDS.end());
+    corpus.totals.tokenTotals.push_back(0);
+    if (corpus.approx.active()) {
+      const std::uint64_t seed = corpus.approx.sketch.estimate(token);
+      corpus.totals.tokenTotals.back() = seed;
+      corpus.approx.tokenSeeds.push_back(seed);
+    }
+  }
+  return id;
+}
+
+// Serializes items [0, count) on `threads` workers and writes them to `out` in index order;
+// fn(buffer, i) appends item i. Items are formatted a window of blocks at a time, so memory stays
+// bounded by the window rather than the whole output.
+template <typename Fn> void writeInOrder(std::ostream &out, std::size_t count, std::size_t threads, Fn fn) {
+  constexpr std::size_t BLOCK = 256;
+  const std::size_t blockCount = (count + BLOCK - 1) / BLOCK;
+  std::vector<OutputBuffer> window(std::max<std::size_t>(1, threads) * 8);
+  for (std::size_t first = 0; first < blockCount; first += window.size()) {
+    const std::size_t blocks = std::min(window.size(), blockCount - first);
+    parallelFor(blocks, threads, [&](std::size_t, std::size_t b) {
+      const std::size_t begin = (first + b) * BLOCK;
+      for (std::size_t i = begin; i < std::min(count, begin + BLOCK); ++i) {
+        fn(window[b], i);
+      }
+    });
+    for (std::size_t b = 0; b < blocks; ++b) {
+      window[b].flushTo(out);
+    }
+  }
+}
+
+// With `only` (by token id), postings are kept just for the flagged tokens; the other lists are empty.
+TokenIndex buildTokenIndex(const CorpusStats &corpus, const std::vector<std::uint8_t> *only) {
+  TokenIndex index;
+  index.offsets.assign(corpus.tokens.size() + 1, 0);
+  for (const auto &stat : corpus.stats) {
+    for (const auto &tokenPair : stat.tokenCounts.entries) {
+      if (!only || (*only)[tokenPair.first])
+        index.offsets[tokenPair.first + 1] += 1;
+    }
+  }
+  for (std::size_t t = 1; t < index.offsets.size(); ++t) {
+    index.offsets[t] += index.offsets[t - 1];
+  }
+  index.postings.resize(index.offsets.back());
+  std::vector<std::size_t> cursor(index.offsets.begin(), index.offsets.end() - 1);
+  for (std::uint32_t phrase = 0; phrase < corpus.stats.size(); ++phrase) {
+    for (const auto &tokenPair : corpus.stats[phrase].tokenCounts.entries) {
+      if (!only || (*only)[tokenPair.first])
+        index.postings[cursor[tokenPair.first]++] = {phrase, tokenPair.second};
+    }
+  }
+  return index;
+}
+
+// Per-worker buffers for relatedPhrases. `scores` is a dense accumulator indexed by phrase id and
+// `touched` lists its non-zero slots.
+struct RelatedScratch {
+  std::vector<double> scores;
+  std::vector<std::uint32_t> touched;
+  std::vector<std::uint32_t> order;
+  std::vector<double> partials;
+  RelatedList heap;
+};
+
+// Scores every phrase sharing a context token with `phrase` by sum(min(count, otherCount)) and
+// returns the best `limit`, ordered by score then phrase.
+//
+// Posting lists are scanned shortest first. The lists not yet scanned can add at most the sum of
+// this phrase's counts for their tokens to any score, so once that bound drops below the k-th
+// best partial score, unseen phrases cannot place: the long (common-token) lists are skipped and
+// the few phrases still within reach are completed by lookup in their own token counts.
+RelatedList relatedPhrases(const CorpusStats &corpus, std::uint32_t phrase, const TokenIndex &index,
+                           std::size_t limit, RelatedScratch &scratch) {
+  RelatedList ranked;
+  if (limit == 0)
+    return ranked;
+  const auto &tokens = corpus.stats[phrase].tokenCounts.entries;
+  auto listSize = [&](std::uint32_t token) { return index.offsets[token + 1] - index.offsets[token]; };
+  scratch.scores.resize(corpus.stats.size(), 0.0);
+  scratch.touched.clear();
+  scratch.order.resize(tokens.size());
+  double remaining = 0.0;
+  std::size_t remainingPostings = 0;
+  for (std::uint32_t i = 0; i < tokens.size(); ++i) {
+    scratch.order[i] = i;
+    remaining += static_cast<double>(tokens[i].second);
+    remainingPostings += listSize(tokens[i].first);
+  }
+  std::sort(scratch.order.begin(), scratch.order.end(), [&](std::uint32_t a, std::uint32_t b) {
+    std::size_t sa = listSize(tokens[a].first);
+    std::size_t sb = listSize(tokens[b].first);
+    return sa != sb ? sa < sb : a < b;
+  });
+
+  for (std::size_t i = 0; i < scratch.order.size(); ++i) {
+    const IdCount &tokenPair = tokens[scratch.order[i]];
+    const std::size_t length = listSize(tokenPair.first);
+    // Checking the bound costs O(touched), so only do it in front of a list at least that long.
+    if (scratch.touched.size() >= limit && length >= scratch.touched.size() && length >= 64) {
+      scratch.partials.clear();
+      for (std::uint32_t other : scratch.touched) {
+        scratch.partials.push_back(scratch.scores[other]);
+      }
+      std::nth_element(scratch.partials.begin(), scratch.partials.begin() + static_cast<std::ptrdiff_t>(limit - 1),
+                       scratch.partials.end(), std::greater<double>());
+      const double threshold = scratch.partials[limit - 1];
+      if (remaining < threshold) {
+        std::size_t reachable = 0;
+        for (std::uint32_t other : scratch.touched) {
+          if (scratch.scores[other] + remaining >= threshold)
+            reachable += 1;
+        }
+        if (reachable * (scratch.order.size() - i) < remainingPostings) {
+          for (std::uint32_t other : scratch.touched) {
+            if (scratch.scores[other] + remaining < threshold)
+              continue;
+            const CountVector &otherTokens = corpus.stats[other].tokenCounts;
+            for (std::size_t j = i; j < scratch.order.size(); ++j) {
+              const IdCount &rest = tokens[scratch.order[j]];
+              std::size_t pos = otherTokens.position(rest.first);
+              if (pos < otherTokens.size())
+                scratch.scores[other] += static_cast<double>(std::min(rest.second, otherTokens.entries[pos].second));
+            }
+          }
+          break;
+        }
+      }
+    }
+    for (std::size_t p = index.offsets[tokenPair.first]; p < index.offsets[tokenPair.first + 1]; ++p) {
+      const IdCount &other = index.postings[p];
+      if (other.first == phrase)
+        continue;
+      double weight = static_cast<double>(std::min(tokenPair.second, other.second));
+      if (scratch.scores[other.first] == 0.0)
+        scratch.touched.push_back(other.first);
+      scratch.scores[other.first] += weight;
+    }
+    remaining -= static_cast<double>(tokenPair.second);
+    remainingPostings -= length;
+  }
+
+  auto better = [&](const std::pair<std::uint32_t, double> &a, const std::pair<std::uint32_t, double> &b) {
+    if (a.second != b.second)
+      return a.second > b.second;
+    return corpus.phrases.str(a.first) < corpus.phrases.str(b.first);
+  };
+  // Bounded heap whose front is the worst of the best `limit` seen so far.
+  auto &heap = scratch.heap;
+  heap.clear();
+  for (std::uint32_t other : scratch.touched) {
+    std::pair<std::uint32_t, double> candidate{other, scratch.scores[other]};
+    scratch.scores[other] = 0.0;
+    if (heap.size() < limit) {
+      heap.push_back(candidate);
+      std::push_heap(heap.begin(), heap.end(), better);
+    } else if (better(candidate, heap.front())) {
+      std::pop_heap(heap.begin(), heap.end(), better);
+      heap.back() = candidate;
+      std::push_heap(heap.begin(), heap.end(), better);
+    }
+  }
+  std::sort_heap(heap.begin(), heap.end(), better);
+  ranked.assign(heap.begin(), heap.end());
+  return ranked;
+}
+
+// Related phrases for every phrase with at least `minCount` contexts, indexed by phrase id.
+// Computed once per model and shared by the JSON and graph writers.
+std::vector<RelatedList> buildRelatedGraph(const CorpusStats &corpus, const TokenIndex &index, std::uint64_t minCount,
+                                           std::size_t limit, std::size_t threads) {
+  std::vector<RelatedList> related(corpus.stats.size());
+  std::vector<RelatedScratch> scratch(std::max<std::size_t>(1, threads));
+  parallelFor(corpus.stats.size(), threads, [&](std::size_t worker, std::size_t phrase) {
+    if (corpus.stats[phrase].count < minCount)
+      return;
+    related[phrase] = relatedPhrases(corpus, static_cast<std::uint32_t>(phrase), index, limit, scratch[worker]);
+  });
+  return related;
+}
+
+Options parseOptions(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--input" && i + 1 < argc) {
+      opts.inputPath = argv[++i];
+    } else if (arg == "--output" && i + 1 < argc) {
+      opts.outputPath = argv[++i];
+    } else if (arg == "--min-count" && i + 1 < argc) {
+      opts.minCount = static_cast<std::uint64_t>(std::stoull(argv[++i]));
+    } else if (arg == "--top-tokens" && i + 1 < argc) {
+      opts.topTokens = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--related-limit" && i + 1 < argc) {
+      opts.relatedLimit = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--graph-output" && i + 1 < argc) {
+      opts.graphOutputPath = argv[++i];
+    } else if (arg == "--state-in" && i + 1 < argc) {
+      opts.stateInputPath = argv[++i];
+    } else if (arg == "--state-out" && i + 1 < argc) {
+      opts.stateOutputPath = argv[++i];
+    } else if (arg == "--state-only") {
+      opts.stateOnly = true;
+    } else if (arg == "--delta-output" && i + 1 < argc) {
+      opts.deltaOutputPath = argv[++i];
+    } else if (arg == "--delta-only") {
+      opts.deltaOnly = true;
+    } else if (arg == "--pmi-staleness" && i + 1 < argc) {
+      opts.pmiStaleness = std::stod(argv[++i]);
+    } else if (arg == "--embedding-features" && i + 1 < argc) {
+      opts.embeddingFeatures = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--embedding-storage" && i + 1 < argc) {
+      opts.embeddingStorage = argv[++i];
+    } else if (arg == "--embedding-projection" && i + 1 < argc) {
+      opts.embeddingProjection = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--clusters" && i + 1 < argc) {
+      opts.clusterCount = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--cluster-iterations" && i + 1 < argc) {
+      opts.clusterIterations = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--kmeans" && i + 1 < argc) {
+      opts.kmeansMode = argv[++i];
+    } else if (arg == "--batch-size" && i + 1 < argc) {
+      opts.batchSize = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--embedding-neighbors" && i + 1 < argc) {
+      opts.embeddingNeighbors = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--ann-ef" && i + 1 < argc) {
+      opts.annEf = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--ann-index" && i + 1 < argc) {
+      opts.annIndexPath = argv[++i];
+    } else if (arg == "--model-bin" && i + 1 < argc) {
+      opts.modelFilePath = argv[++i];
+    } else if (arg == "--mine-output" && i + 1 < argc) {
+      opts.mineOutputPath = argv[++i];
+    } else if (arg == "--mine-max-length" && i + 1 < argc) {
+      opts.mineMaxLength = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--mine-min-count" && i + 1 < argc) {
+      opts.mineMinCount = static_cast<std::uint64_t>(std::stoull(argv[++i]));
+    } else if (arg == "--mine-limit" && i + 1 < argc) {
+      opts.mineLimit = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--per-region" && i + 1 < argc) {
+      opts.regionOutputDir = argv[++i];
+    } else if (arg == "--min-pmi" && i + 1 < argc) {
+      opts.minPmi = std::stod(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      opts.threads = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--state-format" && i + 1 < argc) {
+      opts.stateFormat = argv[++i];
+    } else if (arg == "--seed" && i + 1 < argc) {
+      opts.seed = static_cast<std::uint64_t>(std::stoull(argv[++i]));
+    } else if (arg == "--profile") {
+      opts.profile = true;
+    } else if (arg == "--metrics-out" && i + 1 < argc) {
+      opts.metricsPath = argv[++i];
+    } else if (arg == "--memory-budget" && i + 1 < argc) {
+      opts.memoryBudget = static_cast<std::uint64_t>(std::stoull(argv[++i])) << 20;
+    } else if (arg == "--serve") {
+      opts.serve = true;
+    } else if (arg == "--socket" && i + 1 < argc) {
+      opts.serve = true;
+      opts.socketPath = argv[++i];
+    } else if (arg == "--query-socket" && i + 1 < argc) {
+      opts.querySocketPath = argv[++i];
+    } else if (arg == "--model-in" && i + 1 < argc) {
+      opts.modelInputPath = argv[++i];
+    } else if (arg == "--ann-in" && i + 1 < argc) {
+      opts.annInputPath = argv[++i];
+    } else if (arg == "--query-http" && i + 1 < argc) {
+      opts.queryHttpPort = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--help" || arg == "-h") {
+      std::cout << "Usage: slang_trainer --input contexts.tsv [--output model.json] [--min-count 2] [--top-tokens 12] "
+                   "[--related-limit 5] [--graph-output graph.tsv] [--state-in stats.dat] [--state-out stats.dat] "
+                   "[--embedding-features 32] [--embedding-storage dense|int8|sparse] [--embedding-projection 0] "
+                   "[--clusters 8] [--cluster-iterations 25] [--min-pmi 0.0] [--threads 1] "
+                   "[--state-format v2|v1] [--seed 42] [--kmeans full|mini-batch] [--batch-size 1024] "
+                   "[--embedding-neighbors 0] [--ann-ef 64] [--ann-index index.bin] [--model-bin model.bin] [--profile] "
+                   "[--metrics-out metrics.json] [--memory-budget MB] [--state-only] "
+                   "[--delta-output delta.json] [--delta-only] [--pmi-staleness 0.05] "
+                   "[--mine-output candidates.json] [--mine-max-length 4] [--mine-min-count 5] [--mine-limit 1000] "
+                   "[--per-region models/]\n"
+                   "       slang_trainer --serve [--socket trainer.sock] [--input contexts.tsv] [--state-in stats.dat] "
+                   "[--state-out stats.dat] [model options]\n"
+                   "       slang_trainer --query-socket model.sock | --query-http 8765 [--state-in stats.dat] "
+                   "[--input contexts.tsv] [--ann-in index.bin] [model options]\n"
+                   "       slang_trainer --query-socket model.sock | --query-http 8765 --model-in model.bin "
+                   "[--ann-in index.bin]\n"
+                   "       slang_trainer merge --state-out merged.dat shard1.dat [shard2.dat ...]\n";
+      std::exit(0);
+    }
+  }
+  const bool query = !opts.querySocketPath.empty() || opts.queryHttpPort > 0;
+  if (query && opts.serve) {
+    throw std::runtime_error("--serve cannot be combined with --query-socket or --query-http.");
+  }
+  if (opts.queryHttpPort > 65535) {
+    throw std::runtime_error("--query-http must be a port number.");
+  }
+  if (!opts.modelInputPath.empty() && (!query || !opts.inputPath.empty() || !opts.stateInputPath.empty())) {
+    throw std::runtime_error("--model-in serves a built model, so it needs --query-socket or --query-http and no "
+                             "--input or --state-in.");
+  }
+  if (!opts.annInputPath.empty() && !query) {
+    throw std::runtime_error("--ann-in is read by the query server, so it needs --query-socket or --query-http.");
+  }
+  if (opts.inputPath.empty() && !opts.serve && opts.stateInputPath.empty() && opts.modelInputPath.empty()) {
+    throw std::runtime_error("Missing required --input contexts.tsv argument.");
+  }
+  if (opts.stateOnly && (opts.stateOutputPath.empty() || opts.serve || query)) {
+    throw std::runtime_error("--state-only needs --state-out and cannot be combined with --serve or queries.");
+  }
+  if (!opts.deltaOutputPath.empty() && (opts.stateOnly || opts.serve || query)) {
+    throw std::runtime_error("--delta-output cannot be combined with --state-only, --serve or queries.");
+  }
+  if (!opts.modelFilePath.empty() && (opts.stateOnly || opts.deltaOnly)) {
+    throw std::runtime_error("--model-bin is written with the full model, so not with --state-only or --delta-only.");
+  }
+  if (!opts.mineOutputPath.empty() && (opts.inputPath.empty() || opts.inputPath == "-" || opts.serve || query)) {
+    throw std::runtime_error("--mine-output reads --input a second time, so it needs a file and no --serve or queries.");
+  }
+  if (!opts.regionOutputDir.empty() && (opts.inputPath.empty() || !opts.stateInputPath.empty() ||
+                                        opts.memoryBudget > 0 || opts.stateOnly || opts.deltaOnly || opts.serve ||
+                                        query)) {
+    throw std::runtime_error("--per-region counts each region's contexts as --input is ingested (the state does not "
+                             "keep them), so it needs --input and cannot be combined with --state-in, --memory-budget, --state-only, "
+                             "--delta-only, --serve or queries.");
+  }
+  if (opts.mineMaxLength < 2 || opts.mineMinCount < 2) {
+    throw std::runtime_error("--mine-max-length and --mine-min-count must be at least 2.");
+  }
+  if (opts.deltaOnly && opts.deltaOutputPath.empty()) {
+    throw std::runtime_error("--delta-only needs --delta-output.");
+  }
+  if (opts.pmiStaleness < 0.0) {
+    throw std::runtime_error("--pmi-staleness must not be negative.");
+  }
+  if (opts.inputPath == "-" && opts.serve && opts.socketPath.empty()) {
+    throw std::runtime_error("--input - needs --socket with --serve, which otherwise reads stdin itself.");
+  }
+  if (opts.stateFormat != "v1" && opts.stateFormat != "v2") {
+    throw std::runtime_error("--state-format must be v1 or v2.");
+  }
+  if (opts.kmeansMode != "full" && opts.kmeansMode != "mini-batch") {
+    throw std::runtime_error("--kmeans must be full or mini-batch.");
+  }
+  if (opts.embeddingStorage != "dense" && opts.embeddingStorage != "int8" && opts.embeddingStorage != "sparse") {
+    throw std::runtime_error("--embedding-storage must be dense, int8 or sparse.");
+  }
+  if (opts.embeddingProjection > 0 && (opts.embeddingStorage == "sparse" || !opts.annIndexPath.empty())) {
+    throw std::runtime_error("--embedding-projection makes rows dense and columns untokened, so it cannot be "
+                             "combined with --embedding-storage sparse or --ann-index.");
+  }
+  if (opts.batchSize == 0) {
+    throw std::runtime_error("--batch-size must be positive.");
+  }
+  if (opts.annEf == 0) {
+    throw std::runtime_error("--ann-ef must be positive.");
+  }
+  if (opts.threads == 0) {
+    opts.threads = std::max<std::size_t>(1, std::thread::hardware_concurrency());
+  }
+  return opts;
+}
+
+double parseScore(std::string_view value, std::string &buffer) {
+  if (value.empty())
+    return 0.0;
+  buffer.assign(value);
+  errno = 0;
+  char *end = nullptr;
+  double parsed = std::strtod(buffer.c_str(), &end);
+  if (end == buffer.c_str() || errno == ERANGE)
+    return 0.0;
+  return parsed;
+}
+
+double safeLog(double value) {
+  if (value <= 0.0) {
+    return -1e6;
+  }
+  return std::log(value);
+}
+
+double computePmi(std::uint64_t coCount, std::uint64_t phraseCount, std::uint64_t tokenCount, std::uint64_t totalContexts) {
+  if (coCount == 0 || phraseCount == 0 || tokenCount == 0 || totalContexts == 0) {
+    return -1e6;
+  }
+  double numerator = static_cast<double>(coCount) / static_cast<double>(totalContexts);
+  double denominator = (static_cast<double>(phraseCount) / static_cast<double>(totalContexts)) *
+                       (static_cast<double>(tokenCount) / static_cast<double>(totalContexts));
+  return safeLog(numerator / denominator);
+}
+
+double tokenPmi(const PhraseStats &stat, const IdCount &entry, const CorpusTotals &totals) {
+  return computePmi(entry.second, stat.count, totals.tokenTotals[entry.first], totals.totalContexts);
+}
+
+PhraseFeatureSummary summarizePhrase(const PhraseStats &stat, const CorpusTotals &totals) {
+  PhraseFeatureSummary summary;
+  double sum = 0.0;
+  double sumSq = 0.0;
+  double maxPmi = 0.0;
+  double count = 0.0;
+
+  for (const auto &pair : stat.tokenCounts.entries) {
+    double pmi = tokenPmi(stat, pair, totals);
+    if (pmi > 0.0) {
+      sum += pmi;
+      sumSq += pmi * pmi;
+      count += 1.0;
+      if (pmi > maxPmi)
+        maxPmi = pmi;
+    }
+  }
+
+  summary.maxPositivePmi = maxPmi;
+  summary.positiveCount = count;
+  if (count > 0.0) {
+    summary.meanPositivePmi = sum / count;
+    double meanSq = summary.meanPositivePmi * summary.meanPositivePmi;
+    summary.variancePositivePmi = (sumSq / count) - meanSq;
+    if (summary.variancePositivePmi < 0.0)
+      summary.variancePositivePmi = 0.0;
+  }
+
+  return summary;
+}
+
+// Feature summaries indexed by phrase id; phrases below minCount are never output and keep an empty one.
+std::vector<PhraseFeatureSummary> summarizeAll(const CorpusStats &corpus, std::uint64_t minCount, std::size_t threads) {
+  std::vector<PhraseFeatureSummary> out(corpus.stats.size());
+  parallelFor(corpus.stats.size(), threads, [&](std::size_t, std::size_t phrase) {
+    const PhraseStats &stat = corpus.stats[phrase];
+    if (stat.count >= minCount)
+      out[phrase] = summarizePhrase(stat, corpus.totals);
+  });
+  return out;
+}
+
+struct QualityScores {
+  double confidence = 0.0;
+  double evidence = 0.0;
+};
+
+QualityScores computeQuality(const PhraseStats &stat, const PhraseFeatureSummary &featureSummary) {
+  QualityScores q;
+  q.confidence = 1.0 - std::exp(-static_cast<double>(stat.count) / 4.0);
+  double meanPmi = featureSummary.meanPositivePmi > 0.0 ? featureSummary.meanPositivePmi : 0.0;
+  q.evidence = meanPmi * std::log1p(static_cast<double>(stat.count));
+  return q;
+}
+
+std::vector<std::uint32_t> selectEmbeddingTokens(const CorpusStats &corpus, std::size_t limit) {
+  const auto &tokenTotals = corpus.totals.tokenTotals;
+  std::vector<std::uint32_t> tokens;
+  tokens.reserve(tokenTotals.size());
+  for (std::uint32_t id = 0; id < tokenTotals.size(); ++id) {
+    if (tokenTotals[id] > 0)
+      tokens.push_back(id);
+  }
+  auto byFrequency = [&](std::uint32_t a, std::uint32_t b) {
+    if (tokenTotals[a] != tokenTotals[b])
+      return tokenTotals[a] > tokenTotals[b];
+    return corpus.tokens.str(a) < corpus.tokens.str(b);
+  };
+  if (tokens.size() > limit) {
+    std::partial_sort(tokens.begin(), tokens.begin() + static_cast<std::ptrdiff_t>(limit), tokens.end(), byFrequency);
+    tokens.resize(limit);
+  } else {
+    std::sort(tokens.begin(), tokens.end(), byFrequency);
+  }
+  return tokens;
+}
+
+// Squared Euclidean distance with SSE/AVX or NEON accumulators when available.
+float squaredDistance(const float *a, const float *b, std::size_t dim) {
+  std::size_t i = 0;
+  float sum = 0.0f;
+#if defined(__AVX__)
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  for (; i + 16 <= dim; i += 16) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(d0, d0));
+    acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(d1, d1));
+  }
+  for (; i + 8 <= dim; i += 8) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(d0, d0));
+  }
+  acc0 = _mm256_add_ps(acc0, acc1);
+  __m128 acc = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+  sum = _mm_cvtss_f32(acc);
+#elif defined(__SSE2__)
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  for (; i + 8 <= dim; i += 8) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+  }
+  for (; i + 4 <= dim; i += 4) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+  }
+  __m128 acc = _mm_add_ps(acc0, acc1);
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+  sum = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  float32x4_t acc0 = vdupq_n_f32(0.0f);
+  float32x4_t acc1 = vdupq_n_f32(0.0f);
+  for (; i + 8 <= dim; i += 8) {
+    float32x4_t d0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+    float32x4_t d1 = vsubq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    acc0 = vfmaq_f32(acc0, d0, d0);
+    acc1 = vfmaq_f32(acc1, d1, d1);
+  }
+  for (; i + 4 <= dim; i += 4) {
+    float32x4_t d0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+    acc0 = vfmaq_f32(acc0, d0, d0);
+  }
+  sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+#endif
+  for (; i < dim; ++i) {
+    float d = a[i] - b[i];
+    sum += d * d;
+  }
+  return sum;
+}
+
+// Portable draws from the engine: std:: distributions differ between standard libraries, and
+// cluster ids should not depend on the platform a model was trained on.
+std::size_t randomIndex(std::mt19937_64 &rng, std::size_t bound) { return static_cast<std::size_t>(rng() % bound); }
+double randomUnit(std::mt19937_64 &rng) { return static_cast<double>(rng() >> 11) * (1.0 / 9007199254740992.0); }
+
+float squaredNorm(const float *a, std::size_t dim) {
+  float sum = 0.0f;
+  for (std::size_t d = 0; d < dim; ++d) {
+    sum += a[d] * a[d];
+  }
+  return sum;
+}
+
+// How embedding rows are stored (--embedding-storage). Dense keeps dim floats per row; Int8 keeps
+// dim signed bytes and a per-row scale (value = scale * code); Sparse keeps only the non-zero
+// columns of each row, which after --min-pmi are usually few.
+
+float Embeddings::distance(std::size_t i, const float *point, float pointNorm) const {
+  if (storage == EmbeddingStorage::Dense)
+    return squaredDistance(values.data() + i * dim, point, dim);
+  float sum = 0.0f;
+  if (storage == EmbeddingStorage::Int8) {
+    const std::int8_t *row = codes.data() + i * dim;
+    const float scale = scales[i];
+    for (std::size_t d = 0; d < dim; ++d) {
+      const float diff = scale * static_cast<float>(row[d]) - point[d];
+      sum += diff * diff;
+    }
+    return sum;
+  }
+  sum = pointNorm;
+  for (std::uint64_t k = offsets[i]; k < offsets[i + 1]; ++k) {
+    const float p = point[columns[k]];
+    const float diff = values[k] - p;
+    sum += diff * diff - p * p;
+  }
+  return std::max(0.0f, sum);
+}
+
+// Achlioptas' sparse random projection, vocab x dim: entries are +-sqrt(3 / dim) with probability
+// 1/6 each and 0 otherwise, so projected distances keep their expected value.
+std::vector<float> projectionMatrix(std::size_t vocab, std::size_t dim, std::uint64_t seed) {
+  std::mt19937_64 rng(seed);
+  const float weight = std::sqrt(3.0f / static_cast<float>(dim));
+  std::vector<float> matrix(vocab * dim);
+  for (float &value : matrix) {
+    const std::size_t draw = randomIndex(rng, 6);
+    value = draw == 0 ? weight : draw == 1 ? -weight : 0.0f;
+  }
+  return matrix;
+}
+
+// Token-space vectors (one column per vocab token, e.g. saved centroids) projected like the rows
+// buildEmbeddings projects.
+std::vector<float> projectVectors(const std::vector<float> &vectors, std::size_t vocab, const EmbeddingFormat &format) {
+  if (format.projection == 0 || vocab == 0)
+    return vectors;
+  const std::vector<float> matrix = projectionMatrix(vocab, format.projection, format.seed);
+  const std::size_t count = vectors.size() / vocab;
+  std::vector<float> projected(count * format.projection, 0.0f);
+  for (std::size_t v = 0; v < count; ++v) {
+    float *out = projected.data() + v * format.projection;
+    for (std::size_t col = 0; col < vocab; ++col) {
+      const float value = vectors[v * vocab + col];
+      if (value == 0.0f)
+        continue;
+      for (std::size_t d = 0; d < format.projection; ++d) {
+        out[d] += value * matrix[col * format.projection + d];
+      }
+    }
+  }
+  return projected;
+}
+
+// With `only` (by phrase id), rows are built just for the flagged phrases.
+Embeddings buildEmbeddings(const CorpusStats &corpus, const std::vector<std::uint32_t> &vocab, std::uint64_t minCount,
+                           double minPmi, std::size_t threads, const EmbeddingFormat &format,
+                           const std::vector<std::uint8_t> *only) {
+  Embeddings embeddings;
+  if (vocab.empty())
+    return embeddings;
+  const bool projected = format.projection > 0;
+  embeddings.dim = projected ? format.projection : vocab.size();
+  embeddings.storage = format.storage;
+  std::vector<int> column(corpus.tokens.size(), -1);
+  for (std::size_t i = 0; i < vocab.size(); ++i) {
+    column[vocab[i]] = static_cast<int>(i);
+  }
+  for (std::uint32_t phrase = 0; phrase < corpus.stats.size(); ++phrase) {
+    if (corpus.stats[phrase].count >= minCount && (!only || (*only)[phrase]))
+      embeddings.phrases.push_back(phrase);
+  }
+  const std::size_t n = embeddings.phrases.size();
+  const std::size_t dim = embeddings.dim;
+  const std::vector<float> matrix = projected ? projectionMatrix(vocab.size(), dim, format.seed) : std::vector<float>{};
+
+  // A row's non-zero token columns, ascending.
+  auto features = [&](std::size_t row, std::vector<std::pair<std::uint32_t, float>> &out) {
+    const auto &stat = corpus.stats[embeddings.phrases[row]];
+    out.clear();
+    for (const auto &entry : stat.tokenCounts.entries) {
+      int col = column[entry.first];
+      if (col < 0)
+        continue;
+      double value = tokenPmi(stat, entry, corpus.totals);
+      if (value >= minPmi && value != 0.0)
+        out.push_back({static_cast<std::uint32_t>(col), static_cast<float>(value)});
+    }
+    std::sort(out.begin(), out.end());
+  };
+  // The row as `dim` floats: its features scattered, or their projection.
+  auto denseRow = [&](const std::vector<std::pair<std::uint32_t, float>> &row, float *out) {
+    std::fill(out, out + dim, 0.0f);
+    for (const auto &feature : row) {
+      if (!projected) {
+        out[feature.first] = feature.second;
+        continue;
+      }
+      const float *weights = matrix.data() + static_cast<std::size_t>(feature.first) * dim;
+      for (std::size_t d = 0; d < dim; ++d) {
+        out[d] += feature.second * weights[d];
+      }
+    }
+  };
+
+  std::vector<std::vector<std::pair<std::uint32_t, float>>> scratch(std::max<std::size_t>(1, threads));
+  if (format.storage == EmbeddingStorage::Dense) {
+    embeddings.values.assign(n * dim, 0.0f);
+    parallelFor(n, threads, [&](std::size_t worker, std::size_t row) {
+      features(row, scratch[worker]);
+      denseRow(scratch[worker], embeddings.values.data() + row * dim);
+    });
+  } else if (format.storage == EmbeddingStorage::Int8) {
+    embeddings.codes.assign(n * dim, 0);
+    embeddings.scales.assign(n, 0.0f);
+    std::vector<std::vector<float>> rows(scratch.size(), std::vector<float>(dim));
+    parallelFor(n, threads, [&](std::size_t worker, std::size_t row) {
+      features(row, scratch[worker]);
+      float *values = rows[worker].data();
+      denseRow(scratch[worker], values);
+      float peak = 0.0f;
+      for (std::size_t d = 0; d < dim; ++d) {
+        peak = std::max(peak, std::fabs(values[d]));
+      }
+      const float scale = peak / 127.0f;
+      embeddings.scales[row] = scale;
+      if (scale == 0.0f)
+        return;
+      for (std::size_t d = 0; d < dim; ++d) {
+        embeddings.codes[row * dim + d] = static_cast<std::int8_t>(std::lround(values[d] / scale));
+      }
+    });
+  } else {
+    std::vector<std::vector<std::pair<std::uint32_t, float>>> rows(n);
+    parallelFor(n, threads, [&](std::size_t, std::size_t row) { features(row, rows[row]); });
+    embeddings.offsets.reserve(n + 1);
+    embeddings.offsets.push_back(0);
+    for (auto &row : rows) {
+      for (const auto &feature : row) {
+        embeddings.columns.push_back(feature.first);
+        embeddings.values.push_back(feature.second);
+      }
+      embeddings.offsets.push_back(embeddings.columns.size());
+      row = {};
+    }
+  }
+  return embeddings;
+}
+
+// k-means++: each new centroid is a point drawn with probability proportional to its squared
+// distance from the nearest centroid chosen so far.
+std::vector<float> seedCentroids(const Embeddings &embeddings, std::size_t clusterCount, std::mt19937_64 &rng,
+                                 std::size_t threads) {
+  const std::size_t n = embeddings.size();
+  const std::size_t dim = embeddings.dim;
+  std::vector<float> centroids(clusterCount * dim);
+  std::vector<float> nearest(n, std::numeric_limits<float>::max());
+  std::size_t chosen = randomIndex(rng, n);
+  for (std::size_t c = 0;; ++c) {
+    embeddings.decode(chosen, centroids.data() + c * dim);
+    if (c + 1 == clusterCount)
+      break;
+    const float *centroid = centroids.data() + c * dim;
+    const float norm = squaredNorm(centroid, dim);
+    parallelFor(n, threads, [&](std::size_t, std::size_t i) {
+      nearest[i] = std::min(nearest[i], embeddings.distance(i, centroid, norm));
+    });
+    double total = 0.0;
+    for (float d : nearest) {
+      total += d;
+    }
+    if (total <= 0.0) {
+      chosen = randomIndex(rng, n);
+      continue;
+    }
+    double target = randomUnit(rng) * total;
+    chosen = n - 1;
+    for (std::size_t i = 0; i < n; ++i) {
+      target -= nearest[i];
+      if (target < 0.0) {
+        chosen = i;
+        break;
+      }
+    }
+  }
+  return centroids;
+}
+
+// Upper limit on per-point, per-centroid lower bounds (Elkan); beyond it runKMeans keeps one
+// lower bound per point (Hamerly).
+constexpr std::size_t ELKAN_MAX_BOUNDS = std::size_t{1} << 26;
+
+// Lloyd's k-means that uses the triangle inequality to skip distance evaluations. Each point keeps
+// an upper bound on the distance to its centroid and lower bounds on the distance to the others:
+// one per centroid (Elkan) while n * k fits ELKAN_MAX_BOUNDS, otherwise a single bound on the
+// nearest other centroid (Hamerly). Centroids closer than twice the upper bound's slack are never
+// evaluated. Assignment runs on `threads` workers; centroid sums are split by dimension so they
+// are added in point order whatever the thread count. Non-empty `initial` centroids replace k-means++.
+KMeansResult runKMeans(const Embeddings &embeddings, std::size_t clusterCount, std::size_t iterations,
+                       std::uint64_t seed, std::size_t threads, std::vector<float> initial = {}) {
+  KMeansResult result;
+  const std::size_t n = embeddings.size();
+  const std::size_t dim = embeddings.dim;
+  if (clusterCount == 0 || n < clusterCount || dim == 0)
+    return result;
+  const float infinity = std::numeric_limits<float>::infinity();
+  std::mt19937_64 rng(seed);
+  const bool seeded = initial.empty();
+  std::vector<float> centroids = seeded ? seedCentroids(embeddings, clusterCount, rng, threads) : std::move(initial);
+  auto centroid = [&](std::size_t c) { return centroids.data() + c * dim; };
+  std::vector<float> norms(clusterCount);
+  for (std::size_t c = 0; c < clusterCount; ++c) {
+    norms[c] = squaredNorm(centroid(c), dim);
+  }
+  std::vector<WorkerCount> evaluations(std::max<std::size_t>(1, threads));
+  auto distance = [&](std::size_t i, std::size_t c, std::size_t worker) {
+    evaluations[worker].value += 1;
+    return std::sqrt(embeddings.distance(i, centroid(c), norms[c]));
+  };
+
+  const bool elkan = n * clusterCount <= ELKAN_MAX_BOUNDS;
+  std::vector<int> assignments(n, -1);
+  std::vector<float> upper(n, infinity);
+  std::vector<float> lower(elkan ? n * clusterCount : n, 0.0f);
+  std::vector<float> centerDistance(clusterCount * clusterCount);
+  std::vector<float> halfGap(clusterCount);
+  std::vector<float> moved(clusterCount);
+  std::vector<double> sums(clusterCount * dim);
+  std::vector<std::size_t> counts(clusterCount);
+  std::vector<float> previous;
+  std::vector<std::uint8_t> changed(std::max<std::size_t>(1, threads));
+
+  // First pass (or a point whose bounds are useless): evaluate every centroid.
+  auto assignFully = [&](std::size_t i, std::size_t worker) {
+    float best = infinity;
+    float second = infinity;
+    int bestCluster = 0;
+    for (std::size_t c = 0; c < clusterCount; ++c) {
+      float d = distance(i, c, worker);
+      if (elkan)
+        lower[i * clusterCount + c] = d;
+      if (d < best) {
+        second = best;
+        best = d;
+        bestCluster = static_cast<int>(c);
+      } else if (d < second) {
+        second = d;
+      }
+    }
+    upper[i] = best;
+    if (!elkan)
+      lower[i] = second;
+    return bestCluster;
+  };
+
+  auto assignHamerly = [&](std::size_t i, std::size_t current, std::size_t worker) {
+    float bound = std::max(halfGap[current], lower[i]);
+    if (upper[i] <= bound)
+      return static_cast<int>(current);
+    upper[i] = distance(i, current, worker);
+    if (upper[i] <= bound)
+      return static_cast<int>(current);
+    return assignFully(i, worker);
+  };
+
+  auto assignElkan = [&](std::size_t i, std::size_t current, std::size_t worker) {
+    if (upper[i] <= halfGap[current])
+      return static_cast<int>(current);
+    float *bounds = lower.data() + i * clusterCount;
+    bool tight = false;
+    for (std::size_t c = 0; c < clusterCount; ++c) {
+      if (c == current || upper[i] <= bounds[c] || upper[i] <= 0.5f * centerDistance[current * clusterCount + c])
+        continue;
+      if (!tight) {
+        upper[i] = bounds[current] = distance(i, current, worker);
+        tight = true;
+        if (upper[i] <= bounds[c] || upper[i] <= 0.5f * centerDistance[current * clusterCount + c])
+          continue;
+      }
+      float d = bounds[c] = distance(i, c, worker);
+      if (d < upper[i]) {
+        current = c;
+        upper[i] = d;
+      }
+    }
+    return static_cast<int>(current);
+  };
+
+  for (std::size_t iter = 0; iter < iterations; ++iter) {
+    parallelFor(clusterCount, threads, [&](std::size_t worker, std::size_t c) {
+      evaluations[worker].value += clusterCount - 1;
+      float gap = infinity;
+      for (std::size_t other = 0; other < clusterCount; ++other) {
+        float d = other == c ? 0.0f : std::sqrt(squaredDistance(centroid(c), centroid(other), dim));
+        centerDistance[c * clusterCount + other] = d;
+        if (other != c)
+          gap = std::min(gap, d);
+      }
+      halfGap[c] = 0.5f * gap;
+    });
+
+    std::fill(changed.begin(), changed.end(), 0);
+    parallelFor(n, threads, [&](std::size_t worker, std::size_t i) {
+      int current = assignments[i];
+      int next = current < 0                ? assignFully(i, worker)
+                 : elkan                    ? assignElkan(i, static_cast<std::size_t>(current), worker)
+                                            : assignHamerly(i, static_cast<std::size_t>(current), worker);
+      if (next != current) {
+        assignments[i] = next;
+        changed[worker] = 1;
+      }
+    });
+    if (std::find(changed.begin(), changed.end(), 1) == changed.end())
+      break;
+
+    std::fill(counts.begin(), counts.end(), 0);
+    for (int cluster : assignments) {
+      counts[static_cast<std::size_t>(cluster)] += 1;
+    }
+    constexpr std::size_t SLICE = 16;
+    parallelFor((dim + SLICE - 1) / SLICE, threads, [&](std::size_t, std::size_t slice) {
+      const std::size_t begin = slice * SLICE;
+      const std::size_t end = std::min(dim, begin + SLICE);
+      for (std::size_t c = 0; c < clusterCount; ++c) {
+        std::fill(sums.begin() + static_cast<std::ptrdiff_t>(c * dim + begin),
+                  sums.begin() + static_cast<std::ptrdiff_t>(c * dim + end), 0.0);
+      }
+      for (std::size_t i = 0; i < n; ++i) {
+        embeddings.accumulate(i, sums.data() + static_cast<std::size_t>(assignments[i]) * dim, begin, end);
+      }
+    });
+
+    previous = centroids;
+    for (std::size_t c = 0; c < clusterCount; ++c) {
+      float *target = centroid(c);
+      if (counts[c] == 0) {
+        embeddings.decode(randomIndex(rng, n), target);
+      } else {
+        double inv = 1.0 / static_cast<double>(counts[c]);
+        for (std::size_t d = 0; d < dim; ++d) {
+          target[d] = static_cast<float>(sums[c * dim + d] * inv);
+        }
+      }
+      moved[c] = std::sqrt(squaredDistance(previous.data() + c * dim, target, dim));
+      norms[c] = squaredNorm(target, dim);
+    }
+
+    std::size_t farthest = 0;
+    for (std::size_t c = 1; c < clusterCount; ++c) {
+      if (moved[c] > moved[farthest])
+        farthest = c;
+    }
+    float secondFarthest = 0.0f;
+    for (std::size_t c = 0; c < clusterCount; ++c) {
+      if (c != farthest)
+        secondFarthest = std::max(secondFarthest, moved[c]);
+    }
+    parallelFor(n, threads, [&](std::size_t, std::size_t i) {
+      std::size_t cluster = static_cast<std::size_t>(assignments[i]);
+      upper[i] += moved[cluster];
+      if (elkan) {
+        float *bounds = lower.data() + i * clusterCount;
+        for (std::size_t c = 0; c < clusterCount; ++c) {
+          bounds[c] = std::max(0.0f, bounds[c] - moved[c]);
+        }
+      } else {
+        lower[i] -= cluster == farthest ? secondFarthest : moved[farthest];
+      }
+    });
+  }
+
+  result.valid = true;
+  result.dim = dim;
+  result.assignments = std::move(assignments);
+  result.centroids = std::move(centroids);
+  result.phrases = embeddings.phrases;
+  result.distanceEvaluations = seeded ? (clusterCount - 1) * n : 0;
+  for (const auto &count : evaluations) {
+    result.distanceEvaluations += count.value;
+  }
+  return result;
+}
+
+// Previous centroids re-expressed over the current embedding columns: columns are matched by token
+// and tokens new to the vocabulary start at zero. Empty when the cluster count has changed.
+std::vector<float> warmStartCentroids(const ClusterCentroids &previous, const std::vector<std::uint32_t> &vocab,
+                                      std::size_t clusterCount) {
+  std::vector<float> centroids;
+  if (clusterCount == 0 || vocab.empty() || previous.clusterCount() != clusterCount)
+    return centroids;
+  const std::size_t dim = vocab.size();
+  const std::size_t previousDim = previous.tokens.size();
+  std::unordered_map<std::uint32_t, std::size_t> previousColumn;
+  for (std::size_t i = 0; i < previousDim; ++i) {
+    previousColumn.emplace(previous.tokens[i], i);
+  }
+  centroids.assign(clusterCount * dim, 0.0f);
+  for (std::size_t col = 0; col < dim; ++col) {
+    auto it = previousColumn.find(vocab[col]);
+    if (it == previousColumn.end())
+      continue;
+    for (std::size_t c = 0; c < clusterCount; ++c) {
+      centroids[c * dim + col] = previous.values[c * previousDim + it->second];
+    }
+  }
+  return centroids;
+}
+
+int nearestCentroid(const Embeddings &embeddings, std::size_t i, const std::vector<float> &centroids,
+                    const std::vector<float> &norms) {
+  const std::size_t dim = embeddings.dim;
+  int best = 0;
+  float bestDistance = std::numeric_limits<float>::infinity();
+  for (std::size_t c = 0; c < norms.size(); ++c) {
+    float d = embeddings.distance(i, centroids.data() + c * dim, norms[c]);
+    if (d < bestDistance) {
+      bestDistance = d;
+      best = static_cast<int>(c);
+    }
+  }
+  return best;
+}
+
+// Mini-batch k-means (Sculley, 2010): each of `iterations` steps assigns `batchSize` randomly drawn
+// points and moves their centroids toward them with a per-centroid learning rate of 1 / (points
+// seen), so the cost per step does not grow with the phrase table. Seeding runs k-means++ on a
+// sample unless `initial` centroids are given; warm-started centroids are treated as having already
+// absorbed one batch so the first steps refine them instead of replacing them. Every point is
+// assigned once at the end.
+KMeansResult runMiniBatchKMeans(const Embeddings &embeddings, std::size_t clusterCount, std::size_t iterations,
+                                std::size_t batchSize, std::uint64_t seed, std::size_t threads,
+                                std::vector<float> initial = {}) {
+  KMeansResult result;
+  const std::size_t n = embeddings.size();
+  const std::size_t dim = embeddings.dim;
+  if (clusterCount == 0 || n < clusterCount || dim == 0)
+    return result;
+  std::mt19937_64 rng(seed);
+  std::vector<double> seen(clusterCount, 0.0);
+  std::vector<float> centroids = std::move(initial);
+  if (centroids.empty()) {
+    const std::size_t sampleSize = std::min(n, std::max<std::size_t>({batchSize, clusterCount * 16, 16384}));
+    result.distanceEvaluations += (clusterCount - 1) * sampleSize;
+    if (sampleSize == n) {
+      centroids = seedCentroids(embeddings, clusterCount, rng, threads);
+    } else {
+      Embeddings sample;
+      sample.dim = dim;
+      sample.values.resize(sampleSize * dim);
+      for (std::size_t s = 0; s < sampleSize; ++s) {
+        std::size_t i = randomIndex(rng, n);
+        embeddings.decode(i, sample.values.data() + s * dim);
+        sample.phrases.push_back(embeddings.phrases[i]);
+      }
+      centroids = seedCentroids(sample, clusterCount, rng, threads);
+    }
+  } else {
+    std::fill(seen.begin(), seen.end(), std::max(1.0, static_cast<double>(batchSize) / static_cast<double>(clusterCount)));
+  }
+
+  const std::size_t batch = std::min(batchSize, n);
+  result.distanceEvaluations += (iterations * batch + n) * clusterCount;
+  std::vector<std::size_t> picks(batch);
+  std::vector<int> nearest(batch);
+  std::vector<float> norms(clusterCount);
+  for (std::size_t c = 0; c < clusterCount; ++c) {
+    norms[c] = squaredNorm(centroids.data() + c * dim, dim);
+  }
+  std::vector<float> point(dim);
+  for (std::size_t iter = 0; iter < iterations; ++iter) {
+    for (auto &pick : picks) {
+      pick = randomIndex(rng, n);
+    }
+    parallelFor(batch, threads, [&](std::size_t, std::size_t b) {
+      nearest[b] = nearestCentroid(embeddings, picks[b], centroids, norms);
+    });
+    for (std::size_t b = 0; b < batch; ++b) {
+      const std::size_t c = static_cast<std::size_t>(nearest[b]);
+      seen[c] += 1.0;
+      const float eta = static_cast<float>(1.0 / seen[c]);
+      float *target = centroids.data() + c * dim;
+      embeddings.decode(picks[b], point.data());
+      for (std::size_t d = 0; d < dim; ++d) {
+        target[d] += eta * (point[d] - target[d]);
+      }
+      norms[c] = squaredNorm(target, dim);
+    }
+  }
+
+  result.assignments.resize(n);
+  parallelFor(n, threads, [&](std::size_t, std::size_t i) {
+    result.assignments[i] = nearestCentroid(embeddings, i, centroids, norms);
+  });
+  result.valid = true;
+  result.dim = dim;
+  result.centroids = std::move(centroids);
+  result.phrases = embeddings.phrases;
+  return result;
+}
+
+float AnnIndex::distance(const float *query, std::uint32_t node) const {
+  return squaredDistance(query, vector(node), dim);
+}
+
+using AnnCandidate = std::pair<float, std::uint32_t>; // (squared distance, node)
+
+// Per-worker search state; `visited` holds the epoch in which each node was last reached.
+struct AnnScratch {
+  std::vector<std::uint32_t> visited;
+  std::uint32_t epoch = 0;
+  std::vector<AnnCandidate> frontier; // min-heap on distance
+  std::vector<AnnCandidate> nearest;  // max-heap on distance, at most ef entries
+};
+
+// Greedy descent: the node closest to `query` reachable from `entry` on `level`.
+std::uint32_t annGreedy(const AnnIndex &index, const float *query, std::uint32_t entry, int level) {
+  float best = index.distance(query, entry);
+  for (bool improved = true; improved;) {
+    improved = false;
+    const std::uint32_t *list = index.links(entry, level);
+    for (std::uint32_t i = 1; i <= list[0]; ++i) {
+      float d = index.distance(query, list[i]);
+      if (d < best) {
+        best = d;
+        entry = list[i];
+        improved = true;
+      }
+    }
+  }
+  return entry;
+}
+
+// Best-first search of one level keeping the `ef` closest nodes; returns them closest first.
+std::vector<AnnCandidate> annSearchLevel(const AnnIndex &index, const float *query, std::uint32_t entry, int level,
+                                         std::size_t ef, AnnScratch &scratch) {
+  if (scratch.visited.size() < index.size())
+    scratch.visited.resize(index.size(), 0);
+  if (++scratch.epoch == 0) {
+    std::fill(scratch.visited.begin(), scratch.visited.end(), 0);
+    scratch.epoch = 1;
+  }
+  auto closer = [](const AnnCandidate &a, const AnnCandidate &b) { return a > b; };
+  auto &frontier = scratch.frontier;
+  auto &nearest = scratch.nearest;
+  frontier.clear();
+  nearest.clear();
+  AnnCandidate start{index.distance(query, entry), entry};
+  scratch.visited[entry] = scratch.epoch;
+  frontier.push_back(start);
+  nearest.push_back(start);
+  while (!frontier.empty()) {
+    std::pop_heap(frontier.begin(), frontier.end(), closer);
+    AnnCandidate current = frontier.back();
+    frontier.pop_back();
+    if (current.first > nearest.front().first && nearest.size() >= ef)
+      break;
+    const std::uint32_t *list = index.links(current.second, level);
+    for (std::uint32_t i = 1; i <= list[0]; ++i) {
+      std::uint32_t node = list[i];
+      if (scratch.visited[node] == scratch.epoch)
+        continue;
+      scratch.visited[node] = scratch.epoch;
+      float d = index.distance(query, node);
+      if (nearest.size() < ef || d < nearest.front().first) {
+        frontier.push_back({d, node});
+        std::push_heap(frontier.begin(), frontier.end(), closer);
+        nearest.push_back({d, node});
+        std::push_heap(nearest.begin(), nearest.end());
+        if (nearest.size() > ef) {
+          std::pop_heap(nearest.begin(), nearest.end());
+          nearest.pop_back();
+        }
+      }
+    }
+  }
+  std::vector<AnnCandidate> found(nearest.begin(), nearest.end());
+  std::sort(found.begin(), found.end());
+  return found;
+}
+
+// Neighbour selection heuristic: a candidate (closest first) is kept only if it is closer to the
+// base node than to every neighbour already kept, which spreads links across directions.
+void annSelectLinks(const AnnIndex &index, const std::vector<AnnCandidate> &candidates, std::size_t limit,
+                    std::uint32_t *list) {
+  list[0] = 0;
+  for (const auto &candidate : candidates) {
+    if (list[0] == limit)
+      break;
+    const float *point = index.vector(candidate.second);
+    bool diverse = true;
+    for (std::uint32_t i = 1; i <= list[0] && diverse; ++i) {
+      diverse = index.distance(point, list[i]) >= candidate.first;
+    }
+    if (diverse)
+      list[++list[0]] = candidate.second;
+  }
+}
+
+// Builds the graph over the non-zero embedding rows. Nodes are inserted in batches that grow with
+// the graph: each batch searches the graph as it stood before the batch on `threads` workers, then
+// its links are applied in node order, so the index does not depend on the thread count.
+AnnIndex buildAnnIndex(const Embeddings &embeddings, std::size_t ef, std::uint64_t seed, std::size_t threads) {
+  AnnIndex index;
+  index.dim = embeddings.dim;
+  std::vector<float> row(index.dim);
+  for (std::size_t i = 0; i < embeddings.size(); ++i) {
+    embeddings.decode(i, row.data());
+    float norm = 0.0f;
+    for (std::size_t d = 0; d < index.dim; ++d) {
+      norm += row[d] * row[d];
+    }
+    norm = std::sqrt(norm);
+    if (!(norm > 0.0f))
+      continue;
+    for (std::size_t d = 0; d < index.dim; ++d) {
+      index.vectors.push_back(row[d] / norm);
+    }
+    index.phrases.push_back(embeddings.phrases[i]);
+  }
+  const std::size_t n = index.size();
+  if (n == 0)
+    return index;
+
+  std::mt19937_64 rng(seed);
+  const double levelScale = 1.0 / std::log(static_cast<double>(ANN_LINKS));
+  index.levels.resize(n);
+  index.upperLinks.resize(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    double draw = -std::log(std::max(randomUnit(rng), 1e-12)) * levelScale;
+    index.levels[i] = static_cast<std::uint8_t>(std::min(draw, 32.0));
+    index.upperLinks[i].assign(index.levels[i] * (ANN_LINKS + 1), 0);
+  }
+  index.baseLinks.assign(n * (ANN_BASE_LINKS + 1), 0);
+  index.entryPoint = 0;
+  index.maxLevel = index.levels[0];
+
+  // Per batch node and level: candidates found by search, then the chosen links.
+  std::vector<std::vector<std::vector<AnnCandidate>>> found;
+  std::vector<AnnScratch> scratch(std::max<std::size_t>(1, threads));
+  std::vector<AnnCandidate> merged;
+  for (std::size_t begin = 1; begin < n;) {
+    const std::size_t end = std::min(n, begin + std::max<std::size_t>(1, begin / 16));
+    found.assign(end - begin, {});
+    parallelFor(end - begin, threads, [&](std::size_t worker, std::size_t b) {
+      const std::uint32_t node = static_cast<std::uint32_t>(begin + b);
+      const float *query = index.vector(node);
+      const int top = std::min<int>(index.levels[node], index.maxLevel);
+      std::uint32_t entry = index.entryPoint;
+      for (int level = index.maxLevel; level > top; --level) {
+        entry = annGreedy(index, query, entry, level);
+      }
+      found[b].resize(static_cast<std::size_t>(top) + 1);
+      for (int level = top; level >= 0; --level) {
+        found[b][static_cast<std::size_t>(level)] = annSearchLevel(index, query, entry, level, ef, scratch[worker]);
+        entry = found[b][static_cast<std::size_t>(level)].front().second;
+      }
+    });
+    for (std::size_t b = 0; b < end - begin; ++b) {
+      const std::uint32_t node = static_cast<std::uint32_t>(begin + b);
+      for (int level = 0; level < static_cast<int>(found[b].size()); ++level) {
+        const std::size_t limit = level == 0 ? ANN_BASE_LINKS : ANN_LINKS;
+        std::uint32_t *list = index.links(node, level);
+        annSelectLinks(index, found[b][static_cast<std::size_t>(level)], limit, list);
+        for (std::uint32_t i = 1; i <= list[0]; ++i) {
+          const std::uint32_t other = list[i];
+          std::uint32_t *back = index.links(other, level);
+          if (back[0] < limit) {
+            back[++back[0]] = node;
+            continue;
+          }
+          const float *point = index.vector(other);
+          merged.clear();
+          merged.push_back({index.distance(point, node), node});
+          for (std::uint32_t j = 1; j <= back[0]; ++j) {
+            merged.push_back({index.distance(point, back[j]), back[j]});
+          }
+          std::sort(merged.begin(), merged.end());
+          annSelectLinks(index, merged, limit, back);
+        }
+      }
+      if (index.levels[node] > index.maxLevel) {
+        index.maxLevel = index.levels[node];
+        index.entryPoint = node;
+      }
+    }
+    begin = end;
+  }
+  return index;
+}
+
+// The `limit` nearest other nodes of `node` as (phrase id, cosine similarity), most similar first.
+RelatedList annNeighbors(const AnnIndex &index, std::uint32_t node, std::size_t limit, std::size_t ef,
+                         AnnScratch &scratch) {
+  const float *query = index.vector(node);
+  std::uint32_t entry = index.entryPoint;
+  for (int level = index.maxLevel; level > 0; --level) {
+    entry = annGreedy(index, query, entry, level);
+  }
+  RelatedList neighbors;
+  for (const auto &candidate : annSearchLevel(index, query, entry, 0, std::max(ef, limit + 1), scratch)) {
+    if (candidate.second == node)
+      continue;
+    neighbors.push_back({index.phrases[candidate.second], 1.0 - 0.5 * static_cast<double>(candidate.first)});
+    if (neighbors.size() == limit)
+      break;
+  }
+  return neighbors;
+}
+
+// Read-only memory mapping of an input file; empty files map to an empty view.
+struct MappedFile {
+  MappedFile(const std::string &path, const std::string &what) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open " + what + ": " + path);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Failed to stat " + what + ": " + path);
+    }
+    size = static_cast<std::size_t>(info.st_size);
+    if (size > 0) {
+      void *mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("Failed to map " + what + ": " + path);
+      }
+      ::madvise(mapped, size, MADV_SEQUENTIAL);
+      data = static_cast<const char *>(mapped);
+    }
+    ::close(fd);
+  }
+  ~MappedFile() {
+    if (data)
+      ::munmap(const_cast<char *>(data), size);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  std::string_view view() const { return data ? std::string_view(data, size) : std::string_view(); }
+
+  // Drops the pages wholly before `end` from memory; they are read back from the file if touched.
+  void release(std::size_t end) const {
+    const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    const std::size_t length = std::min(end, size) / page * page;
+    if (data && length > 0)
+      ::madvise(const_cast<char *>(data), length, MADV_DONTNEED);
+  }
+
+  const char *data = nullptr;
+  std::size_t size = 0;
+};
+
+enum class InputCodec { Plain, Gzip, Zstd };
+
+InputCodec inputCodec(const unsigned char *magic, std::size_t size) {
+  if (size >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+    return InputCodec::Gzip;
+  if (size >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+    return InputCodec::Zstd;
+  return InputCodec::Plain;
+}
+
+// Reads an input that cannot be mapped (a gzip or zstd file, stdin or a pipe) on its own thread,
+// decompressing by magic bytes. Decoded chunks wait in a queue of at most `queueChunks`, so the
+// decoder runs ahead of the parser by a bounded amount. Decoder errors are rethrown by next().
+struct InputStream {
+  static constexpr std::size_t CHUNK_BYTES = 4 << 20;
+
+  InputStream(int fd, std::string name, std::size_t queueChunks)
+      : fd(fd), name(std::move(name)), queueChunks(std::max<std::size_t>(2, queueChunks)) {
+    reader = std::thread([this]() { run(); });
+  }
+  ~InputStream() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    ready.notify_all();
+    reader.join();
+    if (fd != STDIN_FILENO)
+      ::close(fd);
+  }
+  InputStream(const InputStream &) = delete;
+  InputStream &operator=(const InputStream &) = delete;
+
+  // Moves the next decoded chunk into `chunk`; false at the end of the input.
+  bool next(std::string &chunk) {
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [&]() { return !queue.empty() || done; });
+    if (queue.empty()) {
+      if (error)
+        std::rethrow_exception(error);
+      return false;
+    }
+    chunk = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+    ready.notify_all();
+    return true;
+  }
+
+  void run() {
+    try {
+      decode();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      error = std::current_exception();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+    }
+    ready.notify_all();
+  }
+
+  // Queues out[0, used) and starts a fresh chunk; false once the stream is being torn down.
+  bool emit(std::string &out, std::size_t &used) {
+    out.resize(used);
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready.wait(lock, [&]() { return queue.size() < queueChunks || stopping; });
+      if (stopping)
+        return false;
+      queue.push_back(std::move(out));
+    }
+    ready.notify_all();
+    out.assign(CHUNK_BYTES, '\0');
+    used = 0;
+    return true;
+  }
+
+  std::size_t readRaw(char *buffer, std::size_t size) {
+    for (;;) {
+      const ssize_t n = ::read(fd, buffer, size);
+      if (n >= 0)
+        return static_cast<std::size_t>(n);
+      if (errno != EINTR)
+        throw std::runtime_error("Failed to read input TSV: " + name);
+    }
+  }
+
+  void decode() {
+    std::vector<char> raw(1 << 20);
+    std::size_t rawSize = 0;
+    for (std::size_t n = 1; rawSize < 4 && n > 0; rawSize += n)
+      n = readRaw(raw.data() + rawSize, raw.size() - rawSize);
+    std::string out(CHUNK_BYTES, '\0');
+    std::size_t used = 0;
+    switch (inputCodec(reinterpret_cast<const unsigned char *>(raw.data()), rawSize)) {
+    case InputCodec::Plain:
+      std::memcpy(&out[0], raw.data(), rawSize);
+      used = rawSize;
+      for (std::size_t n = rawSize; n > 0; used += n) {
+        if (used == out.size() && !emit(out, used))
+          return;
+        n = readRaw(&out[used], out.size() - used);
+      }
+      break;
+    case InputCodec::Gzip:
+      if (!inflateInput(raw, rawSize, out, used))
+        return;
+      break;
+    case InputCodec::Zstd:
+      if (!zstdInput(raw, rawSize, out, used))
+        return;
+      break;
+    }
+    if (used > 0)
+      emit(out, used);
+  }
+
+  // Both decoders only read more input once a call leaves room in `out`, i.e. has nothing buffered.
+  bool inflateInput(std::vector<char> &raw, std::size_t rawSize, std::string &out, std::size_t &used) {
+#if defined(SLANG_TRAINER_HAVE_ZLIB)
+    struct Inflater {
+      z_stream stream{};
+      ~Inflater() { inflateEnd(&stream); }
+    } inflater;
+    z_stream &z = inflater.stream;
+    if (inflateInit2(&z, 15 + 16) != Z_OK)
+      throw std::runtime_error("Failed to start gzip decoder for input TSV: " + name);
+    z.next_in = reinterpret_cast<Bytef *>(raw.data());
+    z.avail_in = static_cast<uInt>(rawSize);
+    bool inMember = true;
+    bool drained = true;
+    for (;;) {
+      if (z.avail_in == 0 && drained) {
+        rawSize = readRaw(raw.data(), raw.size());
+        if (rawSize == 0)
+          break;
+        z.next_in = reinterpret_cast<Bytef *>(raw.data());
+        z.avail_in = static_cast<uInt>(rawSize);
+      }
+      if (!inMember) {
+        // Concatenated members (cat a.gz b.gz, pigz) decode as one stream.
+        inflateReset(&z);
+        inMember = true;
+      }
+      z.next_out = reinterpret_cast<Bytef *>(&out[used]);
+      z.avail_out = static_cast<uInt>(out.size() - used);
+      const int rc = inflate(&z, Z_NO_FLUSH);
+      used = out.size() - z.avail_out;
+      drained = z.avail_out > 0 || rc == Z_STREAM_END;
+      if (rc == Z_STREAM_END) {
+        inMember = false;
+      } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+        throw std::runtime_error("Corrupt gzip input TSV: " + name);
+      }
+      if (used == out.size() && !emit(out, used))
+        return false;
+    }
+    if (inMember)
+      throw std::runtime_error("Truncated gzip input TSV: " + name);
+    return true;
+#else
+    (void)raw, (void)rawSize, (void)out, (void)used;
+    throw std::runtime_error("slang_trainer was built without gzip support (zlib): " + name);
+#endif
+  }
+
+  bool zstdInput(std::vector<char> &raw, std::size_t rawSize, std::string &out, std::size_t &used) {
+#if defined(SLANG_TRAINER_HAVE_ZSTD)
+    std::unique_ptr<ZSTD_DCtx, std::size_t (*)(ZSTD_DCtx *)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+    if (!context)
+      throw std::runtime_error("Failed to start zstd decoder for input TSV: " + name);
+    ZSTD_inBuffer in{raw.data(), rawSize, 0};
+    std::size_t frameLeft = 0; // 0 once the last frame is complete
+    bool drained = true;
+    for (;;) {
+      if (in.pos == in.size && drained) {
+        rawSize = readRaw(raw.data(), raw.size());
+        if (rawSize == 0)
+          break;
+        in = {raw.data(), rawSize, 0};
+      }
+      ZSTD_outBuffer output{&out[0], out.size(), used};
+      frameLeft = ZSTD_decompressStream(context.get(), &output, &in);
+      if (ZSTD_isError(frameLeft))
+        throw std::runtime_error("Corrupt zstd input TSV: " + name + " (" + ZSTD_getErrorName(frameLeft) + ")");
+      used = output.pos;
+      drained = output.pos < output.size || frameLeft == 0;
+      if (used == out.size() && !emit(out, used))
+        return false;
+    }
+    if (frameLeft != 0)
+      throw std::runtime_error("Truncated zstd input TSV: " + name);
+    return true;
+#else
+    (void)raw, (void)rawSize, (void)out, (void)used;
+    throw std::runtime_error("slang_trainer was built without zstd support: " + name);
+#endif
+  }
+
+  int fd;
+  std::string name;
+  std::size_t queueChunks;
+  std::mutex mutex;
+  std::condition_variable ready; // signals both a queued chunk and a freed queue slot
+  std::deque<std::string> queue;
+  bool done = false;
+  bool stopping = false;
+  std::exception_ptr error;
+  std::thread reader;
+};
+
+// Opens `path` for InputStream when it cannot be mapped as plain text: "-" (stdin), pipes and other
+// non-regular files, and gzip or zstd files. Returns -1 for a plain regular file.
+int openStreamedInput(const std::string &path) {
+  if (path == "-")
+    return STDIN_FILENO;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open input TSV: " + path);
+  }
+  struct stat info;
+  if (::fstat(fd, &info) != 0) {
+    ::close(fd);
+    throw std::runtime_error("Failed to stat input TSV: " + path);
+  }
+  if (S_ISREG(info.st_mode)) {
+    unsigned char magic[4];
+    const ssize_t n = ::pread(fd, magic, sizeof(magic), 0);
+    if (inputCodec(magic, n > 0 ? static_cast<std::size_t>(n) : 0) == InputCodec::Plain) {
+      ::close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+void loadStateV1(std::istream &in, CorpusStats &corpus) {
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream iss(line);
+    std::string tag;
+    iss >> tag;
+    if (tag == "TOTAL") {
+      iss >> corpus.totals.totalContexts;
+    } else if (tag == "TOKEN_TOTAL") {
+      std::string token;
+      std::uint64_t count;
+      iss >> std::quoted(token) >> count;
+      corpus.totals.tokenTotals[internToken(corpus, token)] = count;
+    } else if (tag == "PHRASE") {
+      std::string phrase;
+      std::uint64_t count;
+      double sum;
+      iss >> std::quoted(phrase) >> count >> sum;
+      PhraseStats &stat = corpus.stats[internPhrase(corpus, phrase)];
+      stat.count = count;
+      stat.scoreSum = scoreSumUnits(sum);
+    } else if (tag == "PHRASE_REGION") {
+      std::string phrase, region;
+      std::uint64_t count;
+      iss >> std::quoted(phrase) >> std::quoted(region) >> count;
+      std::uint32_t phraseId = internPhrase(corpus, phrase);
+      corpus.stats[phraseId].regionCounts.add(corpus.regions.intern(region), count);
+    } else if (tag == "PHRASE_TOKEN") {
+      std::string phrase, token;
+      std::uint64_t count;
+      iss >> std::quoted(phrase) >> std::quoted(token) >> count;
+      std::uint32_t phraseId = internPhrase(corpus, phrase);
+      corpus.stats[phraseId].tokenCounts.add(internToken(corpus, token), count);
+    }
+  }
+  compactAll(corpus);
+}
+
+void saveStateV1(std::ostream &out, const CorpusStats &corpus) {
+  out << "# SlangTrainerState v1\n";
+  out << "TOTAL " << corpus.totals.totalContexts << "\n";
+  for (std::uint32_t token = 0; token < corpus.tokens.size(); ++token) {
+    if (corpus.totals.tokenTotals[token] == 0)
+      continue;
+    out << "TOKEN_TOTAL " << std::quoted(std::string(corpus.tokens.str(token))) << ' '
+        << corpus.totals.tokenTotals[token] << "\n";
+  }
+  for (std::uint32_t id : sortedPhraseIds(corpus)) {
+    const std::string phrase(corpus.phrases.str(id));
+    const auto &stat = corpus.stats[id];
+    out << "PHRASE " << std::quoted(phrase) << ' ' << stat.count << ' ' << std::setprecision(17)
+        << scoreValue(stat.scoreSum) << "\n";
+    for (const auto &region : stat.regionCounts.entries) {
+      out << "PHRASE_REGION " << std::quoted(phrase) << ' ' << std::quoted(std::string(corpus.regions.str(region.first)))
+          << ' ' << region.second << "\n";
+    }
+    for (const auto &token : stat.tokenCounts.entries) {
+      out << "PHRASE_TOKEN " << std::quoted(phrase) << ' ' << std::quoted(std::string(corpus.tokens.str(token.first)))
+          << ' ' << token.second << "\n";
+    }
+  }
+}
+
+// Binary state format v2. All integers are native little-endian and every section starts on an
+// 8-byte boundary. The string table holds token strings, then phrase strings, then region strings;
+// phrase records point at contiguous runs of id-sorted count records. The checksum covers every
+// byte after the header, so a reader can map the file and consult the header without touching the rest.
+// Tokens, phrases and regions are numbered in string order, so count records are string-sorted too;
+// `merge` relies on that to combine files in one streaming pass. Sections may appear in any order.
+// Phrase records hold the score sum as its exact 128-bit units (ScoreSum).
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "slang_trainer state v2 assumes a little-endian host"
+#endif
+
+constexpr char STATE_MAGIC[8] = {'S', 'L', 'G', 'S', 'T', 'A', 'T', 'E'};
+constexpr std::uint32_t STATE_VERSION = 2;
+
+struct StateSection {
+  std::uint64_t offset = 0;
+  std::uint64_t size = 0;
+};
+
+struct StateHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t headerSize;
+  std::uint64_t totalContexts;
+  std::uint32_t tokenCount;
+  std::uint32_t phraseCount;
+  std::uint32_t regionCount;
+  std::uint32_t reserved;
+  StateSection stringOffsets; // uint64[tokenCount + phraseCount + regionCount + 1] into stringData
+  StateSection stringData;
+  StateSection tokenTotals;   // uint64[tokenCount]
+  StateSection phrases;       // StatePhraseRecord[phraseCount]
+  StateSection regionCounts;  // StateCountRecord[]
+  StateSection tokenCounts;   // StateCountRecord[]
+  std::uint64_t checksum;
+  StateSection centroidTokens; // uint32[] token ids, one per centroid column
+  StateSection centroids;      // float[clusters * centroid columns], row-major
+  StateSection tokenSeeds;     // uint64[tokenCount] under --memory-budget, else empty (see ApproxCounts)
+  StateSection sketch;         // uint64[sketchWidth * sketchDepth]
+  std::uint32_t sketchWidth;
+  std::uint32_t sketchDepth;
+  std::uint64_t tokenCountError;
+  std::uint64_t evictedMass;
+  std::uint64_t prunedEntries;
+  std::uint64_t evictedTokens;
+};
+
+struct StatePhraseRecord {
+  std::uint64_t count;
+  std::uint64_t scoreLow; // score units (ScoreSum), low and high 64 bits
+  std::int64_t scoreHigh;
+  std::uint64_t regionBegin;
+  std::uint64_t tokenBegin;
+  std::uint32_t regionCount;
+  std::uint32_t tokenCount;
+
+  ScoreSum scoreSum() const { return static_cast<ScoreSum>((static_cast<unsigned __int128>(scoreHigh) << 64) | scoreLow); }
+  void setScoreSum(ScoreSum units) {
+    scoreLow = static_cast<std::uint64_t>(units);
+    scoreHigh = static_cast<std::int64_t>(units >> 64);
+  }
+};
+
+struct StateCountRecord {
+  std::uint32_t id;
+  std::uint32_t reserved;
+  std::uint64_t count;
+};
+
+static_assert(sizeof(StateHeader) == 248, "state header layout changed");
+static_assert(sizeof(StatePhraseRecord) == 48, "state phrase record layout changed");
+static_assert(sizeof(StateCountRecord) == 16, "state count record layout changed");
+
+// Word-at-a-time running checksum; bytes that do not fill a word are carried to the next update.
+struct Checksum64 {
+  std::uint64_t hash = 0x9E3779B97F4A7C15ull;
+  std::uint64_t length = 0;
+  unsigned char tail[8] = {};
+  std::size_t tailSize = 0;
+
+  void mix(std::uint64_t word) {
+    hash ^= word;
+    hash = (hash << 29) | (hash >> 35);
+    hash *= 0xBF58476D1CE4E5B9ull;
+  }
+
+  void update(const char *data, std::size_t size) {
+    length += size;
+    while (size > 0 && tailSize > 0) {
+      tail[tailSize++] = static_cast<unsigned char>(*data++);
+      --size;
+      if (tailSize == 8) {
+        std::uint64_t word;
+        std::memcpy(&word, tail, 8);
+        mix(word);
+        tailSize = 0;
+      }
+    }
+    for (; size >= 8; data += 8, size -= 8) {
+      std::uint64_t word;
+      std::memcpy(&word, data, 8);
+      mix(word);
+    }
+    std::memcpy(tail + tailSize, data, size);
+    tailSize += size;
+  }
+
+  std::uint64_t finish() const {
+    Checksum64 copy = *this;
+    std::uint64_t word = 0;
+    std::memcpy(&word, copy.tail, copy.tailSize);
+    copy.mix(word);
+    copy.mix(length);
+    return copy.hash ^ (copy.hash >> 31);
+  }
+};
+
+// Sequential writer that tracks the file offset and checksums everything after the header.
+struct StateWriter {
+  std::ostream &out;
+  std::uint64_t offset;
+  Checksum64 checksum;
+
+  void write(const void *data, std::size_t size) {
+    out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+    checksum.update(static_cast<const char *>(data), size);
+    offset += size;
+  }
+
+  void align() {
+    static const char zeros[8] = {};
+    if (offset % 8 != 0)
+      write(zeros, 8 - offset % 8);
+  }
+
+  template <typename T> StateSection writeArray(const std::vector<T> &values) {
+    align();
+    StateSection section{offset, values.size() * sizeof(T)};
+    write(values.data(), section.size);
+    return section;
+  }
+};
+
+// Position of each id in `order`.
+std::vector<std::uint32_t> ranksOf(const std::vector<std::uint32_t> &order) {
+  std::vector<std::uint32_t> rank(order.size());
+  for (std::uint32_t i = 0; i < order.size(); ++i) {
+    rank[order[i]] = i;
+  }
+  return rank;
+}
+
+// Writes the corpus renumbered in string order, so the file does not depend on
+// the order the corpus was ingested in.
+void saveStateV2(std::ofstream &out, const CorpusStats &corpus) {
+  StateHeader header{};
+  std::memcpy(header.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+  header.version = STATE_VERSION;
+  header.headerSize = sizeof(StateHeader);
+  header.totalContexts = corpus.totals.totalContexts;
+  header.tokenCount = static_cast<std::uint32_t>(corpus.tokens.size());
+  header.phraseCount = static_cast<std::uint32_t>(corpus.phrases.size());
+  header.regionCount = static_cast<std::uint32_t>(corpus.regions.size());
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  StateWriter writer{out, sizeof(header), {}};
+
+  const std::vector<std::uint32_t> tokenOrder = sortedIds(corpus.tokens);
+  const std::vector<std::uint32_t> phraseOrder = sortedIds(corpus.phrases);
+  const std::vector<std::uint32_t> regionOrder = sortedIds(corpus.regions);
+  const std::vector<std::uint32_t> tokenRank = ranksOf(tokenOrder);
+  const std::vector<std::uint32_t> regionRank = ranksOf(regionOrder);
+  const std::pair<const StringInterner *, const std::vector<std::uint32_t> *> tables[] = {
+      {&corpus.tokens, &tokenOrder}, {&corpus.phrases, &phraseOrder}, {&corpus.regions, &regionOrder}};
+  std::vector<std::uint64_t> stringOffsets{0};
+  for (const auto &table : tables) {
+    for (std::uint32_t id : *table.second) {
+      stringOffsets.push_back(stringOffsets.back() + table.first->str(id).size());
+    }
+  }
+  header.stringOffsets = writer.writeArray(stringOffsets);
+  header.stringData = {writer.offset, stringOffsets.back()};
+  for (const auto &table : tables) {
+    for (std::uint32_t id : *table.second) {
+      std::string_view value = table.first->str(id);
+      writer.write(value.data(), value.size());
+    }
+  }
+  auto permuted = [&](const std::vector<std::uint64_t> &byToken) {
+    std::vector<std::uint64_t> values;
+    values.reserve(tokenOrder.size());
+    for (std::uint32_t id : tokenOrder)
+      values.push_back(byToken[id]);
+    return values;
+  };
+  header.tokenTotals = writer.writeArray(permuted(corpus.totals.tokenTotals));
+
+  std::vector<StatePhraseRecord> records;
+  records.reserve(corpus.stats.size());
+  std::uint64_t regionCursor = 0;
+  std::uint64_t tokenCursor = 0;
+  for (std::uint32_t phrase : phraseOrder) {
+    const PhraseStats &stat = corpus.stats[phrase];
+    StatePhraseRecord &record = records.emplace_back();
+    record.count = stat.count;
+    record.setScoreSum(stat.scoreSum);
+    record.regionBegin = regionCursor;
+    record.tokenBegin = tokenCursor;
+    record.regionCount = static_cast<std::uint32_t>(stat.regionCounts.size());
+    record.tokenCount = static_cast<std::uint32_t>(stat.tokenCounts.size());
+    regionCursor += stat.regionCounts.size();
+    tokenCursor += stat.tokenCounts.size();
+  }
+  header.phrases = writer.writeArray(records);
+
+  auto writeCounts = [&](std::uint64_t total, auto member, const std::vector<std::uint32_t> &rank) {
+    writer.align();
+    StateSection section{writer.offset, total * sizeof(StateCountRecord)};
+    std::vector<StateCountRecord> buffer;
+    for (std::uint32_t phrase : phraseOrder) {
+      buffer.clear();
+      for (const auto &entry : (corpus.stats[phrase].*member).entries) {
+        buffer.push_back({rank[entry.first], 0, entry.second});
+      }
+      std::sort(buffer.begin(), buffer.end(),
+                [](const StateCountRecord &a, const StateCountRecord &b) { return a.id < b.id; });
+      writer.write(buffer.data(), buffer.size() * sizeof(StateCountRecord));
+    }
+    return section;
+  };
+  header.regionCounts = writeCounts(regionCursor, &PhraseStats::regionCounts, regionRank);
+  header.tokenCounts = writeCounts(tokenCursor, &PhraseStats::tokenCounts, tokenRank);
+  std::vector<std::uint32_t> centroidTokens;
+  for (std::uint32_t token : corpus.centroids.tokens)
+    centroidTokens.push_back(tokenRank[token]);
+  header.centroidTokens = writer.writeArray(centroidTokens);
+  header.centroids = writer.writeArray(corpus.centroids.values);
+  const ApproxCounts &approx = corpus.approx;
+  if (approx.active()) {
+    header.tokenSeeds = writer.writeArray(permuted(approx.tokenSeeds));
+    header.sketch = writer.writeArray(approx.sketch.cells);
+    header.sketchWidth = approx.sketch.width;
+    header.sketchDepth = approx.sketch.depth;
+    header.tokenCountError = approx.tokenCountError;
+    header.evictedMass = approx.evictedMass;
+    header.prunedEntries = approx.prunedEntries;
+    header.evictedTokens = approx.evictedTokens;
+  }
+
+  header.checksum = writer.checksum.finish();
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+// Memory-mapped v2 state file. Construction validates the header and section bounds only; sections
+// are paged in as they are read, and verifyChecksum() is a separate full pass.
+struct StateFileView {
+  explicit StateFileView(const std::string &path) : file(path, "state file") {
+    std::string_view bytes = file.view();
+    if (bytes.size() < sizeof(StateHeader) ||
+        std::memcmp(bytes.data(), STATE_MAGIC, sizeof(STATE_MAGIC)) != 0) {
+      throw std::runtime_error("Not a binary slang_trainer state file: " + path);
+    }
+    std::uint32_t version;
+    std::uint32_t headerSize;
+    std::memcpy(&version, bytes.data() + offsetof(StateHeader, version), sizeof(version));
+    std::memcpy(&headerSize, bytes.data() + offsetof(StateHeader, headerSize), sizeof(headerSize));
+    if (version != STATE_VERSION || headerSize != sizeof(StateHeader)) {
+      throw std::runtime_error("Unsupported state file version in " + path);
+    }
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    const std::uint64_t strings = std::uint64_t{header.tokenCount} + header.phraseCount + header.regionCount;
+    auto check = [&](const StateSection &section, std::uint64_t expected) {
+      if (section.offset % 8 != 0 || section.offset > bytes.size() || section.size > bytes.size() - section.offset ||
+          (expected != 0 && section.size != expected)) {
+        throw std::runtime_error("Corrupt state file (bad section bounds): " + path);
+      }
+    };
+    check(header.stringOffsets, (strings + 1) * sizeof(std::uint64_t));
+    check(header.stringData, 0);
+    check(header.tokenTotals, std::uint64_t{header.tokenCount} * sizeof(std::uint64_t));
+    check(header.phrases, std::uint64_t{header.phraseCount} * sizeof(StatePhraseRecord));
+    check(header.regionCounts, 0);
+    check(header.tokenCounts, 0);
+    if (header.regionCounts.size % sizeof(StateCountRecord) != 0 ||
+        header.tokenCounts.size % sizeof(StateCountRecord) != 0) {
+      throw std::runtime_error("Corrupt state file (bad record section): " + path);
+    }
+    check(header.centroidTokens, 0);
+    check(header.centroids, 0);
+    const std::uint64_t columns = header.centroidTokens.size / sizeof(std::uint32_t);
+    if (header.centroidTokens.size % sizeof(std::uint32_t) != 0 || header.centroids.size % sizeof(float) != 0 ||
+        (columns == 0 ? header.centroids.size != 0 : header.centroids.size / sizeof(float) % columns != 0)) {
+      throw std::runtime_error("Corrupt state file (bad centroid section): " + path);
+    }
+    const std::uint64_t sketchCells = std::uint64_t{header.sketchWidth} * header.sketchDepth;
+    check(header.tokenSeeds, sketchCells == 0 ? 0 : std::uint64_t{header.tokenCount} * sizeof(std::uint64_t));
+    check(header.sketch, sketchCells * sizeof(std::uint64_t));
+    if ((header.sketchWidth & (header.sketchWidth - 1)) != 0 ||
+        (sketchCells == 0 && (header.sketch.size != 0 || header.tokenSeeds.size != 0))) {
+      throw std::runtime_error("Corrupt state file (bad sketch section): " + path);
+    }
+  }
+
+  bool verifyChecksum() const {
+    Checksum64 checksum;
+    std::string_view bytes = file.view();
+    checksum.update(bytes.data() + header.headerSize, bytes.size() - header.headerSize);
+    return checksum.finish() == header.checksum;
+  }
+
+  template <typename T> const T *section(const StateSection &ref) const {
+    return reinterpret_cast<const T *>(file.data + ref.offset);
+  }
+
+  // Index into the combined string table: tokens, then phrases, then regions.
+  std::string_view string(std::uint64_t index) const {
+    const std::uint64_t *offsets = section<std::uint64_t>(header.stringOffsets);
+    std::uint64_t begin = offsets[index];
+    std::uint64_t end = offsets[index + 1];
+    if (begin > end || end > header.stringData.size) {
+      throw std::runtime_error("Corrupt state file (bad string offset)");
+    }
+    return std::string_view(file.data + header.stringData.offset + begin, end - begin);
+  }
+  std::string_view token(std::uint32_t id) const { return string(id); }
+  std::string_view phrase(std::uint32_t id) const { return string(std::uint64_t{header.tokenCount} + id); }
+  std::string_view region(std::uint32_t id) const {
+    return string(std::uint64_t{header.tokenCount} + header.phraseCount + id);
+  }
+
+  const StatePhraseRecord &phraseRecord(std::uint32_t id) const { return section<StatePhraseRecord>(header.phrases)[id]; }
+
+  // Count records [begin, begin + count) of a record section, bounds-checked.
+  const StateCountRecord *records(const StateSection &ref, std::uint64_t begin, std::uint64_t count) const {
+    std::uint64_t available = ref.size / sizeof(StateCountRecord);
+    if (begin > available || count > available - begin) {
+      throw std::runtime_error("Corrupt state file (bad record range)");
+    }
+    return section<StateCountRecord>(ref) + begin;
+  }
+
+  MappedFile file;
+  StateHeader header;
+};
+
+// Adds a v2 state file to `corpus`: a checksum pass over the whole file, then every section is copied
+// into the corpus tables, so load time grows with the file rather than with what is used.
+void loadStateV2(const std::string &path, CorpusStats &corpus) {
+  StateFileView view(path);
+  if (!view.verifyChecksum()) {
+    throw std::runtime_error("State file checksum mismatch: " + path);
+  }
+  const StateHeader &header = view.header;
+  corpus.tokens.reserve(corpus.tokens.size() + header.tokenCount);
+  corpus.phrases.reserve(corpus.phrases.size() + header.phraseCount);
+  corpus.stats.reserve(corpus.stats.size() + header.phraseCount);
+  std::vector<std::uint32_t> tokenIds(header.tokenCount);
+  const std::uint64_t *tokenTotals = view.section<std::uint64_t>(header.tokenTotals);
+  for (std::uint32_t t = 0; t < header.tokenCount; ++t) {
+    tokenIds[t] = internToken(corpus, view.token(t));
+    corpus.totals.tokenTotals[tokenIds[t]] += tokenTotals[t];
+  }
+  std::vector<std::uint32_t> regionIds(header.regionCount);
+  for (std::uint32_t r = 0; r < header.regionCount; ++r) {
+    regionIds[r] = corpus.regions.intern(view.region(r));
+  }
+  corpus.totals.totalContexts += header.totalContexts;
+
+  auto fill = [](CountVector &into, const StateCountRecord *records, std::uint32_t count,
+                 const std::vector<std::uint32_t> &ids) {
+    for (std::uint32_t i = 0; i < count; ++i) {
+      if (records[i].id >= ids.size()) {
+        throw std::runtime_error("Corrupt state file (bad count id)");
+      }
+    }
+    if (into.entries.empty() && into.pending.empty()) {
+      into.entries.reserve(count);
+      for (std::uint32_t i = 0; i < count; ++i) {
+        into.entries.push_back({ids[records[i].id], records[i].count});
+      }
+      if (!std::is_sorted(into.entries.begin(), into.entries.end(),
+                          [](const IdCount &a, const IdCount &b) { return a.first < b.first; })) {
+        std::swap(into.entries, into.pending);
+        into.compact();
+      }
+      return;
+    }
+    for (std::uint32_t i = 0; i < count; ++i) {
+      into.add(ids[records[i].id], records[i].count);
+    }
+  };
+  for (std::uint32_t p = 0; p < header.phraseCount; ++p) {
+    const StatePhraseRecord &record = view.phraseRecord(p);
+    PhraseStats &stat = corpus.stats[internPhrase(corpus, view.phrase(p))];
+    stat.count += record.count;
+    addScoreUnits(stat.scoreSum, record.scoreSum());
+    fill(stat.regionCounts, view.records(header.regionCounts, record.regionBegin, record.regionCount),
+         record.regionCount, regionIds);
+    fill(stat.tokenCounts, view.records(header.tokenCounts, record.tokenBegin, record.tokenCount), record.tokenCount,
+         tokenIds);
+  }
+  compactAll(corpus);
+
+  const std::size_t columns = header.centroidTokens.size / sizeof(std::uint32_t);
+  if (columns > 0) {
+    const std::uint32_t *centroidTokens = view.section<std::uint32_t>(header.centroidTokens);
+    const float *centroids = view.section<float>(header.centroids);
+    ClusterCentroids loaded;
+    for (std::size_t i = 0; i < columns; ++i) {
+      if (centroidTokens[i] >= tokenIds.size()) {
+        throw std::runtime_error("Corrupt state file (bad centroid token)");
+      }
+      loaded.tokens.push_back(tokenIds[centroidTokens[i]]);
+    }
+    loaded.values.assign(centroids, centroids + header.centroids.size / sizeof(float));
+    corpus.centroids = std::move(loaded);
+  }
+
+  if (header.sketchWidth > 0) {
+    // Sketches and seeds add up: the loaded totals include the file's seeds, and tokens new to an
+    // approximate corpus were seeded from its own sketch when interned.
+    ApproxCounts &approx = corpus.approx;
+    if (!approx.active()) {
+      approx.sketch.reset(header.sketchWidth, header.sketchDepth);
+      approx.tokenSeeds.assign(corpus.tokens.size(), 0);
+    } else if (approx.sketch.width != header.sketchWidth || approx.sketch.depth != header.sketchDepth) {
+      throw std::runtime_error("State file sketch dimensions differ from the loaded state: " + path);
+    }
+    const std::uint64_t *seeds = view.section<std::uint64_t>(header.tokenSeeds);
+    for (std::uint32_t t = 0; t < header.tokenCount; ++t) {
+      approx.tokenSeeds[tokenIds[t]] += seeds[t];
+    }
+    const std::uint64_t *cells = view.section<std::uint64_t>(header.sketch);
+    for (std::size_t c = 0; c < approx.sketch.cells.size(); ++c) {
+      approx.sketch.cells[c] += cells[c];
+    }
+    approx.tokenCountError += header.tokenCountError;
+    approx.evictedMass += header.evictedMass;
+    approx.prunedEntries += header.prunedEntries;
+    approx.evictedTokens += header.evictedTokens;
+  }
+}
+
+// Loads a v1 (text) or v2 (binary) state file into `corpus`. A missing file is not an error.
+bool loadState(const std::string &path, CorpusStats &corpus) {
+  if (path.empty())
+    return false;
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    return false;
+  char magic[sizeof(STATE_MAGIC)] = {};
+  in.read(magic, sizeof(magic));
+  if (in.gcount() == sizeof(magic) && std::memcmp(magic, STATE_MAGIC, sizeof(magic)) == 0) {
+    in.close();
+    loadStateV2(path, corpus);
+  } else {
+    in.clear();
+    in.seekg(0);
+    loadStateV1(in, corpus);
+  }
+  return true;
+}
+
+void saveState(const std::string &path, const CorpusStats &corpus, const std::string &format) {
+  if (path.empty())
+    return;
+  if (format == "v1" && corpus.approx.active()) {
+    throw std::runtime_error("--state-format v1 cannot hold the approximate counts of --memory-budget; use v2.");
+  }
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Failed to write state file: " + path);
+  }
+  if (format == "v1") {
+    saveStateV1(out, corpus);
+  } else {
+    saveStateV2(out, corpus);
+  }
+  if (!out) {
+    throw std::runtime_error("Failed to write state file: " + path);
+  }
+}
+
+// K-way merges the strictly increasing string lists strings(f, 0 .. sizes[f]) of files f, calling
+// emit(value) once per distinct string in order and filling ids[f] with each string's merged index.
+// Returns the number of distinct strings.
+template <typename Get, typename Emit>
+std::uint32_t mergeStringLists(const std::vector<std::uint32_t> &sizes, Get strings, Emit emit,
+                               std::vector<std::vector<std::uint32_t>> &ids) {
+  using Head = std::pair<std::string_view, std::size_t>;
+  auto later = [](const Head &a, const Head &b) { return a.first != b.first ? a.first > b.first : a.second > b.second; };
+  std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+  std::vector<std::uint32_t> cursor(sizes.size(), 0);
+  ids.assign(sizes.size(), {});
+  for (std::size_t f = 0; f < sizes.size(); ++f) {
+    ids[f].resize(sizes[f]);
+    if (sizes[f] > 0)
+      heads.push({strings(f, 0), f});
+  }
+  std::uint32_t merged = 0;
+  while (!heads.empty()) {
+    const std::string_view value = heads.top().first;
+    emit(value);
+    while (!heads.empty() && heads.top().first == value) {
+      const std::size_t f = heads.top().second;
+      heads.pop();
+      ids[f][cursor[f]] = merged;
+      if (++cursor[f] < sizes[f]) {
+        const std::string_view next = strings(f, cursor[f]);
+        if (next <= value) {
+          throw std::runtime_error("Corrupt state file (strings out of order)");
+        }
+        heads.push({next, f});
+      }
+    }
+    ++merged;
+  }
+  return merged;
+}
+
+// Appends a file's id-sorted count run to `run`, mapped to merged ids, keeping `run` sorted and
+// summing counts for ids it already holds. Merged ids preserve each file's (string) order.
+void foldCountRun(std::vector<StateCountRecord> &run, const StateCountRecord *records, std::uint32_t count,
+                  const std::vector<std::uint32_t> &ids) {
+  auto byId = [](const StateCountRecord &a, const StateCountRecord &b) { return a.id < b.id; };
+  const std::size_t middle = run.size();
+  for (std::uint32_t i = 0; i < count; ++i) {
+    if (records[i].id >= ids.size() || (i > 0 && records[i].id <= records[i - 1].id)) {
+      throw std::runtime_error("Corrupt state file (bad count id)");
+    }
+    run.push_back({ids[records[i].id], 0, records[i].count});
+  }
+  std::inplace_merge(run.begin(), run.begin() + static_cast<std::ptrdiff_t>(middle), run.end(), byId);
+  std::size_t kept = 0;
+  for (std::size_t i = 0; i < run.size(); ++i) {
+    if (kept > 0 && run[kept - 1].id == run[i].id) {
+      run[kept - 1].count += run[i].count;
+    } else {
+      run[kept++] = run[i];
+    }
+  }
+  run.resize(kept);
+}
+
+// `slang_trainer merge`: combines v2 state files into one, as if their inputs had been
+// ingested together. The string tables are k-way merged to number the result, then each merged
+// phrase folds in the count runs of every file that has it. Count records stream from the mapped
+// inputs to the output, so memory holds the id maps and phrase records but no shard's counts.
+// Approximate (--memory-budget) files add up as in loadStateV2: sketches, seeds and error bounds
+// are summed, and a token a file does not hold is seeded from that file's sketch. The centroids of
+// the first file that has them are kept, so merging a new shard into a running state keeps its
+// cluster ids stable. The output is written next to `output` and renamed over it, so it may be
+// one of the inputs.
+void mergeStates(const std::vector<std::string> &inputs, const std::string &output) {
+  std::vector<std::unique_ptr<StateFileView>> views;
+  std::uint32_t sketchWidth = 0;
+  std::uint32_t sketchDepth = 0;
+  for (const auto &path : inputs) {
+    views.push_back(std::make_unique<StateFileView>(path));
+    const StateHeader &header = views.back()->header;
+    if (!views.back()->verifyChecksum()) {
+      throw std::runtime_error("State file checksum mismatch: " + path);
+    }
+    if (header.sketchWidth > 0) {
+      if (sketchWidth > 0 && (header.sketchWidth != sketchWidth || header.sketchDepth != sketchDepth)) {
+        throw std::runtime_error("State file sketch dimensions differ from the other inputs: " + path);
+      }
+      sketchWidth = header.sketchWidth;
+      sketchDepth = header.sketchDepth;
+    }
+  }
+  const std::size_t files = views.size();
+
+  const std::string temporary = output + ".tmp";
+  std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Failed to write state file: " + output);
+  }
+  StateHeader header{};
+  std::memcpy(header.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+  header.version = STATE_VERSION;
+  header.headerSize = sizeof(StateHeader);
+  for (const auto &view : views)
+    header.totalContexts += view->header.totalContexts;
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  StateWriter writer{out, sizeof(header), {}};
+
+  // Strings: merged tokens, then phrases, then regions, written as they come out of the merge.
+  std::vector<std::uint64_t> stringOffsets{0};
+  std::vector<std::string_view> tokenStrings; // only kept to seed tokens from the inputs' sketches
+  writer.align();
+  header.stringData.offset = writer.offset;
+  auto emit = [&](std::string_view value) {
+    writer.write(value.data(), value.size());
+    stringOffsets.push_back(stringOffsets.back() + value.size());
+  };
+  auto sizesOf = [&](std::uint32_t StateHeader::*count) {
+    std::vector<std::uint32_t> sizes;
+    for (const auto &view : views)
+      sizes.push_back(view->header.*count);
+    return sizes;
+  };
+  std::vector<std::vector<std::uint32_t>> tokenIds;
+  std::vector<std::vector<std::uint32_t>> phraseIds;
+  std::vector<std::vector<std::uint32_t>> regionIds;
+  header.tokenCount = mergeStringLists(
+      sizesOf(&StateHeader::tokenCount), [&](std::size_t f, std::uint32_t i) { return views[f]->token(i); },
+      [&](std::string_view value) {
+        emit(value);
+        if (sketchWidth > 0)
+          tokenStrings.push_back(value);
+      },
+      tokenIds);
+  header.phraseCount = mergeStringLists(
+      sizesOf(&StateHeader::phraseCount), [&](std::size_t f, std::uint32_t i) { return views[f]->phrase(i); }, emit,
+      phraseIds);
+  header.regionCount = mergeStringLists(
+      sizesOf(&StateHeader::regionCount), [&](std::size_t f, std::uint32_t i) { return views[f]->region(i); }, emit,
+      regionIds);
+  header.stringData.size = stringOffsets.back();
+  header.stringOffsets = writer.writeArray(stringOffsets);
+  std::vector<std::uint64_t>().swap(stringOffsets);
+
+  std::vector<std::uint64_t> tokenTotals(header.tokenCount, 0);
+  std::vector<std::uint64_t> tokenSeeds(sketchWidth > 0 ? header.tokenCount : 0, 0);
+  CountMinSketch sketch;
+  if (sketchWidth > 0)
+    sketch.reset(sketchWidth, sketchDepth);
+  std::vector<std::uint8_t> present;
+  for (std::size_t f = 0; f < files; ++f) {
+    const StateFileView &view = *views[f];
+    const StateHeader &from = view.header;
+    const std::uint64_t *totals = view.section<std::uint64_t>(from.tokenTotals);
+    for (std::uint32_t t = 0; t < from.tokenCount; ++t)
+      tokenTotals[tokenIds[f][t]] += totals[t];
+    if (from.sketchWidth == 0)
+      continue;
+    CountMinSketch fileSketch;
+    fileSketch.width = from.sketchWidth;
+    fileSketch.depth = from.sketchDepth;
+    const std::uint64_t *cells = view.section<std::uint64_t>(from.sketch);
+    fileSketch.cells.assign(cells, cells + from.sketch.size / sizeof(std::uint64_t));
+    const std::uint64_t *seeds = view.section<std::uint64_t>(from.tokenSeeds);
+    present.assign(header.tokenCount, 0);
+    for (std::uint32_t t = 0; t < from.tokenCount; ++t) {
+      tokenSeeds[tokenIds[f][t]] += seeds[t];
+      present[tokenIds[f][t]] = 1;
+    }
+    for (std::uint32_t t = 0; t < header.tokenCount; ++t) {
+      if (present[t])
+        continue;
+      const std::uint64_t seed = fileSketch.estimate(tokenStrings[t]);
+      tokenTotals[t] += seed;
+      tokenSeeds[t] += seed;
+    }
+    for (std::size_t c = 0; c < sketch.cells.size(); ++c)
+      sketch.cells[c] += fileSketch.cells[c];
+    header.tokenCountError += from.tokenCountError;
+    header.evictedMass += from.evictedMass;
+    header.prunedEntries += from.prunedEntries;
+    header.evictedTokens += from.evictedTokens;
+  }
+  header.tokenTotals = writer.writeArray(tokenTotals);
+  std::vector<std::uint64_t>().swap(tokenTotals);
+
+  // Count records, one merged phrase at a time; token runs go straight to the output.
+  std::vector<StatePhraseRecord> records(header.phraseCount, StatePhraseRecord{});
+  std::vector<StateCountRecord> regionRecords;
+  std::vector<StateCountRecord> regionRun;
+  std::vector<StateCountRecord> tokenRun;
+  std::vector<std::uint32_t> cursor(files, 0);
+  std::uint64_t tokenRecords = 0;
+  writer.align();
+  header.tokenCounts.offset = writer.offset;
+  for (std::uint32_t phrase = 0; phrase < header.phraseCount; ++phrase) {
+    StatePhraseRecord &record = records[phrase];
+    ScoreSum scoreSum = 0;
+    regionRun.clear();
+    tokenRun.clear();
+    for (std::size_t f = 0; f < files; ++f) {
+      const StateFileView &view = *views[f];
+      if (cursor[f] == view.header.phraseCount || phraseIds[f][cursor[f]] != phrase)
+        continue;
+      const StatePhraseRecord &from = view.phraseRecord(cursor[f]++);
+      record.count += from.count;
+      addScoreUnits(scoreSum, from.scoreSum());
+      foldCountRun(regionRun, view.records(view.header.regionCounts, from.regionBegin, from.regionCount),
+                   from.regionCount, regionIds[f]);
+      foldCountRun(tokenRun, view.records(view.header.tokenCounts, from.tokenBegin, from.tokenCount),
+                   from.tokenCount, tokenIds[f]);
+    }
+    record.setScoreSum(scoreSum);
+    record.regionBegin = regionRecords.size();
+    record.regionCount = static_cast<std::uint32_t>(regionRun.size());
+    regionRecords.insert(regionRecords.end(), regionRun.begin(), regionRun.end());
+    record.tokenBegin = tokenRecords;
+    record.tokenCount = static_cast<std::uint32_t>(tokenRun.size());
+    writer.write(tokenRun.data(), tokenRun.size() * sizeof(StateCountRecord));
+    tokenRecords += tokenRun.size();
+  }
+  header.tokenCounts.size = tokenRecords * sizeof(StateCountRecord);
+  header.phrases = writer.writeArray(records);
+  header.regionCounts = writer.writeArray(regionRecords);
+
+  for (std::size_t f = 0; f < files; ++f) {
+    const StateFileView &view = *views[f];
+    const std::size_t columns = view.header.centroidTokens.size / sizeof(std::uint32_t);
+    if (columns == 0)
+      continue;
+    const std::uint32_t *centroidTokens = view.section<std::uint32_t>(view.header.centroidTokens);
+    std::vector<std::uint32_t> mapped;
+    for (std::size_t i = 0; i < columns; ++i) {
+      if (centroidTokens[i] >= tokenIds[f].size()) {
+        throw std::runtime_error("Corrupt state file (bad centroid token): " + inputs[f]);
+      }
+      mapped.push_back(tokenIds[f][centroidTokens[i]]);
+    }
+    const float *centroids = view.section<float>(view.header.centroids);
+    header.centroidTokens = writer.writeArray(mapped);
+    header.centroids =
+        writer.writeArray(std::vector<float>(centroids, centroids + view.header.centroids.size / sizeof(float)));
+    break;
+  }
+  if (sketchWidth > 0) {
+    header.tokenSeeds = writer.writeArray(tokenSeeds);
+    header.sketch = writer.writeArray(sketch.cells);
+    header.sketchWidth = sketchWidth;
+    header.sketchDepth = sketchDepth;
+  }
+
+  header.checksum = writer.checksum.finish();
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Failed to write state file: " + output);
+  }
+  views.clear();
+  if (std::rename(temporary.c_str(), output.c_str()) != 0) {
+    throw std::runtime_error("Failed to replace state file: " + output);
+  }
+}
+
+// `slang_trainer merge --state-out merged.dat shard1.dat shard2.dat ...`
+void runMerge(int argc, char **argv) {
+  std::string output;
+  std::vector<std::string> inputs;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--state-out" && i + 1 < argc) {
+      output = argv[++i];
+    } else if (arg == "--help" || arg == "-h") {
+      std::cout << "Usage: slang_trainer merge --state-out merged.dat shard1.dat [shard2.dat ...]\n";
+      std::exit(0);
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      throw std::runtime_error("Unknown merge option: " + arg);
+    } else {
+      inputs.push_back(arg);
+    }
+  }
+  if (output.empty()) {
+    throw std::runtime_error("merge needs --state-out merged.dat.");
+  }
+  if (inputs.empty()) {
+    throw std::runtime_error("merge needs at least one state file.");
+  }
+  mergeStates(inputs, output);
+  std::cout << "Merged " << inputs.size() << " state files into " << output << "\n";
+}
+
+// On-disk HNSW index for later querying, laid out like state v2 (little-endian, 8-byte aligned
+// sections, checksum over everything after the header). The string table holds the embedding
+// column tokens, then one phrase per node; vectors are the unit-length rows the graph links.
+constexpr char ANN_MAGIC[8] = {'S', 'L', 'G', 'A', 'N', 'N', 'I', 'X'};
+constexpr std::uint32_t ANN_VERSION = 1;
+
+struct AnnIndexHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t headerSize;
+  std::uint32_t dim;
+  std::uint32_t nodeCount;
+  std::uint32_t links;     // ANN_LINKS
+  std::uint32_t baseLinks; // ANN_BASE_LINKS
+  std::uint32_t entryPoint;
+  std::int32_t maxLevel;
+  StateSection stringOffsets; // uint64[dim + nodeCount + 1] into stringData
+  StateSection stringData;
+  StateSection vectors;       // float[nodeCount * dim]
+  StateSection levels;        // uint8[nodeCount]
+  StateSection baseLinkData;  // uint32[nodeCount * (baseLinks + 1)]
+  StateSection upperOffsets;  // uint64[nodeCount + 1] into upperLinkData, in words
+  StateSection upperLinkData; // uint32[]
+  std::uint64_t checksum;
+};
+
+static_assert(sizeof(AnnIndexHeader) == 160, "ann index header layout changed");
+
+void saveAnnIndex(const std::string &path, const AnnIndex &index, const CorpusStats &corpus,
+                  const std::vector<std::uint32_t> &vocab) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Failed to write ANN index file: " + path);
+  }
+  AnnIndexHeader header{};
+  std::memcpy(header.magic, ANN_MAGIC, sizeof(ANN_MAGIC));
+  header.version = ANN_VERSION;
+  header.headerSize = sizeof(AnnIndexHeader);
+  header.dim = static_cast<std::uint32_t>(index.dim);
+  header.nodeCount = static_cast<std::uint32_t>(index.size());
+  header.links = ANN_LINKS;
+  header.baseLinks = ANN_BASE_LINKS;
+  header.entryPoint = index.entryPoint;
+  header.maxLevel = index.maxLevel;
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  StateWriter writer{out, sizeof(header), {}};
+
+  std::vector<std::string_view> strings;
+  for (std::uint32_t token : vocab) {
+    strings.push_back(corpus.tokens.str(token));
+  }
+  for (std::uint32_t phrase : index.phrases) {
+    strings.push_back(corpus.phrases.str(phrase));
+  }
+  std::vector<std::uint64_t> stringOffsets{0};
+  for (std::string_view value : strings) {
+    stringOffsets.push_back(stringOffsets.back() + value.size());
+  }
+  header.stringOffsets = writer.writeArray(stringOffsets);
+  header.stringData = {writer.offset, stringOffsets.back()};
+  for (std::string_view value : strings) {
+    writer.write(value.data(), value.size());
+  }
+  header.vectors = writer.writeArray(index.vectors);
+  header.levels = writer.writeArray(index.levels);
+  header.baseLinkData = writer.writeArray(index.baseLinks);
+  std::vector<std::uint64_t> upperOffsets{0};
+  for (const auto &links : index.upperLinks) {
+    upperOffsets.push_back(upperOffsets.back() + links.size());
+  }
+  header.upperOffsets = writer.writeArray(upperOffsets);
+  writer.align();
+  header.upperLinkData = {writer.offset, upperOffsets.back() * sizeof(std::uint32_t)};
+  for (const auto &links : index.upperLinks) {
+    writer.write(links.data(), links.size() * sizeof(std::uint32_t));
+  }
+
+  header.checksum = writer.checksum.finish();
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  if (!out) {
+    throw std::runtime_error("Failed to write ANN index file: " + path);
+  }
+}
+
+// Reads an --ann-index file back for the query server: the graph into `index`, whose node phrase
+// ids are then node numbers, and each node's phrase into `phrases`. The column tokens are skipped.
+void loadAnnIndex(const std::string &path, AnnIndex &index, std::vector<std::string> &phrases) {
+  MappedFile file(path, "ANN index file");
+  std::string_view bytes = file.view();
+  AnnIndexHeader header;
+  if (bytes.size() < sizeof(header) || std::memcmp(bytes.data(), ANN_MAGIC, sizeof(ANN_MAGIC)) != 0) {
+    throw std::runtime_error("Not a slang_trainer ANN index file: " + path);
+  }
+  std::memcpy(&header, bytes.data(), sizeof(header));
+  if (header.version != ANN_VERSION || header.headerSize != sizeof(AnnIndexHeader) || header.links != ANN_LINKS ||
+      header.baseLinks != ANN_BASE_LINKS) {
+    throw std::runtime_error("Unsupported ANN index file version in " + path);
+  }
+  Checksum64 checksum;
+  checksum.update(bytes.data() + sizeof(header), bytes.size() - sizeof(header));
+  if (checksum.finish() != header.checksum) {
+    throw std::runtime_error("ANN index file checksum mismatch: " + path);
+  }
+  const std::uint64_t nodes = header.nodeCount;
+  auto check = [&](const StateSection &section, std::uint64_t expected) {
+    if (section.offset % 8 != 0 || section.offset > bytes.size() || section.size > bytes.size() - section.offset ||
+        (expected != 0 && section.size != expected)) {
+      throw std::runtime_error("Corrupt ANN index file (bad section bounds): " + path);
+    }
+  };
+  check(header.stringOffsets, (std::uint64_t{header.dim} + nodes + 1) * sizeof(std::uint64_t));
+  check(header.stringData, 0);
+  check(header.vectors, nodes * header.dim * sizeof(float));
+  check(header.levels, nodes);
+  check(header.baseLinkData, nodes * (ANN_BASE_LINKS + 1) * sizeof(std::uint32_t));
+  check(header.upperOffsets, (nodes + 1) * sizeof(std::uint64_t));
+  check(header.upperLinkData, 0);
+  auto section = [&](const StateSection &ref) { return bytes.data() + ref.offset; };
+
+  const auto *stringOffsets = reinterpret_cast<const std::uint64_t *>(section(header.stringOffsets));
+  phrases.clear();
+  phrases.reserve(nodes);
+  for (std::uint64_t i = header.dim; i < header.dim + nodes; ++i) {
+    if (stringOffsets[i] > stringOffsets[i + 1] || stringOffsets[i + 1] > header.stringData.size) {
+      throw std::runtime_error("Corrupt ANN index file (bad string offset): " + path);
+    }
+    phrases.emplace_back(section(header.stringData) + stringOffsets[i], stringOffsets[i + 1] - stringOffsets[i]);
+  }
+
+  index = AnnIndex{};
+  index.dim = header.dim;
+  const auto *vectors = reinterpret_cast<const float *>(section(header.vectors));
+  index.vectors.assign(vectors, vectors + nodes * header.dim);
+  index.phrases.resize(nodes);
+  std::iota(index.phrases.begin(), index.phrases.end(), 0u);
+  const auto *levels = reinterpret_cast<const std::uint8_t *>(section(header.levels));
+  index.levels.assign(levels, levels + nodes);
+  const auto *baseLinks = reinterpret_cast<const std::uint32_t *>(section(header.baseLinkData));
+  index.baseLinks.assign(baseLinks, baseLinks + nodes * (ANN_BASE_LINKS + 1));
+  const auto *upperOffsets = reinterpret_cast<const std::uint64_t *>(section(header.upperOffsets));
+  const auto *upperLinks = reinterpret_cast<const std::uint32_t *>(section(header.upperLinkData));
+  index.upperLinks.resize(nodes);
+  for (std::uint64_t i = 0; i < nodes; ++i) {
+    const std::uint64_t begin = upperOffsets[i];
+    const std::uint64_t end = upperOffsets[i + 1];
+    if (begin > end || end > header.upperLinkData.size / sizeof(std::uint32_t) ||
+        end - begin != std::uint64_t{index.levels[i]} * (ANN_LINKS + 1)) {
+      throw std::runtime_error("Corrupt ANN index file (bad link offsets): " + path);
+    }
+    index.upperLinks[i].assign(upperLinks + begin, upperLinks + end);
+  }
+  auto checkLinks = [&](const std::uint32_t *list, std::size_t limit) {
+    if (list[0] > limit || std::any_of(list + 1, list + 1 + list[0], [&](std::uint32_t node) { return node >= nodes; })) {
+      throw std::runtime_error("Corrupt ANN index file (bad link): " + path);
+    }
+  };
+  for (std::uint32_t node = 0; node < nodes; ++node) {
+    checkLinks(index.links(node, 0), ANN_BASE_LINKS);
+    for (int level = 1; level <= index.levels[node]; ++level)
+      checkLinks(index.links(node, level), ANN_LINKS);
+  }
+  if (nodes > 0 && (header.entryPoint >= nodes || header.maxLevel != index.levels[header.entryPoint])) {
+    throw std::runtime_error("Corrupt ANN index file (bad entry point): " + path);
+  }
+  index.entryPoint = nodes > 0 ? header.entryPoint : NO_ID;
+  index.maxLevel = nodes > 0 ? header.maxLevel : -1;
+}
+
+// Per-worker buffers reused across rows so ingest only allocates when a new key is interned.
+struct IngestScratch {
+  std::string lowered;
+  std::string number;
+  std::vector<std::string_view> tokens;
+  std::vector<std::uint32_t> tokenIds;
+  std::vector<std::uint32_t> sliceTokenIds;
+  std::vector<std::uint32_t> uniqueTokens;
+};
+
+// `phraseToken` is the phrase's own token id (NO_ID if it never occurred as a token); it is not
+// counted as context for itself.
+void updateStats(PhraseStats &stats, std::uint32_t region, std::int64_t score, const std::vector<std::uint32_t> &tokens,
+                 std::uint32_t phraseToken, const std::vector<std::uint8_t> &contextToken) {
+  stats.count += 1;
+  addScoreUnits(stats.scoreSum, score);
+  if (region != NO_ID) {
+    stats.regionCounts.add(region);
+  }
+  for (std::uint32_t token : tokens) {
+    if (!contextToken[token])
+      continue;
+    if (token == phraseToken)
+      continue;
+    stats.tokenCounts.add(token);
+  }
+}
+
+std::vector<IdCount> topEntries(const CountVector &counts, const StringInterner &names, std::size_t limit) {
+  std::vector<IdCount> entries(counts.entries.begin(), counts.entries.end());
+  auto byCount = [&](const IdCount &a, const IdCount &b) {
+    return a.second != b.second ? a.second > b.second : names.str(a.first) < names.str(b.first);
+  };
+  if (entries.size() > limit) {
+    std::partial_sort(entries.begin(), entries.begin() + static_cast<std::ptrdiff_t>(limit), entries.end(), byCount);
+    entries.resize(limit);
+  } else {
+    std::sort(entries.begin(), entries.end(), byCount);
+  }
+  return entries;
+}
+
+// Counts one context of an interned phrase into its stats and the corpus totals.
+void countContext(CorpusStats &corpus, std::uint32_t phraseId, std::uint32_t regionId, std::int64_t score,
+                  const std::vector<std::uint32_t> &tokenIds, IngestScratch &scratch) {
+  updateStats(corpus.stats[phraseId], regionId, score, tokenIds, corpus.tokens.find(corpus.phrases.str(phraseId)),
+              corpus.contextToken);
+  corpus.totals.totalContexts += 1;
+  scratch.uniqueTokens.assign(tokenIds.begin(), tokenIds.end());
+  std::sort(scratch.uniqueTokens.begin(), scratch.uniqueTokens.end());
+  auto last = std::unique(scratch.uniqueTokens.begin(), scratch.uniqueTokens.end());
+  for (auto it = scratch.uniqueTokens.begin(); it != last; ++it) {
+    corpus.totals.tokenTotals[*it] += 1;
+  }
+}
+
+void ingestLine(std::string_view line, CorpusStats &corpus, IngestScratch &scratch) {
+  TsvRow columns;
+  if (splitTsv(line, columns) < TSV_COLUMNS)
+    return;
+  std::string_view phrase = columns[0];
+  std::string_view region = columns[2];
+  tokenize(columns[4], scratch.lowered, scratch.tokens);
+  std::int64_t score = scoreUnits(parseScore(columns[3], scratch.number));
+  scratch.tokenIds.clear();
+  for (std::string_view token : scratch.tokens) {
+    scratch.tokenIds.push_back(internToken(corpus, token));
+  }
+  std::uint32_t phraseId = internPhrase(corpus, phrase);
+  std::uint32_t regionId = region.empty() ? NO_ID : corpus.regions.intern(region);
+  countContext(corpus, phraseId, regionId, score, scratch.tokenIds, scratch);
+  if (corpus.sliceRegions && regionId != NO_ID) {
+    // The slice is handed the corpus's own views of the strings, which its interners keep.
+    CorpusStats &slice = regionSlice(corpus, regionId);
+    scratch.sliceTokenIds.clear();
+    for (std::uint32_t token : scratch.tokenIds) {
+      scratch.sliceTokenIds.push_back(internToken(slice, corpus.tokens.str(token)));
+    }
+    countContext(slice, internPhrase(slice, corpus.phrases.str(phraseId)),
+                 slice.regions.intern(corpus.regions.str(regionId)), score, scratch.sliceTokenIds, scratch);
+  }
+}
+
+// Ingests every line that starts inside [begin, end) of the mapped input. The first line of the file is the header.
+void ingestRange(std::string_view input, std::size_t begin, std::size_t end, CorpusStats &corpus) {
+  IngestScratch scratch;
+  std::size_t pos = begin;
+  while (pos < end) {
+    const void *newline = std::memchr(input.data() + pos, '\n', input.size() - pos);
+    std::size_t lineEnd = newline ? static_cast<const char *>(newline) - input.data() : input.size();
+    if (pos != 0) {
+      ingestLine(input.substr(pos, lineEnd - pos), corpus, scratch);
+    }
+    pos = lineEnd + 1;
+  }
+}
+
+// Splits the input into `shards` byte ranges whose boundaries fall on line starts.
+std::vector<std::pair<std::size_t, std::size_t>> splitInputRanges(std::string_view input, std::size_t shards) {
+  std::vector<std::size_t> bounds{0};
+  for (std::size_t k = 1; k < shards; ++k) {
+    std::size_t target = input.size() * k / shards;
+    if (target <= bounds.back())
+      continue;
+    std::size_t newline = input.find('\n', target - 1);
+    if (newline == std::string_view::npos || newline + 1 >= input.size())
+      break;
+    if (newline + 1 > bounds.back())
+      bounds.push_back(newline + 1);
+  }
+  bounds.push_back(input.size());
+  std::vector<std::pair<std::size_t, std::size_t>> ranges;
+  for (std::size_t i = 0; i + 1 < bounds.size(); ++i) {
+    ranges.push_back({bounds[i], bounds[i + 1]});
+  }
+  return ranges;
+}
+
+// Folds a compacted shard into `corpus`. Shard ids are re-interned in shard id order, so merging
+// shards in file order assigns the same ids a single-threaded pass would. The shard's region slices
+// are repointed at the corpus's strings and folded into the corpus's slices the same way.
+void mergeShard(CorpusStats &corpus, CorpusStats &shard) {
+  std::vector<std::uint32_t> tokenIds(shard.tokens.size());
+  for (std::uint32_t t = 0; t < shard.tokens.size(); ++t) {
+    tokenIds[t] = internToken(corpus, shard.tokens.str(t));
+    corpus.totals.tokenTotals[tokenIds[t]] += shard.totals.tokenTotals[t];
+  }
+  std::vector<std::uint32_t> regionIds(shard.regions.size());
+  for (std::uint32_t r = 0; r < shard.regions.size(); ++r) {
+    regionIds[r] = corpus.regions.intern(shard.regions.str(r));
+  }
+  corpus.totals.totalContexts += shard.totals.totalContexts;
+  for (std::uint32_t p = 0; p < shard.stats.size(); ++p) {
+    const PhraseStats &from = shard.stats[p];
+    PhraseStats &into = corpus.stats[internPhrase(corpus, shard.phrases.str(p))];
+    into.count += from.count;
+    addScoreUnits(into.scoreSum, from.scoreSum);
+    for (const auto &region : from.regionCounts.entries) {
+      into.regionCounts.add(regionIds[region.first], region.second);
+    }
+    for (const auto &token : from.tokenCounts.entries) {
+      into.tokenCounts.add(tokenIds[token.first], token.second);
+    }
+  }
+  for (std::uint32_t r = 0; r < shard.regionSlices.size(); ++r) {
+    CorpusStats &slice = shard.regionSlices[r];
+    rebaseViews(slice.phrases, corpus.phrases);
+    rebaseViews(slice.tokens, corpus.tokens);
+    rebaseViews(slice.regions, corpus.regions);
+    mergeShard(regionSlice(corpus, regionIds[r]), slice);
+  }
+}
+
+// Heap bytes behind an interner: its arena blocks, the id-to-string array and the slot table.
+// Budget accounting goes by sizes rather than capacities: capacities depend on how shards were
+// merged and compacted, which would make the pruning (and so the model) depend on --threads.
+std::uint64_t internerBytes(const StringInterner &table) {
+  return table.arena.reserved + table.strings.size() * sizeof(std::string_view) +
+         table.slots.size() * sizeof(StringInterner::Slot);
+}
+
+std::uint64_t countBytes(const CountVector &counts) {
+  return (counts.entries.size() + counts.pending.size()) * sizeof(IdCount);
+}
+
+// Approximate resident size of the corpus tables, as compared against --memory-budget.
+std::uint64_t corpusBytes(const CorpusStats &corpus) {
+  std::uint64_t bytes = internerBytes(corpus.phrases) + internerBytes(corpus.tokens) + internerBytes(corpus.regions);
+  bytes += corpus.stats.capacity() * sizeof(PhraseStats);
+  for (const auto &stat : corpus.stats) {
+    bytes += countBytes(stat.regionCounts) + countBytes(stat.tokenCounts);
+  }
+  bytes += corpus.totals.tokenTotals.capacity() * sizeof(std::uint64_t) + corpus.contextToken.capacity();
+  bytes += corpus.approx.tokenSeeds.capacity() * sizeof(std::uint64_t);
+  bytes += corpus.approx.sketch.cells.capacity() * sizeof(std::uint64_t);
+  return bytes;
+}
+
+constexpr std::uint32_t SKETCH_DEPTH = 4;
+constexpr std::uint64_t PRUNE_HISTOGRAM = 4096; // thresholds are searched up to this count
+
+// Drops tokens no phrase or centroid refers to whose totals are at most `threshold`, moving their
+// totals into the sketch. Survivors are renumbered in id order, so every CountVector stays sorted.
+void evictTokens(CorpusStats &corpus, std::uint64_t threshold) {
+  ApproxCounts &approx = corpus.approx;
+  const std::size_t tokenCount = corpus.tokens.size();
+  std::vector<std::uint8_t> keep(tokenCount, 0);
+  for (const auto &stat : corpus.stats) {
+    for (const auto &entry : stat.tokenCounts.entries)
+      keep[entry.first] = 1;
+  }
+  for (std::uint32_t token : corpus.centroids.tokens)
+    keep[token] = 1;
+  std::vector<std::uint32_t> remap(tokenCount, NO_ID);
+  StringInterner survivors;
+  std::vector<std::uint64_t> totals;
+  std::vector<std::uint8_t> contextToken;
+  std::vector<std::uint64_t> seeds;
+  for (std::uint32_t t = 0; t < tokenCount; ++t) {
+    const std::uint64_t total = corpus.totals.tokenTotals[t];
+    if (!keep[t] && total <= threshold) {
+      const std::uint64_t mass = total - std::min(total, approx.tokenSeeds[t]);
+      if (mass > 0)
+        approx.sketch.add(corpus.tokens.str(t), mass);
+      approx.evictedMass += mass;
+      approx.evictedTokens += 1;
+      continue;
+    }
+    remap[t] = survivors.intern(corpus.tokens.str(t));
+    totals.push_back(total);
+    contextToken.push_back(corpus.contextToken[t]);
+    seeds.push_back(approx.tokenSeeds[t]);
+  }
+  if (survivors.size() == tokenCount)
+    return;
+  for (auto &stat : corpus.stats) {
+    for (auto &entry : stat.tokenCounts.entries)
+      entry.first = remap[entry.first];
+  }
+  for (auto &token : corpus.centroids.tokens)
+    token = remap[token];
+  corpus.tokens = std::move(survivors);
+  corpus.totals.tokenTotals = std::move(totals);
+  corpus.contextToken = std::move(contextToken);
+  approx.tokenSeeds = std::move(seeds);
+}
+
+// Keeps the corpus under `budget` bytes, lossy-counting style: when it is over, every phrase drops
+// its token entries counted at most t times and tokens left unreferenced with totals of at most t are
+// evicted, with t the smallest threshold predicted to bring the tables to 3/4 of the budget (capped
+// at PRUNE_HISTOGRAM, since phrases and regions are never dropped). Each call adds t to the token
+// count error bound.
+void enforceMemoryBudget(CorpusStats &corpus, std::uint64_t budget) {
+  if (budget == 0)
+    return;
+  compactAll(corpus);
+  std::uint64_t bytes = corpusBytes(corpus);
+  if (bytes <= budget)
+    return;
+  ApproxCounts &approx = corpus.approx;
+  if (!approx.active()) {
+    // The sketch takes about 1/32 of the budget.
+    std::uint64_t width = 1024;
+    while (width * 2 * SKETCH_DEPTH * sizeof(std::uint64_t) <= budget / 32 && width < (1u << 26))
+      width *= 2;
+    approx.sketch.reset(static_cast<std::uint32_t>(width), SKETCH_DEPTH);
+    approx.tokenSeeds.assign(corpus.tokens.size(), 0);
+    bytes = corpusBytes(corpus);
+  }
+
+  // Entries and tokens by count, to predict what each threshold frees. A token whose total is at
+  // most the threshold has no entry above it, so it is evicted too (unless it is a centroid column).
+  const std::uint64_t target = budget / 4 * 3;
+  std::vector<std::uint64_t> entriesAt(PRUNE_HISTOGRAM + 1, 0);
+  std::vector<std::uint64_t> tokensAt(PRUNE_HISTOGRAM + 1, 0);
+  std::uint64_t entryBytes = 0;
+  std::uint64_t entries = 0;
+  for (const auto &stat : corpus.stats) {
+    entryBytes += countBytes(stat.tokenCounts);
+    entries += stat.tokenCounts.size();
+    for (const auto &entry : stat.tokenCounts.entries)
+      entriesAt[std::min(entry.second, PRUNE_HISTOGRAM)] += 1;
+  }
+  for (std::uint64_t total : corpus.totals.tokenTotals)
+    tokensAt[std::min(total, PRUNE_HISTOGRAM)] += 1;
+  const std::uint64_t tokenCount = std::max<std::uint64_t>(1, corpus.tokens.size());
+  const std::uint64_t bytesPerToken = internerBytes(corpus.tokens) / tokenCount + 2 * sizeof(std::uint64_t) + 1;
+  const std::uint64_t otherBytes = bytes - entryBytes;
+
+  std::uint64_t threshold = 0;
+  std::uint64_t droppedEntries = 0;
+  std::uint64_t droppedTokens = tokensAt[0];
+  while (threshold < PRUNE_HISTOGRAM) {
+    ++threshold;
+    droppedEntries += entriesAt[threshold];
+    droppedTokens += tokensAt[threshold];
+    const std::uint64_t predicted = otherBytes - std::min(otherBytes, droppedTokens * bytesPerToken) +
+                                    (entries - droppedEntries) * sizeof(IdCount);
+    if (predicted <= target)
+      break;
+  }
+  for (auto &stat : corpus.stats) {
+    auto &counts = stat.tokenCounts.entries;
+    const std::size_t before = counts.size();
+    counts.erase(std::remove_if(counts.begin(), counts.end(),
+                                [&](const IdCount &entry) { return entry.second <= threshold; }),
+                 counts.end());
+    if (counts.size() != before) {
+      counts.shrink_to_fit();
+      approx.prunedEntries += before - counts.size();
+    }
+  }
+  evictTokens(corpus, threshold);
+  approx.tokenCountError += threshold;
+}
+
+// Ingests the lines starting in [begin, end) of the input on `threads` workers, each filling its own
+// shard, then folds the shards into `corpus` in file order. Counts are exact; score sums are only
+// reassociated per shard.
+void ingestWindow(std::string_view input, std::size_t begin, std::size_t end, std::size_t threads,
+                  CorpusStats &corpus) {
+  auto ranges = splitInputRanges(input.substr(begin, end - begin), threads);
+  for (auto &range : ranges) {
+    range.first += begin;
+    range.second += begin;
+  }
+  if (ranges.size() <= 1) {
+    ingestRange(input, begin, end, corpus);
+    compactAll(corpus);
+    return;
+  }
+  std::vector<CorpusStats> shards(ranges.size());
+  for (auto &shard : shards)
+    shard.sliceRegions = corpus.sliceRegions;
+  std::vector<std::exception_ptr> errors(ranges.size());
+  std::vector<std::thread> workers;
+  workers.reserve(ranges.size());
+  for (std::size_t i = 0; i < ranges.size(); ++i) {
+    workers.emplace_back([&, i]() {
+      try {
+        ingestRange(input, ranges[i].first, ranges[i].second, shards[i]);
+        compactAll(shards[i]);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  for (const auto &error : errors) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+  for (auto &shard : shards) {
+    mergeShard(corpus, shard);
+    shard = CorpusStats();
+  }
+  compactAll(corpus);
+}
+
+constexpr std::size_t STREAM_WINDOW_BYTES = 64 << 20; // streamed input per ingest window without a budget
+
+// Ingests a streamed input in line-aligned windows of `windowBytes`, cut where ingestFile cuts a
+// mapped file, each spread over `threads` workers while the decoder thread fills the next one.
+// Returns the decoded size.
+std::uint64_t ingestStream(int fd, const std::string &path, std::size_t threads, CorpusStats &corpus,
+                           std::uint64_t memoryBudget, std::size_t windowBytes) {
+  InputStream stream(fd, path == "-" ? "stdin" : path, windowBytes / InputStream::CHUNK_BYTES);
+  std::string window;
+  std::string chunk;
+  std::uint64_t bytes = 0;
+  std::size_t begin = 0;
+  for (bool more = true; more;) {
+    more = stream.next(chunk);
+    if (more) {
+      window.append(chunk);
+      bytes += chunk.size();
+    }
+    // Cuts every full window the buffer holds; at the end of the input the rest is the last one.
+    while (window.size() > begin) {
+      std::size_t end = window.size();
+      if (window.size() - begin > windowBytes) {
+        const std::size_t newline = window.find('\n', begin + windowBytes - 1);
+        if (newline != std::string::npos) {
+          end = newline + 1;
+        } else if (more) {
+          break;
+        }
+      } else if (more) {
+        break;
+      }
+      ingestWindow(window, begin, end, threads, corpus);
+      enforceMemoryBudget(corpus, memoryBudget);
+      // ingestRange treats offset 0 as the header line, so the carried-over partial line keeps a
+      // newline in front of it.
+      window.replace(0, end, "\n");
+      begin = 1;
+    }
+  }
+  return bytes;
+}
+
+// Ingests the TSV into `corpus` and returns its size in bytes. With a memory budget the file is taken
+// in line-aligned windows of half the budget, and the budget is enforced after each one; the windows
+// do not depend on `threads`, so neither do the results. Gzip and zstd files, stdin ("-") and pipes
+// are decoded on a separate thread and always taken in windows.
+std::uint64_t ingestFile(const std::string &path, std::size_t threads, CorpusStats &corpus,
+                         std::uint64_t memoryBudget) {
+  const int streamed = openStreamedInput(path);
+  if (streamed >= 0) {
+    const std::size_t windowBytes =
+        memoryBudget == 0 ? STREAM_WINDOW_BYTES : std::max<std::uint64_t>(memoryBudget / 2, 1 << 20);
+    return ingestStream(streamed, path, threads, corpus, memoryBudget, windowBytes);
+  }
+  MappedFile file(path, "input TSV");
+  std::string_view input = file.view();
+  if (memoryBudget == 0) {
+    ingestWindow(input, 0, input.size(), threads, corpus);
+    return input.size();
+  }
+  const std::size_t windowBytes = std::max<std::uint64_t>(memoryBudget / 2, 1 << 20);
+  for (std::size_t begin = 0; begin < input.size();) {
+    std::size_t end = input.size();
+    if (input.size() - begin > windowBytes) {
+      std::size_t newline = input.find('\n', begin + windowBytes - 1);
+      end = newline == std::string_view::npos ? input.size() : newline + 1;
+    }
+    ingestWindow(input, begin, end, threads, corpus);
+    enforceMemoryBudget(corpus, memoryBudget);
+    file.release(end);
+    begin = end;
+  }
+  return input.size();
+}
+
+// Reports the interners' hash maps and the per-id tables to the profiler.
+void profileCorpusTables(Profiler &profiler, const CorpusStats &corpus) {
+  auto interner = [&](const char *name, const StringInterner &table) {
+    profiler.table(name, table.size(), table.slots.size(), internerBytes(table));
+  };
+  interner("phraseIds", corpus.phrases);
+  interner("tokenIds", corpus.tokens);
+  interner("regionIds", corpus.regions);
+  std::uint64_t countEntries = 0;
+  std::uint64_t countBytes = 0;
+  for (const auto &stat : corpus.stats) {
+    countEntries += stat.regionCounts.size() + stat.tokenCounts.size();
+    countBytes += (stat.regionCounts.entries.capacity() + stat.tokenCounts.entries.capacity()) * sizeof(IdCount);
+  }
+  profiler.table("phraseStats", corpus.stats.size(), 0, corpus.stats.capacity() * sizeof(PhraseStats));
+  profiler.table("phraseCounts", countEntries, 0, countBytes);
+  profiler.table("tokenTotals", corpus.totals.tokenTotals.size(), 0,
+                 corpus.totals.tokenTotals.capacity() * sizeof(std::uint64_t));
+  if (!corpus.regionSlices.empty()) {
+    std::uint64_t sliceBytes = 0;
+    for (const auto &slice : corpus.regionSlices)
+      sliceBytes += corpusBytes(slice);
+    profiler.table("regionSlices", corpus.regionSlices.size(), 0, sliceBytes);
+  }
+  if (corpus.approx.active()) {
+    profiler.table("tokenSketch", corpus.approx.sketch.cells.size(), 0,
+                   corpus.approx.sketch.cells.capacity() * sizeof(std::uint64_t));
+  }
+}
+
+// Multi-word candidate mining (--mine-output). The input's contexts are read again as one token-id
+// sequence, each context ended by NO_ID (which also stands in for tokens the memory budget evicted),
+// and a suffix array over it, sorted to --mine-max-length tokens, puts all occurrences of an n-gram
+// in one run of adjacent suffixes. Suffixes are bucketed by their first token, so buckets sort and
+// scan in parallel. Every run of --mine-min-count or more is a frequent n-gram; it is scored by its
+// weakest split, the min over k of log(P(gram) / (P(first k tokens) P(the rest))), where every part's
+// probability, single tokens included, is its occurrence count in the sequence over the input's
+// token positions, so independent parts score about 0 and --state-in history does not skew it. Grams
+// the corpus already has as phrases are left out.
+struct MinedGram {
+  std::uint32_t position; // an occurrence in the token sequence
+  std::uint32_t length;
+  std::uint64_t count;
+  double pmi = 0.0;
+  std::string phrase;
+};
+
+// Appends the context tokens of every line starting in [begin, end) to `sequence`; offset 0 of
+// `input` is the header line, as in ingestRange.
+void appendContextTokens(std::string_view input, std::size_t begin, std::size_t end, std::size_t threads,
+                         const CorpusStats &corpus, std::vector<std::uint32_t> &sequence, std::uint64_t &contexts) {
+  auto ranges = splitInputRanges(input.substr(begin, end - begin), std::max<std::size_t>(1, threads));
+  std::vector<std::vector<std::uint32_t>> parts(ranges.size());
+  std::vector<std::uint64_t> rows(ranges.size(), 0);
+  parallelFor(ranges.size(), threads, [&](std::size_t, std::size_t r) {
+    IngestScratch scratch;
+    TsvRow columns;
+    const std::size_t stop = begin + ranges[r].second;
+    for (std::size_t pos = begin + ranges[r].first; pos < stop;) {
+      const void *newline = std::memchr(input.data() + pos, '\n', input.size() - pos);
+      std::size_t lineEnd = newline ? static_cast<const char *>(newline) - input.data() : input.size();
+      if (pos != 0 && splitTsv(input.substr(pos, lineEnd - pos), columns) >= TSV_COLUMNS) {
+        tokenize(columns[4], scratch.lowered, scratch.tokens);
+        for (std::string_view token : scratch.tokens) {
+          parts[r].push_back(corpus.tokens.find(token));
+        }
+        parts[r].push_back(NO_ID);
+        rows[r] += 1;
+      }
+      pos = lineEnd + 1;
+    }
+  });
+  for (std::size_t r = 0; r < ranges.size(); ++r) {
+    sequence.insert(sequence.end(), parts[r].begin(), parts[r].end());
+    contexts += rows[r];
+  }
+}
+
+// The input's context tokens, read the way ingestFile reads it.
+std::vector<std::uint32_t> readContextTokens(const std::string &path, std::size_t threads, const CorpusStats &corpus,
+                                             std::uint64_t &contexts) {
+  std::vector<std::uint32_t> sequence;
+  const int streamed = openStreamedInput(path);
+  if (streamed < 0) {
+    MappedFile file(path, "input TSV");
+    appendContextTokens(file.view(), 0, file.view().size(), threads, corpus, sequence, contexts);
+    return sequence;
+  }
+  InputStream stream(streamed, path, STREAM_WINDOW_BYTES / InputStream::CHUNK_BYTES);
+  std::string window;
+  std::string chunk;
+  for (bool more = true; more;) {
+    more = stream.next(chunk);
+    if (more)
+      window.append(chunk);
+    if (more && window.size() <= STREAM_WINDOW_BYTES)
+      continue;
+    const std::size_t newline = more ? window.rfind('\n') : std::string::npos;
+    const std::size_t end = newline == std::string::npos ? window.size() : newline + 1;
+    if (end == 0)
+      continue;
+    appendContextTokens(window, 0, end, threads, corpus, sequence, contexts);
+    // The carried-over partial line keeps a newline in front, so it is not taken for the header.
+    window.replace(0, end, "\n");
+  }
+  return sequence;
+}
+
+// Frequent n-grams of 2..maxLength tokens in `sequence`, with their counts; unscored.
+std::vector<MinedGram> frequentGrams(const std::vector<std::uint32_t> &sequence, std::size_t tokenCount,
+                                     std::size_t maxLength, std::uint64_t minCount, std::size_t threads) {
+  std::vector<std::size_t> offsets(tokenCount + 1, 0);
+  for (std::size_t i = 0; i + 1 < sequence.size(); ++i) {
+    if (sequence[i] != NO_ID && sequence[i + 1] != NO_ID)
+      offsets[sequence[i] + 1] += 1;
+  }
+  for (std::size_t t = 0; t < tokenCount; ++t) {
+    offsets[t + 1] += offsets[t];
+  }
+  std::vector<std::uint32_t> suffixes(offsets.back());
+  std::vector<std::size_t> cursor(offsets.begin(), offsets.end() - 1);
+  for (std::size_t i = 0; i + 1 < sequence.size(); ++i) {
+    if (sequence[i] != NO_ID && sequence[i + 1] != NO_ID)
+      suffixes[cursor[sequence[i]]++] = static_cast<std::uint32_t>(i);
+  }
+  cursor = {};
+
+  // Every context ends in NO_ID, so comparisons stop at it before running off the sequence.
+  auto shared = [&](std::uint32_t a, std::uint32_t b) {
+    std::size_t k = 1;
+    while (k < maxLength && sequence[a + k] == sequence[b + k] && sequence[a + k] != NO_ID)
+      ++k;
+    return k;
+  };
+  std::vector<std::vector<MinedGram>> found(std::max<std::size_t>(1, threads));
+  std::vector<std::vector<std::size_t>> prefix(found.size());
+  parallelFor(tokenCount, threads, [&](std::size_t worker, std::size_t token) {
+    const std::size_t begin = offsets[token];
+    const std::size_t size = offsets[token + 1] - begin;
+    if (size < minCount)
+      return;
+    auto first = suffixes.begin() + static_cast<std::ptrdiff_t>(begin);
+    std::sort(first, first + static_cast<std::ptrdiff_t>(size), [&](std::uint32_t a, std::uint32_t b) {
+      for (std::size_t k = 1; k < maxLength; ++k) {
+        if (sequence[a + k] != sequence[b + k])
+          return sequence[a + k] < sequence[b + k];
+        if (sequence[a + k] == NO_ID)
+          return false;
+      }
+      return false;
+    });
+    // prefix[j]: tokens suffix j shares with suffix j - 1. Bigrams share two, so the bucket is one run.
+    std::vector<std::size_t> &lcp = prefix[worker];
+    lcp.assign(size, 0);
+    for (std::size_t j = 1; j < size; ++j) {
+      lcp[j] = shared(first[static_cast<std::ptrdiff_t>(j - 1)], first[static_cast<std::ptrdiff_t>(j)]);
+    }
+    for (std::size_t n = 2; n <= maxLength; ++n) {
+      for (std::size_t start = 0; start < size;) {
+        std::size_t stop = start + 1;
+        while (stop < size && lcp[stop] >= n)
+          ++stop;
+        if (stop - start >= minCount && stop - start >= 2)
+          found[worker].push_back({first[static_cast<std::ptrdiff_t>(start)], static_cast<std::uint32_t>(n),
+                                   stop - start, 0.0, {}});
+        start = stop;
+      }
+    }
+  });
+  std::vector<MinedGram> grams;
+  for (auto &part : found) {
+    std::move(part.begin(), part.end(), std::back_inserter(grams));
+  }
+  return grams;
+}
+
+void mineCandidates(const Options &options, const CorpusStats &corpus, std::ostream &log) {
+  std::uint64_t contexts = 0;
+  const std::vector<std::uint32_t> sequence = readContextTokens(options.inputPath, options.threads, corpus, contexts);
+  if (sequence.size() > NO_ID) {
+    throw std::runtime_error("--mine-output supports at most 2^32 context tokens per input.");
+  }
+  std::vector<MinedGram> grams =
+      frequentGrams(sequence, corpus.tokens.size(), options.mineMaxLength, options.mineMinCount, options.threads);
+  const std::size_t frequent = grams.size();
+
+  auto gramKey = [&](std::uint32_t position, std::size_t length) {
+    return std::string(reinterpret_cast<const char *>(sequence.data() + position), length * sizeof(std::uint32_t));
+  };
+  std::unordered_map<std::string, std::uint64_t> gramCounts;
+  gramCounts.reserve(grams.size());
+  for (const MinedGram &gram : grams) {
+    gramCounts.emplace(gramKey(gram.position, gram.length), gram.count);
+  }
+  std::vector<std::uint64_t> tokenCounts(corpus.tokens.size(), 0);
+  for (std::uint32_t token : sequence) {
+    if (token != NO_ID)
+      tokenCounts[token] += 1;
+  }
+  // Every part of a frequent gram is at least as frequent, so longer parts are always in gramCounts.
+  const double positions = static_cast<double>(sequence.size() - contexts);
+  auto logProbability = [&](std::uint32_t position, std::size_t length) {
+    const std::uint64_t count =
+        length == 1 ? tokenCounts[sequence[position]] : gramCounts.at(gramKey(position, length));
+    return std::log(static_cast<double>(count) / positions);
+  };
+  parallelFor(grams.size(), options.threads, [&](std::size_t, std::size_t i) {
+    MinedGram &gram = grams[i];
+    const double joint = logProbability(gram.position, gram.length);
+    gram.pmi = std::numeric_limits<double>::infinity();
+    for (std::size_t k = 1; k < gram.length; ++k) {
+      gram.pmi = std::min(gram.pmi, joint - logProbability(gram.position, k) -
+                                        logProbability(gram.position + static_cast<std::uint32_t>(k), gram.length - k));
+    }
+    for (std::size_t k = 0; k < gram.length; ++k) {
+      if (k > 0)
+        gram.phrase += ' ';
+      gram.phrase += corpus.tokens.str(sequence[gram.position + k]);
+    }
+  });
+  grams.erase(std::remove_if(grams.begin(), grams.end(),
+                             [&](const MinedGram &gram) {
+                               return gram.pmi <= 0.0 || corpus.phrases.find(gram.phrase) != NO_ID;
+                             }),
+              grams.end());
+  std::sort(grams.begin(), grams.end(), [](const MinedGram &a, const MinedGram &b) {
+    if (a.pmi != b.pmi)
+      return a.pmi > b.pmi;
+    if (a.count != b.count)
+      return a.count > b.count;
+    return a.phrase < b.phrase;
+  });
+  if (grams.size() > options.mineLimit)
+    grams.resize(options.mineLimit);
+
+  std::ofstream out(options.mineOutputPath);
+  if (!out) {
+    throw std::runtime_error("Failed to open mining output file: " + options.mineOutputPath);
+  }
+  OutputBuffer buf;
+  buf.raw("{\n  \"summary\": {\"contexts\": ").integer(contexts);
+  buf.raw(", \"tokens\": ").integer(sequence.size() - contexts);
+  buf.raw(", \"maxLength\": ").integer(options.mineMaxLength);
+  buf.raw(", \"minCount\": ").integer(options.mineMinCount);
+  buf.raw(", \"frequentGrams\": ").integer(frequent);
+  buf.raw(", \"candidates\": ").integer(grams.size()).raw("},\n");
+  buf.raw("  \"candidates\": [");
+  for (std::size_t i = 0; i < grams.size(); ++i) {
+    buf.raw(i > 0 ? ",\n" : "\n");
+    buf.raw("    {\"phrase\": \"").escaped(grams[i].phrase).raw("\", \"length\": ").integer(grams[i].length);
+    buf.raw(", \"count\": ").integer(grams[i].count).raw(", \"pmi\": ").fixed4(grams[i].pmi).raw("}");
+  }
+  buf.raw(grams.empty() ? "]\n}\n" : "\n  ]\n}\n");
+  buf.flushTo(out);
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Failed to write mining output file: " + options.mineOutputPath);
+  }
+  log << "Wrote " << grams.size() << " mined phrase candidates to " << options.mineOutputPath << "\n";
+}
+
+EmbeddingFormat embeddingFormat(const Options &options) {
+  EmbeddingFormat format;
+  format.storage = options.embeddingStorage == "int8"     ? EmbeddingStorage::Int8
+                   : options.embeddingStorage == "sparse" ? EmbeddingStorage::Sparse
+                                                          : EmbeddingStorage::Dense;
+  format.projection = options.embeddingProjection;
+  format.seed = options.seed;
+  return format;
+}
+
+// Replaces projected centroids with their clusters' means over the token columns.
+void tokenSpaceCentroids(const Options &options, const CorpusStats &corpus, const std::vector<std::uint32_t> &vocab,
+                         KMeansResult &result) {
+  EmbeddingFormat sparse;
+  sparse.storage = EmbeddingStorage::Sparse;
+  const Embeddings rows = buildEmbeddings(corpus, vocab, options.minCount, options.minPmi, options.threads, sparse);
+  const std::size_t clusterCount = result.clusterCount();
+  const std::size_t dim = vocab.size();
+  std::vector<double> sums(clusterCount * dim, 0.0);
+  std::vector<std::size_t> counts(clusterCount, 0);
+  for (std::size_t i = 0; i < rows.size(); ++i) {
+    const std::size_t c = static_cast<std::size_t>(result.assignments[i]);
+    rows.accumulate(i, sums.data() + c * dim, 0, dim);
+    counts[c] += 1;
+  }
+  result.dim = dim;
+  result.centroids.assign(clusterCount * dim, 0.0f);
+  for (std::size_t c = 0; c < clusterCount; ++c) {
+    for (std::size_t d = 0; counts[c] > 0 && d < dim; ++d) {
+      result.centroids[c * dim + d] = static_cast<float>(sums[c * dim + d] / static_cast<double>(counts[c]));
+    }
+  }
+}
+
+// Runs the configured k-means mode, warm-starting from corpus.centroids when they match --clusters.
+// With --embedding-projection the clustering runs on the projected rows, but the centroids are
+// returned over token columns, so the model, the saved state and the next warm start (projected on
+// the way in) stay in token space.
+KMeansResult clusterEmbeddings(const Options &options, const CorpusStats &corpus, const Model &model) {
+  const EmbeddingFormat format = embeddingFormat(options);
+  std::vector<float> warmStart = projectVectors(
+      warmStartCentroids(corpus.centroids, model.embeddingTokens, options.clusterCount), model.embeddingTokens.size(),
+      format);
+  KMeansResult result =
+      options.kmeansMode == "mini-batch"
+          ? runMiniBatchKMeans(model.embeddings, options.clusterCount, options.clusterIterations, options.batchSize,
+                               options.seed, options.threads, std::move(warmStart))
+          : runKMeans(model.embeddings, options.clusterCount, options.clusterIterations, options.seed, options.threads,
+                      std::move(warmStart));
+  if (result.valid && format.projection > 0)
+    tokenSpaceCentroids(options, corpus, model.embeddingTokens, result);
+  return result;
+}
+
+// Builds the ANN index when it is needed and, with --embedding-neighbors, each phrase's neighbours.
+void buildEmbeddingNeighbors(const Options &options, const CorpusStats &corpus, Model &model) {
+  if (options.embeddingNeighbors == 0 && options.annIndexPath.empty())
+    return;
+  model.annIndex = buildAnnIndex(model.embeddings, options.annEf, options.seed, options.threads);
+  if (options.embeddingNeighbors == 0)
+    return;
+  const AnnIndex &annIndex = model.annIndex;
+  model.embeddingNeighbors.assign(corpus.stats.size(), {});
+  std::vector<AnnScratch> annScratch(std::max<std::size_t>(1, options.threads));
+  parallelFor(annIndex.size(), options.threads, [&](std::size_t worker, std::size_t node) {
+    model.embeddingNeighbors[annIndex.phrases[node]] = annNeighbors(
+        annIndex, static_cast<std::uint32_t>(node), options.embeddingNeighbors, options.annEf, annScratch[worker]);
+  });
+}
+
+Model buildModel(const Options &options, const CorpusStats &corpus, Profiler *profiler = nullptr) {
+  Model model;
+  profileStage(profiler, "pmi_summary", [&] { model.features = summarizeAll(corpus, options.minCount, options.threads); });
+  profileStage(profiler, "embedding", [&] {
+    model.embeddingTokens = selectEmbeddingTokens(corpus, options.embeddingFeatures);
+    model.embeddings = buildEmbeddings(corpus, model.embeddingTokens, options.minCount, options.minPmi,
+                                       options.threads, embeddingFormat(options));
+    if (profiler)
+      profiler->table("embeddings", model.embeddings.size(), 0, model.embeddings.bytes());
+  });
+  profileStage(profiler, "kmeans", [&] { model.clusters = clusterEmbeddings(options, corpus, model); });
+  profileStage(profiler, "related_phrases", [&] {
+    TokenIndex tokenIndex = buildTokenIndex(corpus);
+    model.related = buildRelatedGraph(corpus, tokenIndex, options.minCount, options.relatedLimit, options.threads);
+    if (profiler) {
+      profiler->table("tokenIndex", tokenIndex.postings.size(), 0,
+                      tokenIndex.offsets.capacity() * sizeof(std::size_t) +
+                          tokenIndex.postings.capacity() * sizeof(IdCount));
+    }
+  });
+  if (options.embeddingNeighbors > 0 || !options.annIndexPath.empty()) {
+    profileStage(profiler, "embedding_neighbors", [&] { buildEmbeddingNeighbors(options, corpus, model); });
+  }
+  if (profiler)
+    profiler->kmeansDistanceEvaluations = model.clusters.distanceEvaluations;
+  return model;
+}
+
+// Writes the model JSON, plus the graph TSV and ANN index when requested.
+// One entry of the model JSON's "phrases" array, pretty-printed at the file's indentation.
+void appendPhraseRecord(OutputBuffer &buf, const Options &options, const CorpusStats &corpus, const Model &model,
+                        const std::vector<int> &clusterLookup, std::uint32_t phraseId) {
+  const auto &stat = corpus.stats[phraseId];
+  buf.raw("    {\n");
+  buf.raw("      \"phrase\": \"").escaped(corpus.phrases.str(phraseId)).raw("\",\n");
+  buf.raw("      \"count\": ").integer(stat.count).raw(",\n");
+  buf.raw("      \"avgScore\": ").fixed4(stat.avgScore()).raw(",\n");
+  int clusterId = clusterLookup[phraseId];
+  if (clusterId >= 0) {
+    buf.raw("      \"cluster\": ").integer(clusterId).raw(",\n");
+  }
+  const PhraseFeatureSummary &featureSummary = model.features[phraseId];
+  QualityScores quality = computeQuality(stat, featureSummary);
+  buf.raw("      \"quality\": {\"confidence\": ").fixed4(quality.confidence);
+  buf.raw(", \"evidence\": ").fixed4(quality.evidence).raw("},\n");
+
+  auto regions = topEntries(stat.regionCounts, corpus.regions, 6);
+  buf.raw("      \"regions\": [");
+  for (std::size_t i = 0; i < regions.size(); ++i) {
+    if (i > 0)
+      buf.raw(", ");
+    buf.raw("{\"region\": \"").escaped(corpus.regions.str(regions[i].first));
+    buf.raw("\", \"count\": ").integer(regions[i].second).raw("}");
+  }
+  buf.raw("],\n");
+
+  auto tokens = topEntries(stat.tokenCounts, corpus.tokens, options.topTokens);
+  buf.raw("      \"topContextTokens\": [");
+  for (std::size_t i = 0; i < tokens.size(); ++i) {
+    if (i > 0)
+      buf.raw(", ");
+    double pmi = tokenPmi(stat, tokens[i], corpus.totals);
+    buf.raw("{\"token\": \"").escaped(corpus.tokens.str(tokens[i].first));
+    buf.raw("\", \"count\": ").integer(tokens[i].second).raw(", \"pmi\": ").fixed4(pmi).raw("}");
+  }
+  buf.raw("],\n");
+
+  const RelatedList &related = model.related[phraseId];
+  buf.raw("      \"relatedPhrases\": [");
+  for (std::size_t i = 0; i < related.size(); ++i) {
+    if (i > 0)
+      buf.raw(", ");
+    buf.raw("{\"phrase\": \"").escaped(corpus.phrases.str(related[i].first));
+    buf.raw("\", \"score\": ").fixed4(related[i].second).raw("}");
+  }
+  if (options.embeddingNeighbors > 0) {
+    buf.raw("],\n");
+    const RelatedList &neighbors = model.embeddingNeighbors[phraseId];
+    buf.raw("      \"embeddingNeighbors\": [");
+    for (std::size_t i = 0; i < neighbors.size(); ++i) {
+      if (i > 0)
+        buf.raw(", ");
+      buf.raw("{\"phrase\": \"").escaped(corpus.phrases.str(neighbors[i].first));
+      buf.raw("\", \"similarity\": ").fixed4(neighbors[i].second).raw("}");
+    }
+  }
+  buf.raw("]\n");
+  buf.raw("    }");
+}
+
+// Cluster id per phrase id, -1 where the phrase was not clustered.
+std::vector<int> clusterLookupFor(const CorpusStats &corpus, const KMeansResult &clusters) {
+  std::vector<int> clusterLookup(corpus.stats.size(), -1);
+  if (clusters.valid) {
+    for (std::size_t i = 0; i < clusters.phrases.size(); ++i) {
+      clusterLookup[clusters.phrases[i]] = clusters.assignments[i];
+    }
+  }
+  return clusterLookup;
+}
+
+// The "generatedAt" and "summary" members shared by the full and delta models.
+void appendModelSummary(OutputBuffer &head, const CorpusStats &corpus) {
+  head.raw("  \"generatedAt\": \"");
+  {
+    // Basic ISO timestamp (UTC) using system clock
+    std::time_t now = std::time(nullptr);
+    std::tm *gmt = std::gmtime(&now);
+    char buf[32];
+    if (std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", gmt)) {
+      head.raw(buf);
+    } else {
+      head.raw("1970-01-01T00:00:00Z");
+    }
+  }
+  head.raw("\",\n");
+  head.raw("  \"summary\": {\"totalContexts\": ").integer(corpus.totals.totalContexts);
+  head.raw(", \"phraseCount\": ").integer(corpus.stats.size());
+  if (corpus.approx.active()) {
+    // Bounds on the counts kept under --memory-budget; see ApproxCounts.
+    const ApproxCounts &approx = corpus.approx;
+    head.raw(", \"approximate\": {\"tokenCountError\": ").integer(approx.tokenCountError);
+    head.raw(", \"tokenTotalError\": ").integer(approx.tokenTotalError());
+    head.raw(", \"tokenTotalConfidence\": ").fixed4(1.0 - std::exp(-static_cast<double>(approx.sketch.depth)));
+    head.raw(", \"prunedEntries\": ").integer(approx.prunedEntries);
+    head.raw(", \"evictedTokens\": ").integer(approx.evictedTokens).raw("}");
+  }
+  head.raw("},\n");
+}
+
+// Binary model (--model-bin) for readers that map the file instead of parsing the JSON. It holds the
+// JSON's phrase records and full cluster centroids, laid out like state v2 (little-endian, 8-byte
+// aligned sections, checksum over everything after the header). Strings 0..phraseCount-1 are the
+// emitted phrases in byte order and phrase i's record is records[i], so a lookup is a binary search
+// over the string table; the other strings are the tokens, regions and phrases that lists refer to.
+// Each record's lists are runs of its own section, found by their begin index and length.
+constexpr char MODEL_MAGIC[8] = {'S', 'L', 'G', 'M', 'O', 'D', 'E', 'L'};
+constexpr std::uint32_t MODEL_VERSION = 1;
+constexpr std::uint32_t MODEL_FLAG_EMBEDDING_NEIGHBORS = 1; // records carry (possibly empty) neighbour lists
+
+struct ModelFileHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t headerSize;
+  std::uint64_t totalContexts;
+  std::uint32_t phraseCount; // emitted phrases, also the first phraseCount strings
+  std::uint32_t stringCount;
+  std::uint32_t clusterCount;
+  std::uint32_t centroidDim;
+  std::uint32_t flags;
+  std::uint32_t reserved;
+  StateSection stringOffsets;  // uint64[stringCount + 1] into stringData
+  StateSection stringData;
+  StateSection records;        // ModelPhraseRecord[phraseCount]
+  StateSection regions;        // ModelCountEntry[], a record's top regions
+  StateSection tokens;         // ModelTokenEntry[], a record's top context tokens
+  StateSection links;          // ModelLinkEntry[], a record's related phrases then embedding neighbours
+  StateSection centroidTokens; // uint32[centroidDim] string ids
+  StateSection centroids;      // float[clusterCount * centroidDim], row-major
+  StateSection clusterSizes;   // uint32[clusterCount]
+  std::uint64_t checksum;
+};
+
+struct ModelPhraseRecord {
+  std::uint64_t count;
+  double avgScore;
+  double confidence;
+  double evidence;
+  std::int32_t cluster; // -1 when the phrase has no embedding row
+  std::uint32_t regionBegin;
+  std::uint32_t regionCount;
+  std::uint32_t tokenBegin;
+  std::uint32_t tokenCount;
+  std::uint32_t linkBegin;
+  std::uint32_t relatedCount;
+  std::uint32_t neighborCount;
+};
+
+struct ModelCountEntry {
+  std::uint32_t string;
+  std::uint32_t reserved;
+  std::uint64_t count;
+};
+
+struct ModelTokenEntry {
+  std::uint32_t string;
+  std::uint32_t reserved;
+  std::uint64_t count;
+  double pmi;
+};
+
+struct ModelLinkEntry {
+  std::uint32_t string;
+  std::uint32_t reserved;
+  double score; // related score, or cosine similarity for embedding neighbours
+};
+
+static_assert(sizeof(ModelFileHeader) == 200, "model file header layout changed");
+static_assert(sizeof(ModelPhraseRecord) == 64, "model phrase record layout changed");
+static_assert(sizeof(ModelCountEntry) == 16, "model count entry layout changed");
+static_assert(sizeof(ModelTokenEntry) == 24, "model token entry layout changed");
+static_assert(sizeof(ModelLinkEntry) == 16, "model link entry layout changed");
+
+// Writes the binary model of `orderedPhrases` to `out`, which must be seekable: the header is
+// rewritten with the section offsets and checksum last.
+void writeModelFile(std::ostream &out, const Options &options, const CorpusStats &corpus, const Model &model,
+                    const std::vector<std::uint32_t> &orderedPhrases, const std::vector<int> &clusterLookup) {
+
+  // The top regions and tokens take a partial sort per phrase, like the JSON records.
+  struct PhraseLists {
+    std::vector<IdCount> regions;
+    std::vector<IdCount> tokens;
+  };
+  std::vector<PhraseLists> lists(orderedPhrases.size());
+  parallelFor(orderedPhrases.size(), options.threads, [&](std::size_t, std::size_t i) {
+    const PhraseStats &stat = corpus.stats[orderedPhrases[i]];
+    lists[i].regions = topEntries(stat.regionCounts, corpus.regions, 6);
+    lists[i].tokens = topEntries(stat.tokenCounts, corpus.tokens, options.topTokens);
+  });
+
+  std::vector<std::string_view> strings;
+  std::vector<std::uint32_t> phraseString(corpus.stats.size(), NO_ID);
+  std::vector<std::uint32_t> tokenString(corpus.tokens.size(), NO_ID);
+  std::vector<std::uint32_t> regionString(corpus.regions.size(), NO_ID);
+  auto stringId = [&](std::vector<std::uint32_t> &ids, const StringInterner &names, std::uint32_t id) {
+    if (ids[id] == NO_ID) {
+      ids[id] = static_cast<std::uint32_t>(strings.size());
+      strings.push_back(names.str(id));
+    }
+    return ids[id];
+  };
+  for (std::uint32_t phrase : orderedPhrases) {
+    stringId(phraseString, corpus.phrases, phrase);
+  }
+
+  std::vector<ModelPhraseRecord> records(orderedPhrases.size());
+  std::vector<ModelCountEntry> regions;
+  std::vector<ModelTokenEntry> tokens;
+  std::vector<ModelLinkEntry> links;
+  for (std::size_t i = 0; i < orderedPhrases.size(); ++i) {
+    const std::uint32_t phrase = orderedPhrases[i];
+    const PhraseStats &stat = corpus.stats[phrase];
+    const QualityScores quality = computeQuality(stat, model.features[phrase]);
+    ModelPhraseRecord &record = records[i];
+    record.count = stat.count;
+    record.avgScore = stat.avgScore();
+    record.confidence = quality.confidence;
+    record.evidence = quality.evidence;
+    record.cluster = clusterLookup[phrase];
+    record.regionBegin = static_cast<std::uint32_t>(regions.size());
+    record.regionCount = static_cast<std::uint32_t>(lists[i].regions.size());
+    for (const auto &entry : lists[i].regions) {
+      regions.push_back({stringId(regionString, corpus.regions, entry.first), 0, entry.second});
+    }
+    record.tokenBegin = static_cast<std::uint32_t>(tokens.size());
+    record.tokenCount = static_cast<std::uint32_t>(lists[i].tokens.size());
+    for (const auto &entry : lists[i].tokens) {
+      tokens.push_back(
+          {stringId(tokenString, corpus.tokens, entry.first), 0, entry.second, tokenPmi(stat, entry, corpus.totals)});
+    }
+    record.linkBegin = static_cast<std::uint32_t>(links.size());
+    record.relatedCount = static_cast<std::uint32_t>(model.related[phrase].size());
+    for (const auto &edge : model.related[phrase]) {
+      links.push_back({stringId(phraseString, corpus.phrases, edge.first), 0, edge.second});
+    }
+    if (options.embeddingNeighbors > 0) {
+      record.neighborCount = static_cast<std::uint32_t>(model.embeddingNeighbors[phrase].size());
+      for (const auto &edge : model.embeddingNeighbors[phrase]) {
+        links.push_back({stringId(phraseString, corpus.phrases, edge.first), 0, edge.second});
+      }
+    }
+  }
+
+  const KMeansResult &clusters = model.clusters;
+  std::vector<std::uint32_t> centroidTokens;
+  std::vector<std::uint32_t> clusterSizes;
+  if (clusters.valid) {
+    for (std::uint32_t token : model.embeddingTokens) {
+      centroidTokens.push_back(stringId(tokenString, corpus.tokens, token));
+    }
+    clusterSizes.assign(clusters.clusterCount(), 0);
+    for (int assignment : clusters.assignments) {
+      if (assignment >= 0)
+        clusterSizes[static_cast<std::size_t>(assignment)] += 1;
+    }
+  }
+
+  ModelFileHeader header{};
+  std::memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+  header.version = MODEL_VERSION;
+  header.headerSize = sizeof(ModelFileHeader);
+  header.totalContexts = corpus.totals.totalContexts;
+  header.phraseCount = static_cast<std::uint32_t>(orderedPhrases.size());
+  header.stringCount = static_cast<std::uint32_t>(strings.size());
+  header.clusterCount = static_cast<std::uint32_t>(clusterSizes.size());
+  header.centroidDim = static_cast<std::uint32_t>(centroidTokens.size());
+  header.flags = options.embeddingNeighbors > 0 ? MODEL_FLAG_EMBEDDING_NEIGHBORS : 0;
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  StateWriter writer{out, sizeof(header), {}};
+
+  std::vector<std::uint64_t> stringOffsets{0};
+  for (std::string_view value : strings) {
+    stringOffsets.push_back(stringOffsets.back() + value.size());
+  }
+  header.stringOffsets = writer.writeArray(stringOffsets);
+  header.stringData = {writer.offset, stringOffsets.back()};
+  for (std::string_view value : strings) {
+    writer.write(value.data(), value.size());
+  }
+  header.records = writer.writeArray(records);
+  header.regions = writer.writeArray(regions);
+  header.tokens = writer.writeArray(tokens);
+  header.links = writer.writeArray(links);
+  header.centroidTokens = writer.writeArray(centroidTokens);
+  if (clusters.valid)
+    header.centroids = writer.writeArray(clusters.centroids);
+  header.clusterSizes = writer.writeArray(clusterSizes);
+
+  header.checksum = writer.checksum.finish();
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+void saveModelFile(const std::string &path, const Options &options, const CorpusStats &corpus, const Model &model,
+                   const std::vector<std::uint32_t> &orderedPhrases, const std::vector<int> &clusterLookup) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Failed to write model file: " + path);
+  }
+  writeModelFile(out, options, corpus, model, orderedPhrases, clusterLookup);
+  if (!out) {
+    throw std::runtime_error("Failed to write model file: " + path);
+  }
+}
+
+// A binary model in memory: a mapped --model-in file, or one the query server wrote from the state.
+// Construction checks the header, the section bounds and every list range and string id, so lookups
+// read records in place without further checks.
+struct ModelFileView {
+  ModelFileView(std::string_view bytes, const std::string &name) : bytes(bytes) {
+    if (bytes.size() < sizeof(ModelFileHeader) || std::memcmp(bytes.data(), MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0) {
+      throw std::runtime_error("Not a slang_trainer model file: " + name);
+    }
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    if (header.version != MODEL_VERSION || header.headerSize != sizeof(ModelFileHeader)) {
+      throw std::runtime_error("Unsupported model file version in " + name);
+    }
+    auto check = [&](const StateSection &section, std::uint64_t expected, std::size_t entrySize) {
+      if (section.offset % 8 != 0 || section.offset > bytes.size() || section.size > bytes.size() - section.offset ||
+          (expected != 0 && section.size != expected) || section.size % entrySize != 0) {
+        throw std::runtime_error("Corrupt model file (bad section bounds): " + name);
+      }
+    };
+    check(header.stringOffsets, (std::uint64_t{header.stringCount} + 1) * sizeof(std::uint64_t), 1);
+    check(header.stringData, 0, 1);
+    check(header.records, std::uint64_t{header.phraseCount} * sizeof(ModelPhraseRecord), 1);
+    check(header.regions, 0, sizeof(ModelCountEntry));
+    check(header.tokens, 0, sizeof(ModelTokenEntry));
+    check(header.links, 0, sizeof(ModelLinkEntry));
+    check(header.clusterSizes, std::uint64_t{header.clusterCount} * sizeof(std::uint32_t), 1);
+    if (header.phraseCount > header.stringCount) {
+      throw std::runtime_error("Corrupt model file (bad phrase count): " + name);
+    }
+    const std::uint64_t *offsets = section<std::uint64_t>(header.stringOffsets);
+    for (std::uint32_t i = 0; i < header.stringCount; ++i) {
+      if (offsets[i] > offsets[i + 1] || offsets[i + 1] > header.stringData.size)
+        throw std::runtime_error("Corrupt model file (bad string offset): " + name);
+    }
+    auto checkRange = [&](const StateSection &section, std::size_t entrySize, std::uint64_t begin, std::uint64_t count) {
+      const std::uint64_t available = section.size / entrySize;
+      if (begin > available || count > available - begin)
+        throw std::runtime_error("Corrupt model file (bad record range): " + name);
+    };
+    for (const ModelPhraseRecord &record : records()) {
+      checkRange(header.regions, sizeof(ModelCountEntry), record.regionBegin, record.regionCount);
+      checkRange(header.tokens, sizeof(ModelTokenEntry), record.tokenBegin, record.tokenCount);
+      checkRange(header.links, sizeof(ModelLinkEntry), record.linkBegin,
+                 std::uint64_t{record.relatedCount} + record.neighborCount);
+      if (record.cluster >= static_cast<std::int64_t>(header.clusterCount))
+        throw std::runtime_error("Corrupt model file (bad cluster id): " + name);
+    }
+    auto checkStrings = [&](const auto &entries) {
+      for (const auto &entry : entries) {
+        if (entry.string >= header.stringCount)
+          throw std::runtime_error("Corrupt model file (bad string id): " + name);
+      }
+    };
+    checkStrings(list<ModelCountEntry>(header.regions, 0, header.regions.size / sizeof(ModelCountEntry)));
+    checkStrings(list<ModelTokenEntry>(header.tokens, 0, header.tokens.size / sizeof(ModelTokenEntry)));
+    checkStrings(list<ModelLinkEntry>(header.links, 0, header.links.size / sizeof(ModelLinkEntry)));
+  }
+
+  bool verifyChecksum() const {
+    Checksum64 checksum;
+    checksum.update(bytes.data() + header.headerSize, bytes.size() - header.headerSize);
+    return checksum.finish() == header.checksum;
+  }
+
+  template <typename T> const T *section(const StateSection &ref) const {
+    return reinterpret_cast<const T *>(bytes.data() + ref.offset);
+  }
+  template <typename T> struct List {
+    const T *first;
+    const T *last;
+    const T *begin() const { return first; }
+    const T *end() const { return last; }
+  };
+  template <typename T> List<T> list(const StateSection &ref, std::uint64_t begin, std::uint64_t count) const {
+    return {section<T>(ref) + begin, section<T>(ref) + begin + count};
+  }
+  List<ModelPhraseRecord> records() const { return list<ModelPhraseRecord>(header.records, 0, header.phraseCount); }
+
+  std::string_view str(std::uint32_t id) const {
+    const std::uint64_t *offsets = section<std::uint64_t>(header.stringOffsets);
+    return bytes.substr(header.stringData.offset + offsets[id], offsets[id + 1] - offsets[id]);
+  }
+
+  // Index of `phrase`'s record, or NO_ID; the phrase strings are in byte order.
+  std::uint32_t find(std::string_view phrase) const {
+    std::uint32_t lo = 0;
+    std::uint32_t hi = header.phraseCount;
+    while (lo < hi) {
+      const std::uint32_t mid = lo + (hi - lo) / 2;
+      const int order = str(mid).compare(phrase);
+      if (order == 0)
+        return mid;
+      if (order < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return NO_ID;
+  }
+
+  std::string_view bytes;
+  ModelFileHeader header;
+};
+
+void writeModelOutputs(const Options &options, const CorpusStats &corpus, const Model &model, std::ostream &log) {
+  const KMeansResult &clusters = model.clusters;
+  const std::vector<std::uint32_t> &embeddingTokens = model.embeddingTokens;
+  const std::vector<RelatedList> &relatedGraph = model.related;
+  const std::vector<int> clusterLookup = clusterLookupFor(corpus, clusters);
+
+  std::ofstream out(options.outputPath);
+  if (!out) {
+    throw std::runtime_error("Failed to open output file: " + options.outputPath);
+  }
+
+  auto orderedPhrases = sortedPhraseIds(corpus);
+  orderedPhrases.erase(std::remove_if(orderedPhrases.begin(), orderedPhrases.end(),
+                                      [&](std::uint32_t id) { return corpus.stats[id].count < options.minCount; }),
+                       orderedPhrases.end());
+
+  OutputBuffer head;
+  head.raw("{\n");
+  appendModelSummary(head, corpus);
+  head.raw("  \"phrases\": [\n");
+  head.flushTo(out);
+
+  writeInOrder(out, orderedPhrases.size(), options.threads, [&](OutputBuffer &buf, std::size_t index) {
+    if (index > 0)
+      buf.raw(",\n");
+    appendPhraseRecord(buf, options, corpus, model, clusterLookup, orderedPhrases[index]);
+  });
+
+  OutputBuffer tail;
+  tail.raw("\n  ]\n");
+  if (clusters.valid) {
+    std::vector<std::size_t> clusterSizes(clusters.clusterCount(), 0);
+    for (int assignment : clusters.assignments) {
+      if (assignment >= 0)
+        clusterSizes[static_cast<std::size_t>(assignment)] += 1;
+    }
+    tail.raw(",\n  \"clusters\": [\n");
+    for (std::size_t c = 0; c < clusters.clusterCount(); ++c) {
+      if (c > 0)
+        tail.raw(",\n");
+      std::vector<std::pair<std::string_view, double>> centroidTokens;
+      for (std::size_t i = 0; i < embeddingTokens.size(); ++i) {
+        centroidTokens.push_back({corpus.tokens.str(embeddingTokens[i]), clusters.centroids[c * clusters.dim + i]});
+      }
+      std::sort(centroidTokens.begin(), centroidTokens.end(), [](const auto &a, const auto &b) {
+        if (a.second != b.second)
+          return a.second > b.second;
+        return a.first < b.first;
+      });
+      if (centroidTokens.size() > 8)
+        centroidTokens.resize(8);
+      tail.raw("    {\n");
+      tail.raw("      \"id\": ").integer(c).raw(",\n");
+      tail.raw("      \"size\": ").integer(clusterSizes[c]).raw(",\n");
+      tail.raw("      \"centroidTokens\": [");
+      for (std::size_t i = 0; i < centroidTokens.size(); ++i) {
+        if (i > 0)
+          tail.raw(", ");
+        tail.raw("{\"token\": \"").escaped(centroidTokens[i].first);
+        tail.raw("\", \"weight\": ").fixed4(centroidTokens[i].second).raw("}");
+      }
+      tail.raw("]\n");
+      tail.raw("    }");
+    }
+    tail.raw("\n  ]\n");
+  } else {
+    tail.raw("\n");
+  }
+  tail.raw("}\n");
+  tail.flushTo(out);
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Failed to write output file: " + options.outputPath);
+  }
+  log << "Wrote language model summary to " << options.outputPath << "\n";
+
+  if (!options.graphOutputPath.empty()) {
+    std::ofstream graphOut(options.graphOutputPath);
+    if (!graphOut) {
+      throw std::runtime_error("Failed to open graph output file: " + options.graphOutputPath);
+    }
+    graphOut << "source\ttarget\tscore\n";
+    writeInOrder(graphOut, orderedPhrases.size(), options.threads, [&](OutputBuffer &buf, std::size_t index) {
+      const std::uint32_t phraseId = orderedPhrases[index];
+      for (const auto &edge : relatedGraph[phraseId]) {
+        buf.raw(corpus.phrases.str(phraseId)).raw("\t").raw(corpus.phrases.str(edge.first)).raw("\t");
+        buf.fixed4(edge.second).raw("\n");
+      }
+    });
+    log << "Wrote related phrase graph to " << options.graphOutputPath << "\n";
+  }
+  if (!options.annIndexPath.empty()) {
+    saveAnnIndex(options.annIndexPath, model.annIndex, corpus, embeddingTokens);
+    log << "Wrote embedding ANN index to " << options.annIndexPath << "\n";
+  }
+  if (!options.modelFilePath.empty()) {
+    saveModelFile(options.modelFilePath, options, corpus, model, orderedPhrases, clusterLookup);
+    log << "Wrote binary model to " << options.modelFilePath << "\n";
+  }
+}
+
+IngestSnapshot snapshotCorpus(const CorpusStats &corpus) {
+  IngestSnapshot snapshot;
+  snapshot.totalContexts = corpus.totals.totalContexts;
+  snapshot.phraseCounts.reserve(corpus.stats.size());
+  for (const auto &stat : corpus.stats)
+    snapshot.phraseCounts.push_back(stat.count);
+  snapshot.tokenTotals = corpus.totals.tokenTotals;
+  snapshot.evictedTokens = corpus.approx.evictedTokens;
+  return snapshot;
+}
+
+// The phrases a delta model rewrites. A phrase with new contexts ("dirty") always is. Any other
+// phrase keeps its co-occurrence and phrase counts, so each of its token PMIs moves by
+// log(N'/N) - log(t'/t) for contexts N and token total t; both terms are non-negative, so
+// max(log(N'/N), max over its tokens of log(t'/t)) bounds the drift. A phrase whose bound exceeds
+// --pmi-staleness is refreshed too; pmiBound is the largest bound among those left out. Related
+// lists only gain or raise dirty phrases, so a clean phrase is also refreshed when a refreshed
+// phrase now lists it (addRelatedRefreshes); one that ranks a dirty phrase without the reverse
+// holding keeps its list until the next full model. Cluster ids outside the delta are those of the
+// last full model.
+struct DeltaPlan {
+  std::vector<std::uint8_t> refresh; // by phrase id; only phrases at or above --min-count
+  std::vector<std::uint32_t> phrases; // the refreshed phrases, in id order
+  std::uint64_t contextsBefore = 0;
+  std::size_t dirtyPhrases = 0;
+  std::size_t dirtyTokens = 0;
+  std::size_t driftedPhrases = 0;
+  std::size_t relatedPhrases = 0;
+  double pmiBound = 0.0;
+  bool full = false; // the snapshot could not be compared, so every phrase is refreshed
+};
+
+DeltaPlan planDelta(const CorpusStats &corpus, const IngestSnapshot &before, std::uint64_t minCount,
+                    double staleness) {
+  DeltaPlan plan;
+  plan.contextsBefore = before.totalContexts;
+  plan.refresh.assign(corpus.stats.size(), 0);
+  plan.full = before.totalContexts == 0 || before.evictedTokens != corpus.approx.evictedTokens;
+  const double contextDrift =
+      plan.full ? 0.0
+                : std::log(static_cast<double>(corpus.totals.totalContexts) / static_cast<double>(before.totalContexts));
+  std::vector<double> tokenDrift;
+  if (!plan.full) {
+    tokenDrift.assign(before.tokenTotals.size(), 0.0);
+    for (std::size_t t = 0; t < before.tokenTotals.size(); ++t) {
+      const std::uint64_t was = before.tokenTotals[t];
+      const std::uint64_t now = corpus.totals.tokenTotals[t];
+      if (now == was)
+        continue;
+      plan.dirtyTokens += 1;
+      tokenDrift[t] = was == 0 ? std::numeric_limits<double>::infinity()
+                               : std::log(static_cast<double>(now) / static_cast<double>(was));
+    }
+    plan.dirtyTokens += corpus.tokens.size() - before.tokenTotals.size();
+  }
+  for (std::uint32_t phrase = 0; phrase < corpus.stats.size(); ++phrase) {
+    const PhraseStats &stat = corpus.stats[phrase];
+    if (stat.count < minCount)
+      continue;
+    if (plan.full || phrase >= before.phraseCounts.size() || before.phraseCounts[phrase] != stat.count) {
+      plan.dirtyPhrases += 1;
+      plan.refresh[phrase] = 1;
+      continue;
+    }
+    // A clean phrase's tokens all predate the ingest.
+    double drift = contextDrift;
+    for (const auto &entry : stat.tokenCounts.entries)
+      drift = std::max(drift, tokenDrift[entry.first]);
+    if (drift > staleness) {
+      plan.driftedPhrases += 1;
+      plan.refresh[phrase] = 1;
+    } else {
+      plan.pmiBound = std::max(plan.pmiBound, drift);
+    }
+  }
+  for (std::uint32_t phrase = 0; phrase < plan.refresh.size(); ++phrase) {
+    if (plan.refresh[phrase])
+      plan.phrases.push_back(phrase);
+  }
+  return plan;
+}
+
+// Refreshes the emitted phrases that the refreshed phrases' related lists name; returns them.
+std::vector<std::uint32_t> addRelatedRefreshes(DeltaPlan &plan, const CorpusStats &corpus,
+                                               const std::vector<RelatedList> &related, std::uint64_t minCount) {
+  std::vector<std::uint32_t> added;
+  for (std::uint32_t phrase : plan.phrases) {
+    for (const auto &edge : related[phrase]) {
+      if (plan.refresh[edge.first] || corpus.stats[edge.first].count < minCount)
+        continue;
+      plan.refresh[edge.first] = 1;
+      added.push_back(edge.first);
+    }
+  }
+  plan.relatedPhrases += added.size();
+  plan.phrases.insert(plan.phrases.end(), added.begin(), added.end());
+  std::sort(plan.phrases.begin(), plan.phrases.end());
+  return added;
+}
+
+// Related lists for `phrases` only, from an index holding just their tokens' postings.
+void relatedForPhrases(const CorpusStats &corpus, const std::vector<std::uint32_t> &phrases, std::size_t limit,
+                       std::size_t threads, std::vector<RelatedList> &related) {
+  std::vector<std::uint8_t> tokens(corpus.tokens.size(), 0);
+  for (std::uint32_t phrase : phrases) {
+    for (const auto &entry : corpus.stats[phrase].tokenCounts.entries)
+      tokens[entry.first] = 1;
+  }
+  const TokenIndex index = buildTokenIndex(corpus, &tokens);
+  std::vector<RelatedScratch> scratch(std::max<std::size_t>(1, threads));
+  parallelFor(phrases.size(), threads, [&](std::size_t worker, std::size_t i) {
+    related[phrases[i]] = relatedPhrases(corpus, phrases[i], index, limit, scratch[worker]);
+  });
+}
+
+// --delta-only: the parts of the model the delta's records need, without a pass over the whole
+// history's features. Clusters are the nearest of the saved centroids (none without a state that
+// has them); embedding neighbours are left out.
+Model buildDeltaModel(const Options &options, const CorpusStats &corpus, DeltaPlan &plan) {
+  Model model;
+  model.related.assign(corpus.stats.size(), {});
+  relatedForPhrases(corpus, plan.phrases, options.relatedLimit, options.threads, model.related);
+  const std::vector<std::uint32_t> added = addRelatedRefreshes(plan, corpus, model.related, options.minCount);
+  relatedForPhrases(corpus, added, options.relatedLimit, options.threads, model.related);
+
+  model.features.assign(corpus.stats.size(), PhraseFeatureSummary{});
+  parallelFor(plan.phrases.size(), options.threads, [&](std::size_t, std::size_t i) {
+    model.features[plan.phrases[i]] = summarizePhrase(corpus.stats[plan.phrases[i]], corpus.totals);
+  });
+
+  const ClusterCentroids &saved = corpus.centroids;
+  const std::size_t clusterCount = saved.clusterCount();
+  if (clusterCount > 0) {
+    model.embeddingTokens = saved.tokens;
+    // Saved centroids are over token columns, so the rows are too, whatever --embedding-projection says.
+    EmbeddingFormat format = embeddingFormat(options);
+    format.projection = 0;
+    model.embeddings = buildEmbeddings(corpus, saved.tokens, options.minCount, options.minPmi, options.threads,
+                                       format, &plan.refresh);
+    KMeansResult &clusters = model.clusters;
+    clusters.valid = true;
+    clusters.dim = saved.tokens.size();
+    clusters.centroids = saved.values;
+    clusters.phrases = model.embeddings.phrases;
+    clusters.assignments.assign(model.embeddings.size(), 0);
+    std::vector<float> norms(clusterCount);
+    for (std::size_t c = 0; c < clusterCount; ++c) {
+      norms[c] = squaredNorm(clusters.centroids.data() + c * clusters.dim, clusters.dim);
+    }
+    parallelFor(model.embeddings.size(), options.threads, [&](std::size_t, std::size_t row) {
+      clusters.assignments[row] = nearestCentroid(model.embeddings, row, clusters.centroids, norms);
+    });
+  }
+  return model;
+}
+
+// Writes the refreshed phrases' records in the full model's record format, plus what the delta
+// covers; consumers replace those phrases in the last full model.
+void writeDeltaModel(const Options &options, const CorpusStats &corpus, const Model &model, const DeltaPlan &plan,
+                     std::ostream &log) {
+  std::ofstream out(options.deltaOutputPath);
+  if (!out) {
+    throw std::runtime_error("Failed to open delta output file: " + options.deltaOutputPath);
+  }
+  const std::vector<int> clusterLookup = clusterLookupFor(corpus, model.clusters);
+  std::vector<std::uint32_t> ordered = plan.phrases;
+  std::sort(ordered.begin(), ordered.end(),
+            [&](std::uint32_t a, std::uint32_t b) { return corpus.phrases.str(a) < corpus.phrases.str(b); });
+
+  OutputBuffer head;
+  head.raw("{\n");
+  appendModelSummary(head, corpus);
+  head.raw("  \"delta\": {\"full\": ").raw(plan.full ? "true" : "false");
+  head.raw(", \"contextsBefore\": ").integer(plan.contextsBefore);
+  head.raw(", \"dirtyPhrases\": ").integer(plan.dirtyPhrases);
+  head.raw(", \"dirtyTokens\": ").integer(plan.dirtyTokens);
+  head.raw(", \"driftedPhrases\": ").integer(plan.driftedPhrases);
+  head.raw(", \"relatedPhrases\": ").integer(plan.relatedPhrases);
+  head.raw(", \"pmiStaleness\": ").fixed4(options.pmiStaleness);
+  head.raw(", \"pmiBound\": ").fixed4(plan.pmiBound).raw("},\n");
+  head.raw("  \"phrases\": [\n");
+  head.flushTo(out);
+
+  writeInOrder(out, ordered.size(), options.threads, [&](OutputBuffer &buf, std::size_t index) {
+    if (index > 0)
+      buf.raw(",\n");
+    appendPhraseRecord(buf, options, corpus, model, clusterLookup, ordered[index]);
+  });
+
+  OutputBuffer tail;
+  tail.raw("\n  ]\n}\n");
+  tail.flushTo(out);
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Failed to write delta output file: " + options.deltaOutputPath);
+  }
+  log << "Wrote delta model (" << ordered.size() << " phrases) to " << options.deltaOutputPath << "\n";
+}
+
+// The delta model of an ingest, from the full model when one was built or else from buildDeltaModel.
+void writeDelta(const Options &options, const CorpusStats &corpus, const IngestSnapshot &before,
+                const Model *full, std::ostream &log, Profiler *profiler) {
+  DeltaPlan plan;
+  profileStage(profiler, "delta_plan", [&] { plan = planDelta(corpus, before, options.minCount, options.pmiStaleness); });
+  if (full) {
+    addRelatedRefreshes(plan, corpus, full->related, options.minCount);
+    profileStage(profiler, "write_delta", [&] { writeDeltaModel(options, corpus, *full, plan, log); });
+    return;
+  }
+  Model model;
+  profileStage(profiler, "delta_model", [&] { model = buildDeltaModel(options, corpus, plan); });
+  Options deltaOptions = options;
+  deltaOptions.embeddingNeighbors = 0;
+  profileStage(profiler, "write_delta", [&] { writeDeltaModel(deltaOptions, corpus, model, plan, log); });
+}
+
+// Builds the model from `corpus` and writes its outputs. Returns the final cluster centroids for the
+// caller to keep in the state, so the next run can warm-start from them. With `before`, also writes
+// the delta model against that snapshot.
+ClusterCentroids writeModel(const Options &options, const CorpusStats &corpus, std::ostream &log,
+                            Profiler *profiler, const IngestSnapshot *before) {
+  Model model = buildModel(options, corpus, profiler);
+  profileStage(profiler, "write_outputs", [&] { writeModelOutputs(options, corpus, model, log); });
+  if (before)
+    writeDelta(options, corpus, *before, &model, log, profiler);
+  ClusterCentroids centroids;
+  if (model.clusters.valid) {
+    centroids.tokens = std::move(model.embeddingTokens);
+    centroids.values = std::move(model.clusters.centroids);
+  }
+  return centroids;
+}
+
+// A region's model file name: bytes outside [A-Za-z0-9_-] are %XX-escaped, so distinct regions never
+// share a file.
+std::string regionFileName(std::string_view region) {
+  static const char HEX[] = "0123456789ABCDEF";
+  std::string name;
+  for (char ch : region) {
+    const unsigned char byte = static_cast<unsigned char>(ch);
+    if (std::isalnum(byte) || ch == '_' || ch == '-') {
+      name.push_back(ch);
+    } else {
+      name.push_back('%');
+      name.push_back(HEX[byte >> 4]);
+      name.push_back(HEX[byte & 15]);
+    }
+  }
+  return name;
+}
+
+// --per-region: builds a model from each region's slice and writes it to <dir>/<region>.json (and
+// <region>.bin with --model-bin), so a regional service loads only its own. Its PMI, related phrases
+// and clusters are computed within the region's contexts. Regions are built concurrently, largest
+// first, each with an even share of --threads; <dir>/regions.tsv lists the files.
+void writeRegionModels(const Options &options, const CorpusStats &corpus, std::ostream &log) {
+  const std::string &dir = options.regionOutputDir;
+  if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw std::runtime_error("Failed to create region model directory: " + dir);
+  }
+  std::vector<std::uint32_t> regions;
+  for (std::uint32_t r = 0; r < corpus.regionSlices.size(); ++r) {
+    if (corpus.regionSlices[r].totals.totalContexts > 0)
+      regions.push_back(r);
+  }
+  std::sort(regions.begin(), regions.end(), [&](std::uint32_t a, std::uint32_t b) {
+    const std::uint64_t left = corpus.regionSlices[a].totals.totalContexts;
+    const std::uint64_t right = corpus.regionSlices[b].totals.totalContexts;
+    return left != right ? left > right : corpus.regions.str(a) < corpus.regions.str(b);
+  });
+
+  Options shared = options;
+  shared.graphOutputPath.clear();
+  shared.annIndexPath.clear();
+  shared.threads = std::max<std::size_t>(1, options.threads / std::max<std::size_t>(1, regions.size()));
+  std::vector<std::uint64_t> phraseCounts(regions.size(), 0);
+  parallelFor(regions.size(), options.threads, [&](std::size_t, std::size_t i) {
+    const CorpusStats &slice = corpus.regionSlices[regions[i]];
+    const std::string base = dir + "/" + regionFileName(corpus.regions.str(regions[i]));
+    Options own = shared;
+    own.outputPath = base + ".json";
+    if (!options.modelFilePath.empty())
+      own.modelFilePath = base + ".bin";
+    std::ostringstream quiet;
+    writeModelOutputs(own, slice, buildModel(own, slice), quiet);
+    for (const auto &stat : slice.stats)
+      phraseCounts[i] += stat.count >= options.minCount;
+  });
+
+  std::vector<std::size_t> byName(regions.size());
+  for (std::size_t i = 0; i < byName.size(); ++i)
+    byName[i] = i;
+  std::sort(byName.begin(), byName.end(), [&](std::size_t a, std::size_t b) {
+    return corpus.regions.str(regions[a]) < corpus.regions.str(regions[b]);
+  });
+  const std::string indexPath = dir + "/regions.tsv";
+  std::ofstream index(indexPath);
+  if (!index) {
+    throw std::runtime_error("Failed to open region index file: " + indexPath);
+  }
+  index << "region\tcontexts\tphrases\tmodel\n";
+  for (std::size_t i : byName) {
+    const std::string_view region = corpus.regions.str(regions[i]);
+    index << region << "\t" << corpus.regionSlices[regions[i]].totals.totalContexts << "\t" << phraseCounts[i]
+          << "\t" << regionFileName(region) << ".json\n";
+  }
+  index.close();
+  if (!index) {
+    throw std::runtime_error("Failed to write region index file: " + indexPath);
+  }
+  log << "Wrote " << regions.size() << " region models to " << dir << "\n";
+}
+
+// Resident mode (--serve). Input is newline-delimited: lines containing a tab are contexts TSV rows
+// (header rows are skipped) and are ingested into the in-memory stats; other lines are commands:
+//   FLUSH [model.json]        rebuild the model and write it (plus --graph-output, if set)
+//   CHECKPOINT [stats.dat]    save state, defaulting to --state-out
+//   STATS                     report corpus sizes
+//   CLOSE                     end this connection (socket mode)
+//   SHUTDOWN                  checkpoint to --state-out (if set) and exit
+// Commands answer with one "OK ..." or "ERR ..." line; rows are not acknowledged.
+struct DaemonSession {
+  const Options &options;
+  CorpusStats &corpus;
+  IngestScratch scratch;
+  std::uint64_t rowsSinceBudgetCheck;
+};
+
+constexpr std::uint64_t DAEMON_BUDGET_INTERVAL = 1 << 16; // rows between --memory-budget checks
+
+bool isHeaderRow(std::string_view line) {
+  TsvRow columns;
+  return splitTsv(line, columns) == TSV_COLUMNS && columns[0] == "phrase" && columns[4] == "context";
+}
+
+void checkpointDaemon(DaemonSession &session, const std::string &path) {
+  compactAll(session.corpus);
+  saveState(path, session.corpus, session.options.stateFormat);
+}
+
+DaemonAction handleDaemonLine(std::string_view line, DaemonSession &session, std::string &reply) {
+  if (!line.empty() && line.back() == '\r')
+    line.remove_suffix(1);
+  if (line.empty())
+    return DaemonAction::Continue;
+  if (line.find('\t') != std::string_view::npos) {
+    if (!isHeaderRow(line)) {
+      ingestLine(line, session.corpus, session.scratch);
+      if (session.options.memoryBudget > 0 && ++session.rowsSinceBudgetCheck >= DAEMON_BUDGET_INTERVAL) {
+        enforceMemoryBudget(session.corpus, session.options.memoryBudget);
+        session.rowsSinceBudgetCheck = 0;
+      }
+    }
+    return DaemonAction::Continue;
+  }
+  std::size_t space = line.find(' ');
+  std::string_view command = line.substr(0, space);
+  std::string argument(space == std::string_view::npos ? std::string_view() : line.substr(space + 1));
+  CorpusStats &corpus = session.corpus;
+  try {
+    if (command == "FLUSH") {
+      Options options = session.options;
+      if (!argument.empty())
+        options.outputPath = argument;
+      compactAll(corpus);
+      corpus.centroids = writeModel(options, corpus, std::cerr);
+      reply = "OK flushed " + options.outputPath;
+    } else if (command == "CHECKPOINT") {
+      std::string path = argument.empty() ? session.options.stateOutputPath : argument;
+      if (path.empty()) {
+        reply = "ERR no state path (pass one or start with --state-out)";
+      } else {
+        checkpointDaemon(session, path);
+        reply = "OK checkpoint " + path;
+      }
+    } else if (command == "STATS") {
+      reply = "OK contexts=" + std::to_string(corpus.totals.totalContexts) +
+              " phrases=" + std::to_string(corpus.phrases.size()) + " tokens=" + std::to_string(corpus.tokens.size()) +
+              " regions=" + std::to_string(corpus.regions.size());
+    } else if (command == "CLOSE") {
+      reply = "OK bye";
+      return DaemonAction::Close;
+    } else if (command == "SHUTDOWN") {
+      reply = "OK shutdown";
+      return DaemonAction::Shutdown;
+    } else {
+      reply = "ERR unknown command " + std::string(command);
+    }
+  } catch (const std::exception &ex) {
+    reply = std::string("ERR ") + ex.what();
+  }
+  return DaemonAction::Continue;
+}
+
+bool writeAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t written = ::write(fd, data.data(), data.size());
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data.remove_prefix(static_cast<std::size_t>(written));
+  }
+  return true;
+}
+
+// Serves one input stream until EOF, CLOSE or SHUTDOWN. Returns the action that ended it.
+DaemonAction serveStream(int inFd, int replyFd, DaemonSession &session) {
+  return serveLines(inFd, replyFd,
+                    [&](std::string_view line, std::string &reply) { return handleDaemonLine(line, session, reply); });
+}
+
+// Binds and listens on a Unix socket at `path`, replacing any stale socket file.
+int listenUnix(const std::string &path) {
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + path);
+  }
+  int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) {
+    throw std::runtime_error("Failed to create socket");
+  }
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  ::unlink(path.c_str());
+  if (::bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(server, 8) != 0) {
+    ::close(server);
+    throw std::runtime_error("Failed to listen on socket: " + path);
+  }
+  return server;
+}
+
+// Accepts one client at a time on a Unix socket until a client sends SHUTDOWN.
+void serveSocket(const std::string &path, DaemonSession &session) {
+  int server = listenUnix(path);
+  std::cerr << "Serving on " << path << "\n";
+  for (;;) {
+    int client = ::accept(server, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    DaemonAction action = serveStream(client, client, session);
+    ::close(client);
+    if (action == DaemonAction::Shutdown)
+      break;
+  }
+  ::close(server);
+  ::unlink(path.c_str());
+}
+
+void runDaemon(const Options &options, CorpusStats &corpus) {
+  std::signal(SIGPIPE, SIG_IGN);
+  DaemonSession session{options, corpus, {}, 0};
+  if (options.socketPath.empty()) {
+    serveStream(STDIN_FILENO, STDOUT_FILENO, session);
+  } else {
+    serveSocket(options.socketPath, session);
+  }
+  if (!options.stateOutputPath.empty()) {
+    checkpointDaemon(session, options.stateOutputPath);
+  }
+}
+
+// Query server (--query-socket / --query-http). The model is built once from the loaded state and kept
+// in memory; lookups only read it, so every connection gets its own thread. Socket clients send one
+// command per line and get one JSON line back:
+//   PHRASE <phrase>           the phrase's record, as in the model JSON
+//   RELATED <phrase>          related phrases (and embedding neighbours, when built)
+//   CLUSTER <id> [limit]      cluster members, most frequent first
+//   NEAREST <phrase> [limit]  nearest phrases by embedding, searched in the --ann-in index
+//   TOP <region> [limit]      phrases seen most often in a region, with the region's share of each
+//   STATS                     model sizes
+//   CLOSE                     end this connection
+//   SHUTDOWN                  stop the server
+// Failed lookups answer {"error": "..."}. Over HTTP the same lookups are GET /phrase?q=, /related?q=,
+// /cluster?id=&limit=, /nearest?q=&limit=, /top?region=&limit= and /stats, with misses answered as 404s.
+constexpr std::size_t QUERY_DEFAULT_LIMIT = 20;
+constexpr std::size_t HTTP_MAX_HEADER = 16 * 1024;
+constexpr std::size_t QUERY_MAX_CONNECTIONS = 256; // further clients are closed until one leaves
+constexpr long QUERY_IDLE_SECONDS = 60;            // a connection quiet this long is closed
+
+enum class QueryKind { Phrase, Related, Cluster, Nearest, Top, Stats };
+
+// The query server's model: the --model-bin layout, mapped from --model-in or written in memory from
+// the state, so both answer from the same records, plus the indexes CLUSTER and TOP are answered from.
+struct QueryModel {
+  std::unique_ptr<MappedFile> file; // --model-in
+  std::vector<std::uint64_t> built; // the model written from the state, 8-byte aligned like the file
+  std::unique_ptr<ModelFileView> view;
+  std::vector<std::vector<std::uint32_t>> clusterMembers;               // records, most frequent first
+  std::unordered_map<std::string_view, std::vector<IdCount>> regionTop; // (record, regional count), highest first
+  AnnIndex ann;                                            // --ann-in, empty without it
+  std::vector<std::string> annPhrases;                     // by node
+  std::unordered_map<std::string_view, std::uint32_t> annNodes; // phrase -> node
+  std::size_t annEf = 0;
+};
+
+// Builds the model from the state and writes it into `query.built`.
+void buildQueryModel(QueryModel &query, const Options &options, const CorpusStats &corpus) {
+  auto orderedPhrases = sortedPhraseIds(corpus);
+  orderedPhrases.erase(std::remove_if(orderedPhrases.begin(), orderedPhrases.end(),
+                                      [&](std::uint32_t id) { return corpus.stats[id].count < options.minCount; }),
+                       orderedPhrases.end());
+  std::ostringstream out;
+  {
+    const Model model = buildModel(options, corpus);
+    writeModelFile(out, options, corpus, model, orderedPhrases, clusterLookupFor(corpus, model.clusters));
+  }
+  const std::string bytes = std::move(out).str();
+  query.built.assign((bytes.size() + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t), 0);
+  std::memcpy(query.built.data(), bytes.data(), bytes.size());
+  query.view = std::make_unique<ModelFileView>(
+      std::string_view(reinterpret_cast<const char *>(query.built.data()), bytes.size()), "query model");
+
+  // TOP counts every region of a phrase from the state, not only the six in its record.
+  for (std::uint32_t r = 0; r < corpus.regions.size(); ++r) {
+    query.regionTop[corpus.regions.str(r)];
+  }
+  for (std::uint32_t i = 0; i < orderedPhrases.size(); ++i) {
+    for (const IdCount &entry : corpus.stats[orderedPhrases[i]].regionCounts.entries) {
+      query.regionTop[corpus.regions.str(entry.first)].push_back({i, entry.second});
+    }
+  }
+}
+
+// Maps the --model-in file. Its records keep only each phrase's top six regions, so TOP ranks a
+// phrase in the regions among them.
+void mapQueryModel(QueryModel &query, const std::string &path) {
+  query.file = std::make_unique<MappedFile>(path, "model file");
+  if (query.file->data)
+    ::madvise(const_cast<char *>(query.file->data), query.file->size, MADV_RANDOM);
+  query.view = std::make_unique<ModelFileView>(query.file->view(), path);
+  if (!query.view->verifyChecksum()) {
+    throw std::runtime_error("Model file checksum mismatch: " + path);
+  }
+  const ModelFileView &model = *query.view;
+  std::uint32_t index = 0;
+  for (const ModelPhraseRecord &record : model.records()) {
+    for (const ModelCountEntry &entry : model.list<ModelCountEntry>(model.header.regions, record.regionBegin,
+                                                                   record.regionCount)) {
+      query.regionTop[model.str(entry.string)].push_back({index, entry.count});
+    }
+    ++index;
+  }
+}
+
+void prepareQueryModel(QueryModel &query) {
+  const ModelFileView &model = *query.view;
+  const ModelPhraseRecord *records = model.records().begin();
+  query.clusterMembers.assign(model.header.clusterCount, {});
+  for (std::uint32_t i = 0; i < model.header.phraseCount; ++i) {
+    if (records[i].cluster >= 0)
+      query.clusterMembers[static_cast<std::size_t>(records[i].cluster)].push_back(i);
+  }
+  // Stable sorts keep ties in phrase order, as in the model JSON.
+  for (auto &members : query.clusterMembers) {
+    std::stable_sort(members.begin(), members.end(),
+                     [&](std::uint32_t a, std::uint32_t b) { return records[a].count > records[b].count; });
+  }
+  for (auto &entry : query.regionTop) {
+    std::vector<IdCount> &top = entry.second;
+    std::stable_sort(top.begin(), top.end(), [](const IdCount &a, const IdCount &b) { return a.second > b.second; });
+  }
+  for (std::uint32_t node = 0; node < query.annPhrases.size(); ++node) {
+    query.annNodes.emplace(query.annPhrases[node], node);
+  }
+}
+
+bool parseCount(std::string_view text, std::size_t &value) {
+  auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+  return !text.empty() && result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+int queryError(OutputBuffer &out, int status, std::string_view message) {
+  out.raw("{\"error\": \"").escaped(message).raw("\"}");
+  return status;
+}
+
+// Appends the compact JSON answer to one lookup to `out` and returns its HTTP status. A PHRASE answer
+// is the phrase's model JSON record on one line.
+int answerQuery(const QueryModel &query, QueryKind kind, std::string_view subject, std::size_t limit,
+                OutputBuffer &out) {
+  const ModelFileView &model = *query.view;
+  const ModelFileHeader &header = model.header;
+  const ModelPhraseRecord *records = model.records().begin();
+  if (kind == QueryKind::Phrase || kind == QueryKind::Related) {
+    const std::uint32_t index = model.find(subject);
+    if (index == NO_ID)
+      return queryError(out, 404, "unknown phrase");
+    const ModelPhraseRecord &record = records[index];
+    auto appendList = [&](const char *name, std::uint64_t begin, std::uint32_t count, const char *scoreName) {
+      out.raw(", \"").raw(name).raw("\": [");
+      std::size_t i = 0;
+      for (const ModelLinkEntry &link :
+           model.list<ModelLinkEntry>(header.links, begin, std::min<std::uint64_t>(count, limit))) {
+        out.raw(i++ > 0 ? ", " : "").raw("{\"phrase\": \"").escaped(model.str(link.string));
+        out.raw("\", \"").raw(scoreName).raw("\": ").fixed4(link.score).raw("}");
+      }
+      out.raw("]");
+    };
+    out.raw("{\"phrase\": \"").escaped(model.str(index)).raw("\"");
+    if (kind == QueryKind::Phrase) {
+      out.raw(", \"count\": ").integer(record.count).raw(", \"avgScore\": ").fixed4(record.avgScore);
+      if (record.cluster >= 0)
+        out.raw(", \"cluster\": ").integer(record.cluster);
+      out.raw(", \"quality\": {\"confidence\": ").fixed4(record.confidence);
+      out.raw(", \"evidence\": ").fixed4(record.evidence).raw("}, \"regions\": [");
+      std::size_t i = 0;
+      for (const ModelCountEntry &entry :
+           model.list<ModelCountEntry>(header.regions, record.regionBegin, record.regionCount)) {
+        out.raw(i++ > 0 ? ", " : "").raw("{\"region\": \"").escaped(model.str(entry.string));
+        out.raw("\", \"count\": ").integer(entry.count).raw("}");
+      }
+      out.raw("], \"topContextTokens\": [");
+      i = 0;
+      for (const ModelTokenEntry &entry :
+           model.list<ModelTokenEntry>(header.tokens, record.tokenBegin, record.tokenCount)) {
+        out.raw(i++ > 0 ? ", " : "").raw("{\"token\": \"").escaped(model.str(entry.string));
+        out.raw("\", \"count\": ").integer(entry.count).raw(", \"pmi\": ").fixed4(entry.pmi).raw("}");
+      }
+      out.raw("]");
+    }
+    appendList("relatedPhrases", record.linkBegin, record.relatedCount, "score");
+    if (header.flags & MODEL_FLAG_EMBEDDING_NEIGHBORS)
+      appendList("embeddingNeighbors", std::uint64_t{record.linkBegin} + record.relatedCount, record.neighborCount,
+                 "similarity");
+    out.raw("}");
+    return 200;
+  }
+  if (kind == QueryKind::Cluster) {
+    std::size_t clusterId = 0;
+    if (!parseCount(subject, clusterId))
+      return queryError(out, 400, "cluster id must be a non-negative integer");
+    if (clusterId >= query.clusterMembers.size())
+      return queryError(out, 404, "unknown cluster");
+    const auto &members = query.clusterMembers[clusterId];
+    out.raw("{\"id\": ").integer(clusterId).raw(", \"size\": ").integer(members.size()).raw(", \"members\": [");
+    for (std::size_t i = 0; i < members.size() && i < limit; ++i) {
+      out.raw(i > 0 ? ", " : "").raw("{\"phrase\": \"").escaped(model.str(members[i]));
+      out.raw("\", \"count\": ").integer(records[members[i]].count).raw("}");
+    }
+    out.raw("]}");
+    return 200;
+  }
+  if (kind == QueryKind::Nearest) {
+    if (query.ann.size() == 0)
+      return queryError(out, 404, "no ANN index loaded (--ann-in)");
+    auto node = query.annNodes.find(subject);
+    if (node == query.annNodes.end())
+      return queryError(out, 404, "unknown phrase");
+    // Connections answer on their own threads, so each keeps its own search state.
+    thread_local AnnScratch scratch;
+    out.raw("{\"phrase\": \"").escaped(node->first).raw("\", \"embeddingNeighbors\": [");
+    std::size_t i = 0;
+    for (const auto &neighbor : annNeighbors(query.ann, node->second, limit, query.annEf, scratch)) {
+      out.raw(i++ > 0 ? ", " : "").raw("{\"phrase\": \"").escaped(query.annPhrases[neighbor.first]);
+      out.raw("\", \"similarity\": ").fixed4(neighbor.second).raw("}");
+    }
+    out.raw("]}");
+    return 200;
+  }
+  if (kind == QueryKind::Top) {
+    auto region = query.regionTop.find(subject);
+    if (region == query.regionTop.end())
+      return queryError(out, 404, "unknown region");
+    const auto &top = region->second;
+    out.raw("{\"region\": \"").escaped(region->first).raw("\", \"phrases\": [");
+    for (std::size_t i = 0; i < top.size() && i < limit; ++i) {
+      out.raw(i > 0 ? ", " : "").raw("{\"phrase\": \"").escaped(model.str(top[i].first));
+      out.raw("\", \"count\": ").integer(top[i].second).raw(", \"share\": ");
+      out.fixed4(static_cast<double>(top[i].second) / static_cast<double>(records[top[i].first].count)).raw("}");
+    }
+    out.raw("]}");
+    return 200;
+  }
+  out.raw("{\"contexts\": ").integer(header.totalContexts);
+  out.raw(", \"phrases\": ").integer(header.phraseCount);
+  out.raw(", \"clusters\": ").integer(query.clusterMembers.size());
+  out.raw(", \"annNodes\": ").integer(query.ann.size());
+  out.raw(", \"regions\": ").integer(query.regionTop.size()).raw("}");
+  return 200;
+}
+
+DaemonAction handleQueryLine(std::string_view line, const QueryModel &query, std::string &reply) {
+  if (!line.empty() && line.back() == '\r')
+    line.remove_suffix(1);
+  if (line.empty())
+    return DaemonAction::Continue;
+  std::size_t space = line.find(' ');
+  std::string_view command = line.substr(0, space);
+  std::string_view argument = space == std::string_view::npos ? std::string_view() : line.substr(space + 1);
+  OutputBuffer out;
+  if (command == "PHRASE" || command == "RELATED") {
+    answerQuery(query, command == "PHRASE" ? QueryKind::Phrase : QueryKind::Related, argument,
+                std::numeric_limits<std::size_t>::max(), out);
+  } else if (command == "CLUSTER" || command == "NEAREST" || command == "TOP") {
+    // An optional trailing count is the limit.
+    std::size_t limit = QUERY_DEFAULT_LIMIT;
+    std::size_t lastSpace = argument.rfind(' ');
+    if (lastSpace != std::string_view::npos && parseCount(argument.substr(lastSpace + 1), limit))
+      argument = argument.substr(0, lastSpace);
+    const QueryKind kind = command == "CLUSTER"   ? QueryKind::Cluster
+                           : command == "NEAREST" ? QueryKind::Nearest
+                                                  : QueryKind::Top;
+    answerQuery(query, kind, argument, limit, out);
+  } else if (command == "STATS") {
+    answerQuery(query, QueryKind::Stats, {}, 0, out);
+  } else if (command == "CLOSE") {
+    return DaemonAction::Close;
+  } else if (command == "SHUTDOWN") {
+    reply = "{\"shutdown\": true}";
+    return DaemonAction::Shutdown;
+  } else {
+    queryError(out, 400, "unknown command " + std::string(command));
+  }
+  reply = std::move(out.data);
+  return DaemonAction::Continue;
+}
+
+// Decodes %XX escapes and '+' in a URL query value.
+std::string urlDecode(std::string_view text) {
+  std::string decoded;
+  decoded.reserve(text.size());
+  for (std::size_t i = 0; i < text.size(); ++i) {
+    unsigned value = 0;
+    if (text[i] == '%' && i + 2 < text.size() &&
+        std::from_chars(text.data() + i + 1, text.data() + i + 3, value, 16).ptr == text.data() + i + 3) {
+      decoded.push_back(static_cast<char>(value));
+      i += 2;
+    } else {
+      decoded.push_back(text[i] == '+' ? ' ' : text[i]);
+    }
+  }
+  return decoded;
+}
+
+// Answers one GET target such as "/top?region=toronto&limit=5".
+int answerHttp(const QueryModel &query, std::string_view target, OutputBuffer &out) {
+  std::size_t mark = target.find('?');
+  std::string_view path = target.substr(0, mark);
+  std::string_view params = mark == std::string_view::npos ? std::string_view() : target.substr(mark + 1);
+  auto param = [&](std::string_view name) {
+    for (std::size_t start = 0; start < params.size();) {
+      std::size_t end = std::min(params.find('&', start), params.size());
+      std::string_view pair = params.substr(start, end - start);
+      if (pair.size() > name.size() && pair.substr(0, name.size()) == name && pair[name.size()] == '=')
+        return urlDecode(pair.substr(name.size() + 1));
+      start = end + 1;
+    }
+    return std::string();
+  };
+  std::size_t limit = QUERY_DEFAULT_LIMIT;
+  std::string limitText = param("limit");
+  if (!limitText.empty() && !parseCount(limitText, limit))
+    return queryError(out, 400, "limit must be a non-negative integer");
+  if (path == "/phrase")
+    return answerQuery(query, QueryKind::Phrase, param("q"), limit, out);
+  if (path == "/related")
+    return answerQuery(query, QueryKind::Related, param("q"), limit, out);
+  if (path == "/cluster")
+    return answerQuery(query, QueryKind::Cluster, param("id"), limit, out);
+  if (path == "/nearest")
+    return answerQuery(query, QueryKind::Nearest, param("q"), limit, out);
+  if (path == "/top")
+    return answerQuery(query, QueryKind::Top, param("region"), limit, out);
+  if (path == "/stats")
+    return answerQuery(query, QueryKind::Stats, {}, 0, out);
+  return queryError(out, 404, "not found");
+}
+
+bool writeHttpResponse(int fd, int status, const OutputBuffer &body, bool keepAlive) {
+  const char *reason = status == 200   ? "OK"
+                       : status == 400 ? "Bad Request"
+                       : status == 404 ? "Not Found"
+                       : status == 405 ? "Method Not Allowed"
+                                       : "Request Header Fields Too Large";
+  OutputBuffer head;
+  head.raw("HTTP/1.1 ").integer(status).raw(" ").raw(reason).raw("\r\n");
+  head.raw("Content-Type: application/json\r\nContent-Length: ").integer(body.data.size()).raw("\r\n");
+  head.raw(keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+  return writeAll(fd, head.data) && writeAll(fd, body.data);
+}
+
+// Serves GET requests on one keep-alive HTTP/1.1 connection; request bodies are not supported.
+void serveHttp(int fd, const QueryModel &query) {
+  std::string buffer;
+  char chunk[1 << 14];
+  for (;;) {
+    std::size_t headerEnd;
+    while ((headerEnd = buffer.find("\r\n\r\n")) == std::string::npos) {
+      if (buffer.size() > HTTP_MAX_HEADER) {
+        OutputBuffer body;
+        writeHttpResponse(fd, queryError(body, 431, "request header too large"), body, false);
+        return;
+      }
+      ssize_t got = ::read(fd, chunk, sizeof(chunk));
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0)
+        return;
+      buffer.append(chunk, static_cast<std::size_t>(got));
+    }
+    std::string head = buffer.substr(0, headerEnd);
+    buffer.erase(0, headerEnd + 4);
+    std::string_view requestLine = std::string_view(head).substr(0, head.find("\r\n"));
+    std::size_t firstSpace = requestLine.find(' ');
+    std::size_t lastSpace = requestLine.rfind(' ');
+    std::string_view method = requestLine.substr(0, firstSpace);
+    std::string_view target = firstSpace < lastSpace ? requestLine.substr(firstSpace + 1, lastSpace - firstSpace - 1)
+                                                     : std::string_view();
+    std::string headers(head);
+    std::transform(headers.begin(), headers.end(), headers.begin(), [](unsigned char ch) { return std::tolower(ch); });
+    bool keepAlive = requestLine.substr(lastSpace + 1) == "HTTP/1.1" &&
+                     headers.find("\r\nconnection: close") == std::string::npos;
+    OutputBuffer body;
+    int status;
+    if (method != "GET") {
+      status = queryError(body, 405, "only GET is supported");
+      keepAlive = false;
+    } else {
+      status = answerHttp(query, target, body);
+    }
+    if (!writeHttpResponse(fd, status, body, keepAlive) || !keepAlive)
+      return;
+  }
+}
+
+int listenHttp(std::size_t port) {
+  int server = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (server < 0) {
+    throw std::runtime_error("Failed to create socket");
+  }
+  int reuse = 1;
+  ::setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(static_cast<std::uint16_t>(port));
+  if (::bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(server, 64) != 0) {
+    ::close(server);
+    throw std::runtime_error("Failed to listen on 127.0.0.1:" + std::to_string(port));
+  }
+  return server;
+}
+
+// A client connection and the thread serving it. The fd is closed (and set to -1) under the
+// server's mutex, so stop() never shuts down a descriptor that has been reused.
+struct QueryConnection {
+  int fd = -1;
+  bool done = false;
+  std::thread thread;
+};
+
+struct QueryServer {
+  const QueryModel &query;
+  std::vector<int> listeners;
+  std::atomic<bool> stopping{false};
+  std::mutex mutex;
+  std::list<QueryConnection> connections; // guarded by mutex
+
+  explicit QueryServer(const QueryModel &model) : query(model) {}
+
+  // Wakes every accept loop and ends every open connection; called from whichever connection sent
+  // SHUTDOWN.
+  void stop() {
+    if (stopping.exchange(true))
+      return;
+    for (int listener : listeners)
+      ::shutdown(listener, SHUT_RDWR);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const QueryConnection &connection : connections) {
+      if (connection.fd >= 0)
+        ::shutdown(connection.fd, SHUT_RDWR);
+    }
+  }
+
+  // Joins the threads of connections that have ended. Called with mutex held.
+  void reapConnections() {
+    for (auto it = connections.begin(); it != connections.end();) {
+      if (!it->done) {
+        ++it;
+        continue;
+      }
+      it->thread.join();
+      it = connections.erase(it);
+    }
+  }
+
+  // Waits for every connection thread; the accept loops must have returned.
+  void joinConnections() {
+    stop();
+    for (QueryConnection &connection : connections)
+      connection.thread.join();
+    connections.clear();
+  }
+};
+
+// Serves each accepted connection with `serve` on a thread of its own until the server stops. At
+// most QUERY_MAX_CONNECTIONS are open at once, and reads time out after QUERY_IDLE_SECONDS.
+template <typename Serve> void acceptConnections(QueryServer &server, int listener, Serve serve) {
+  while (!server.stopping) {
+    int client = ::accept(listener, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+    std::lock_guard<std::mutex> lock(server.mutex);
+    server.reapConnections();
+    if (server.stopping || server.connections.size() >= QUERY_MAX_CONNECTIONS) {
+      ::close(client);
+      continue;
+    }
+    timeval idle{};
+    idle.tv_sec = QUERY_IDLE_SECONDS;
+    ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    QueryConnection &connection = server.connections.emplace_back();
+    connection.fd = client;
+    connection.thread = std::thread([&server, &connection, serve] {
+      serve(connection.fd);
+      std::lock_guard<std::mutex> done(server.mutex);
+      ::close(connection.fd);
+      connection.fd = -1;
+      connection.done = true;
+    });
+  }
+}
+
+void runQueryServer(const Options &options, CorpusStats &corpus) {
+  std::signal(SIGPIPE, SIG_IGN);
+  auto start = std::chrono::steady_clock::now();
+  QueryModel query;
+  if (options.modelInputPath.empty()) {
+    compactAll(corpus);
+    buildQueryModel(query, options, corpus);
+  } else {
+    mapQueryModel(query, options.modelInputPath);
+  }
+  if (!options.annInputPath.empty()) {
+    loadAnnIndex(options.annInputPath, query.ann, query.annPhrases);
+    query.annEf = options.annEf;
+  }
+  prepareQueryModel(query);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cerr << "Query model ready: " << query.view->header.phraseCount << " phrases, " << query.clusterMembers.size()
+            << " clusters, " << query.regionTop.size() << " regions (" << std::fixed << std::setprecision(2)
+            << elapsed.count() << " s)\n";
+
+  QueryServer server(query);
+  int socketListener = -1;
+  int httpListener = -1;
+  if (!options.querySocketPath.empty()) {
+    socketListener = listenUnix(options.querySocketPath);
+    server.listeners.push_back(socketListener);
+    std::cerr << "Answering queries on " << options.querySocketPath << "\n";
+  }
+  if (options.queryHttpPort > 0) {
+    httpListener = listenHttp(options.queryHttpPort);
+    server.listeners.push_back(httpListener);
+    std::cerr << "Answering queries on http://127.0.0.1:" << options.queryHttpPort << "\n";
+  }
+
+  auto serveLineClient = [&server](int fd) {
+    DaemonAction action = serveLines(fd, fd, [&](std::string_view line, std::string &reply) {
+      return handleQueryLine(line, server.query, reply);
+    });
+    if (action == DaemonAction::Shutdown)
+      server.stop();
+  };
+  auto serveHttpClient = [&query](int fd) { serveHttp(fd, query); };
+  std::thread httpThread;
+  if (httpListener >= 0 && socketListener >= 0) {
+    httpThread = std::thread([&] { acceptConnections(server, httpListener, serveHttpClient); });
+  }
+  if (socketListener >= 0) {
+    acceptConnections(server, socketListener, serveLineClient);
+  } else {
+    acceptConnections(server, httpListener, serveHttpClient);
+  }
+  if (httpThread.joinable())
+    httpThread.join();
+  server.joinConnections();
+  for (int listener : server.listeners)
+    ::close(listener);
+  if (socketListener >= 0)
+    ::unlink(options.querySocketPath.c_str());
+}
+
+} // namespace slang
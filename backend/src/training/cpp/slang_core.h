@@ -0,0 +1,805 @@
+// Shared core of the slang tools: the corpus tables, trainer options, the model stages, state files
+// and the line-protocol helpers. slang_trainer, slang_bench and slang_detect link the slang_core
+// library built from slang_core.cpp; everything here is in namespace slang.
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace slang {
+constexpr std::uint32_t NO_ID = std::numeric_limits<std::uint32_t>::max();
+
+// Bump allocator for interned strings: bytes are copied into large blocks that are only freed all at
+// once, with the arena. Views into it stay valid when the arena is moved.
+struct StringArena {
+  static constexpr std::size_t BLOCK_SIZE = 256 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char *cursor = nullptr;
+  std::size_t left = 0;
+  std::uint64_t reserved = 0; // bytes held in blocks
+
+  StringArena() = default;
+  StringArena(StringArena &&other) noexcept
+      : blocks(std::move(other.blocks)), cursor(std::exchange(other.cursor, nullptr)),
+        left(std::exchange(other.left, 0)), reserved(std::exchange(other.reserved, 0)) {}
+  StringArena &operator=(StringArena &&other) noexcept {
+    blocks = std::move(other.blocks);
+    cursor = std::exchange(other.cursor, nullptr);
+    left = std::exchange(other.left, 0);
+    reserved = std::exchange(other.reserved, 0);
+    return *this;
+  }
+
+  std::string_view copy(std::string_view value) {
+    if (value.empty())
+      return {};
+    char *target;
+    if (value.size() > BLOCK_SIZE / 8) {
+      // Long strings get a block of their own rather than wasting the rest of the current one.
+      blocks.emplace_back(new char[value.size()]);
+      reserved += value.size();
+      target = blocks.back().get();
+    } else {
+      if (value.size() > left) {
+        blocks.emplace_back(new char[BLOCK_SIZE]);
+        reserved += BLOCK_SIZE;
+        cursor = blocks.back().get();
+        left = BLOCK_SIZE;
+      }
+      target = cursor;
+      cursor += value.size();
+      left -= value.size();
+    }
+    std::memcpy(target, value.data(), value.size());
+    return {target, value.size()};
+  }
+};
+
+// Word-at-a-time string hash for the interners' tables.
+inline std::uint64_t hashString(std::string_view value) {
+  std::uint64_t h = 0x9E3779B97F4A7C15ull ^ value.size();
+  const char *p = value.data();
+  std::size_t n = value.size();
+  for (; n >= 8; p += 8, n -= 8) {
+    std::uint64_t word;
+    std::memcpy(&word, p, 8);
+    h = (h ^ word) * 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 29;
+  }
+  if (n > 0) {
+    std::uint64_t word = 0;
+    std::memcpy(&word, p, n);
+    h = (h ^ word) * 0xBF58476D1CE4E5B9ull;
+  }
+  h ^= h >> 32;
+  h *= 0x94D049BB133111EBull;
+  return h ^ (h >> 29);
+}
+
+// Assigns dense ids to strings in first-seen order. The strings live in an arena; lookups go through
+// an open-addressing table (linear probing, at most 70% full) of (hash, id) slots, so a probe touches
+// one cache line until the hashes match. A borrowed interner keeps the caller's views instead of
+// copying them, for strings another interner already owns.
+struct StringInterner {
+  struct Slot {
+    std::uint32_t hash = 0;
+    std::uint32_t id = NO_ID;
+  };
+
+  StringArena arena;
+  std::vector<std::string_view> strings; // by id
+  std::vector<Slot> slots;               // power-of-two size
+  bool borrowed = false;                 // views must outlive the interner
+
+  StringInterner() = default;
+  StringInterner(StringInterner &&) = default;
+  StringInterner &operator=(StringInterner &&) = default;
+  StringInterner(const StringInterner &) = delete;
+  StringInterner &operator=(const StringInterner &) = delete;
+
+  std::uint32_t intern(std::string_view value) {
+    if ((strings.size() + 1) * 10 > slots.size() * 7)
+      reserve(strings.size() + 1);
+    const std::uint32_t hash = static_cast<std::uint32_t>(hashString(value));
+    const std::size_t mask = slots.size() - 1;
+    std::size_t index = hash & mask;
+    for (; slots[index].id != NO_ID; index = (index + 1) & mask) {
+      if (slots[index].hash == hash && strings[slots[index].id] == value)
+        return slots[index].id;
+    }
+    const std::uint32_t id = static_cast<std::uint32_t>(strings.size());
+    strings.push_back(borrowed ? value : arena.copy(value));
+    slots[index] = {hash, id};
+    return id;
+  }
+
+  std::uint32_t find(std::string_view value) const {
+    if (slots.empty())
+      return NO_ID;
+    const std::uint32_t hash = static_cast<std::uint32_t>(hashString(value));
+    const std::size_t mask = slots.size() - 1;
+    for (std::size_t index = hash & mask; slots[index].id != NO_ID; index = (index + 1) & mask) {
+      if (slots[index].hash == hash && strings[slots[index].id] == value)
+        return slots[index].id;
+    }
+    return NO_ID;
+  }
+
+  // Sizes the table for `count` strings without rehashing on the way.
+  void reserve(std::size_t count) {
+    std::size_t capacity = std::max<std::size_t>(slots.size(), 16);
+    while (count * 10 > capacity * 7)
+      capacity *= 2;
+    if (count > strings.capacity())
+      strings.reserve(std::max(count, strings.capacity() * 2));
+    if (capacity == slots.size())
+      return;
+    std::vector<Slot> grown(capacity);
+    const std::size_t mask = capacity - 1;
+    for (const Slot &slot : slots) {
+      if (slot.id == NO_ID)
+        continue;
+      std::size_t index = slot.hash & mask;
+      while (grown[index].id != NO_ID)
+        index = (index + 1) & mask;
+      grown[index] = slot;
+    }
+    slots.swap(grown);
+  }
+
+  std::string_view str(std::uint32_t id) const { return strings[id]; }
+  std::size_t size() const { return strings.size(); }
+};
+
+using IdCount = std::pair<std::uint32_t, std::uint64_t>;
+
+// Counts keyed by interned id, kept as an id-sorted array. Increments are appended to `pending`
+// and folded in by compact() once the backlog reaches the size of the sorted array, so ingest
+// never shifts the array per token. Readers must see a compacted vector.
+struct CountVector {
+  std::vector<IdCount> entries;
+  std::vector<IdCount> pending;
+
+  void add(std::uint32_t id, std::uint64_t count = 1) {
+    pending.push_back({id, count});
+    if (pending.size() >= std::max<std::size_t>(32, entries.size()))
+      compact();
+  }
+
+  void compact() {
+    if (pending.empty())
+      return;
+    std::sort(pending.begin(), pending.end(), [](const IdCount &a, const IdCount &b) { return a.first < b.first; });
+    std::vector<IdCount> merged;
+    merged.reserve(entries.size() + pending.size());
+    auto a = entries.begin();
+    auto b = pending.begin();
+    while (a != entries.end() || b != pending.end()) {
+      const IdCount &next = (b == pending.end() || (a != entries.end() && a->first <= b->first)) ? *a++ : *b++;
+      if (!merged.empty() && merged.back().first == next.first) {
+        merged.back().second += next.second;
+      } else {
+        merged.push_back(next);
+      }
+    }
+    entries.swap(merged);
+    std::vector<IdCount>().swap(pending);
+  }
+
+  // Position of `id` in entries, or entries.size() when absent.
+  std::size_t position(std::uint32_t id) const {
+    auto it = std::lower_bound(entries.begin(), entries.end(), id,
+                               [](const IdCount &entry, std::uint32_t key) { return entry.first < key; });
+    return it != entries.end() && it->first == id ? static_cast<std::size_t>(it - entries.begin()) : entries.size();
+  }
+
+  std::size_t size() const { return entries.size(); }
+};
+
+// Scores are summed in fixed point, SCORE_SCALE units per point, so a sum is exact and does not
+// depend on the order shards, windows or merged states are added in. One row's score is clamped to
+// +-SCORE_LIMIT, at most 1e18 units, and sums are 128-bit, so rows alone cannot overflow one (that
+// takes over 1e20 rows); addScoreUnits still rejects overflow, which sums read from files can reach.
+constexpr double SCORE_SCALE = 1e6;
+constexpr double SCORE_LIMIT = 1e12;
+
+using ScoreSum = __int128;
+
+inline std::int64_t scoreUnits(double score) {
+  if (!std::isfinite(score))
+    return 0;
+  return std::llround(std::max(-SCORE_LIMIT, std::min(SCORE_LIMIT, score)) * SCORE_SCALE);
+}
+
+// A score sum in points as v1 text state files store it, unclamped.
+inline ScoreSum scoreSumUnits(double sum) {
+  const double units = std::round(sum * SCORE_SCALE);
+  if (!(std::fabs(units) < 0x1p127)) {
+    throw std::runtime_error("Stored score sum out of range: " + std::to_string(sum));
+  }
+  return static_cast<ScoreSum>(units);
+}
+
+inline void addScoreUnits(ScoreSum &sum, ScoreSum units) {
+  if (__builtin_add_overflow(sum, units, &sum)) {
+    throw std::runtime_error("Score sum overflow");
+  }
+}
+
+inline double scoreValue(ScoreSum units) { return static_cast<double>(units) / SCORE_SCALE; }
+
+struct PhraseStats {
+  std::uint64_t count = 0;
+  ScoreSum scoreSum = 0; // score units
+  CountVector regionCounts;
+  CountVector tokenCounts;
+
+  double avgScore() const { return count ? scoreValue(scoreSum) / static_cast<double>(count) : 0.0; }
+};
+
+struct CorpusTotals {
+  std::uint64_t totalContexts = 0;
+  std::vector<std::uint64_t> tokenTotals; // by token id
+};
+
+// Centroids of the last clustering run, kept in the state so the next run can warm-start from them.
+// Columns are embedding tokens; values is row-major, one row of tokens.size() floats per cluster.
+struct ClusterCentroids {
+  std::vector<std::uint32_t> tokens;
+  std::vector<float> values;
+
+  std::size_t clusterCount() const { return tokens.empty() ? 0 : values.size() / tokens.size(); }
+};
+
+// Count-min sketch over strings with conservative updates: estimates never undercount, and overcount
+// by at most e / width of the total added with probability 1 - e^-depth.
+struct CountMinSketch {
+  std::uint32_t width = 0; // a power of two
+  std::uint32_t depth = 0;
+  std::vector<std::uint64_t> cells; // depth rows of width counters
+
+  bool empty() const { return cells.empty(); }
+
+  void reset(std::uint32_t sketchWidth, std::uint32_t sketchDepth) {
+    width = sketchWidth;
+    depth = sketchDepth;
+    cells.assign(std::size_t{width} * depth, 0);
+  }
+
+  static std::uint64_t hash(std::string_view key) {
+    std::uint64_t h = 0xCBF29CE484222325ull; // FNV-1a, then a splitmix finalizer
+    for (char ch : key) {
+      h ^= static_cast<unsigned char>(ch);
+      h *= 0x100000001B3ull;
+    }
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+  }
+
+  // Row r uses h1 + r * h2 (double hashing).
+  std::size_t cell(std::uint64_t h, std::uint32_t row) const {
+    std::uint64_t h2 = (h >> 32) | 1;
+    return std::size_t{row} * width + static_cast<std::size_t>((h + row * h2) & (width - 1));
+  }
+
+  std::uint64_t estimate(std::string_view key) const {
+    if (cells.empty())
+      return 0;
+    const std::uint64_t h = hash(key);
+    std::uint64_t best = std::numeric_limits<std::uint64_t>::max();
+    for (std::uint32_t row = 0; row < depth; ++row)
+      best = std::min(best, cells[cell(h, row)]);
+    return best;
+  }
+
+  void add(std::string_view key, std::uint64_t count) {
+    const std::uint64_t target = estimate(key) + count;
+    const std::uint64_t h = hash(key);
+    for (std::uint32_t row = 0; row < depth; ++row) {
+      std::uint64_t &value = cells[cell(h, row)];
+      value = std::max(value, target);
+    }
+  }
+};
+
+// Bookkeeping for --memory-budget. Once the budget is first exceeded, token entries at or below a
+// threshold are pruned from every phrase and tokens no phrase references any more are evicted into
+// the sketch. A re-interned token starts from its sketch estimate (its seed), so only the mass seen
+// since then goes back into the sketch when it is evicted again.
+struct ApproxCounts {
+  CountMinSketch sketch;
+  std::vector<std::uint64_t> tokenSeeds; // by token id, while active
+  std::uint64_t tokenCountError = 0;     // per-phrase token counts undercount by at most this
+  std::uint64_t evictedMass = 0;         // total added to the sketch
+  std::uint64_t prunedEntries = 0;
+  std::uint64_t evictedTokens = 0;
+
+  bool active() const { return !sketch.empty(); }
+
+  // Token totals overcount by at most this, with probability 1 - e^-depth.
+  std::uint64_t tokenTotalError() const {
+    return active() ? static_cast<std::uint64_t>(std::ceil(std::exp(1.0) * static_cast<double>(evictedMass) /
+                                                           static_cast<double>(sketch.width)))
+                    : 0;
+  }
+};
+
+// Everything ingest produces: interned phrase/token/region strings, per-phrase stats indexed by
+// phrase id and corpus-wide token totals indexed by token id. With --per-region, each region's
+// contexts are also counted into a slice of their own (indexed by region id), whose ids are its own
+// but whose interners borrow the strings of this one.
+struct CorpusStats {
+  StringInterner phrases;
+  StringInterner tokens;
+  StringInterner regions;
+  std::vector<PhraseStats> stats;
+  std::vector<std::uint8_t> contextToken; // by token id: long enough and not a stop word
+  CorpusTotals totals;
+  ClusterCentroids centroids;
+  ApproxCounts approx;
+  bool sliceRegions = false;
+  std::vector<CorpusStats> regionSlices;
+};
+
+struct Options {
+  std::string inputPath;
+  std::string outputPath = "slang_language_model.json";
+  std::uint64_t minCount = 2;
+  std::size_t topTokens = 12;
+  std::size_t relatedLimit = 5;
+  std::string graphOutputPath;
+  std::string stateInputPath;
+  std::string stateOutputPath;
+  bool stateOnly = false; // ingest and save the state without building a model
+  std::string deltaOutputPath;
+  bool deltaOnly = false;     // write only the delta model
+  double pmiStaleness = 0.05; // largest PMI drift a delta leaves unrefreshed
+  std::size_t embeddingFeatures = 32;
+  std::string embeddingStorage = "dense"; // dense (float32), int8 or sparse
+  std::size_t embeddingProjection = 0;    // random-projection dimension; 0 keeps one per feature
+  std::size_t clusterCount = 8;
+  std::size_t clusterIterations = 25;
+  std::string kmeansMode = "full";
+  std::size_t batchSize = 1024;
+  std::size_t embeddingNeighbors = 0;
+  std::size_t annEf = 64;
+  std::string annIndexPath;
+  std::string modelFilePath;
+  std::string modelInputPath; // --model-in: a --model-bin file the query server maps instead of building
+  std::string annInputPath;   // --ann-in: an --ann-index file the query server answers NEAREST from
+  std::string mineOutputPath;
+  std::size_t mineMaxLength = 4;  // longest mined n-gram, in tokens
+  std::uint64_t mineMinCount = 5; // occurrences before an n-gram is a candidate
+  std::size_t mineLimit = 1000;
+  std::string regionOutputDir; // --per-region: a model per region in this directory
+  bool profile = false;
+  std::string metricsPath;
+  std::uint64_t memoryBudget = 0; // bytes; 0 keeps every count exactly
+  double minPmi = 0.0;
+  std::size_t threads = 1;
+  std::string stateFormat = "v2";
+  bool serve = false;
+  std::string socketPath;
+  std::string querySocketPath;
+  std::size_t queryHttpPort = 0;
+  std::uint64_t seed = 42;
+};
+
+// Append-only text buffer for the model and graph writers. Numbers are formatted with std::to_chars
+// and strings are JSON-escaped in one pass, so nothing depends on stream formatting state.
+struct OutputBuffer {
+  std::string data;
+
+  OutputBuffer &raw(std::string_view text) {
+    data.append(text);
+    return *this;
+  }
+
+  // Appends `text` escaped for a JSON string literal (without the quotes).
+  OutputBuffer &escaped(std::string_view text) {
+    static const char HEX[] = "0123456789ABCDEF";
+    std::size_t run = 0;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+      unsigned char ch = static_cast<unsigned char>(text[i]);
+      if (ch >= 0x20 && ch != '"' && ch != '\\')
+        continue;
+      data.append(text.data() + run, i - run);
+      run = i + 1;
+      switch (ch) {
+      case '"':
+        data.append("\\\"");
+        break;
+      case '\\':
+        data.append("\\\\");
+        break;
+      case '\n':
+        data.append("\\n");
+        break;
+      case '\r':
+        data.append("\\r");
+        break;
+      case '\t':
+        data.append("\\t");
+        break;
+      default: {
+        const char unicode[] = {'\\', 'u', '0', '0', HEX[ch >> 4], HEX[ch & 0xF]};
+        data.append(unicode, sizeof(unicode));
+      }
+      }
+    }
+    data.append(text.data() + run, text.size() - run);
+    return *this;
+  }
+
+  template <typename Integer> OutputBuffer &integer(Integer value) {
+    char buffer[24];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    data.append(buffer, result.ptr);
+    return *this;
+  }
+
+  // Fixed notation, matching std::fixed << std::setprecision(precision).
+  OutputBuffer &fixed(double value, int precision) {
+    char buffer[400];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed, precision);
+    data.append(buffer, result.ptr);
+    return *this;
+  }
+  OutputBuffer &fixed4(double value) { return fixed(value, 4); }
+
+  void flushTo(std::ostream &out) {
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    data.clear();
+  }
+};
+
+// Run metrics for --profile / --metrics-out: wall time, CPU time (all threads) and peak RSS after
+// each stage, plus sizes and counters reported by the stages. With a metrics path set, the report
+// is rewritten after every stage, so a run killed part-way still leaves what it got through.
+struct Profiler {
+  struct Stage {
+    std::string name;
+    double wallSeconds;
+    double cpuSeconds;
+    std::uint64_t peakRssKb;
+  };
+  struct Table {
+    std::string name;
+    std::uint64_t entries;
+    std::uint64_t buckets; // 0 for tables that are not hash maps
+    std::uint64_t bytes;   // approximate heap footprint
+  };
+
+  std::string metricsPath;
+  std::vector<Stage> stages;
+  std::vector<Table> tables;
+  std::uint64_t ingestRows = 0;
+  std::uint64_t ingestBytes = 0;
+  double ingestSeconds = 0.0;
+  std::uint64_t kmeansDistanceEvaluations = 0;
+
+  static double cpuSeconds() {
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    auto seconds = [](const timeval &tv) { return static_cast<double>(tv.tv_sec) + tv.tv_usec * 1e-6; };
+    return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+  }
+
+  static std::uint64_t peakRssKb() {
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return static_cast<std::uint64_t>(usage.ru_maxrss) / 1024; // bytes on macOS
+#else
+    return static_cast<std::uint64_t>(usage.ru_maxrss);
+#endif
+  }
+
+  void table(const std::string &name, std::uint64_t entries, std::uint64_t buckets, std::uint64_t bytes) {
+    auto it = std::find_if(tables.begin(), tables.end(), [&](const Table &t) { return t.name == name; });
+    if (it == tables.end()) {
+      tables.push_back({name, entries, buckets, bytes});
+    } else {
+      *it = {name, entries, buckets, bytes};
+    }
+  }
+
+  void write(std::ostream &out) const {
+    OutputBuffer buf;
+    buf.raw("{\n  \"stages\": [");
+    for (std::size_t i = 0; i < stages.size(); ++i) {
+      buf.raw(i > 0 ? ",\n" : "\n").raw("    {\"name\": \"").escaped(stages[i].name);
+      buf.raw("\", \"wallSeconds\": ").fixed(stages[i].wallSeconds, 6);
+      buf.raw(", \"cpuSeconds\": ").fixed(stages[i].cpuSeconds, 6);
+      buf.raw(", \"peakRssKb\": ").integer(stages[i].peakRssKb).raw("}");
+    }
+    buf.raw("\n  ],\n");
+    const double ingestRate = ingestSeconds > 0.0 ? 1.0 / ingestSeconds : 0.0;
+    buf.raw("  \"ingest\": {\"rows\": ").integer(ingestRows).raw(", \"bytes\": ").integer(ingestBytes);
+    buf.raw(", \"rowsPerSecond\": ").fixed(static_cast<double>(ingestRows) * ingestRate, 1);
+    buf.raw(", \"bytesPerSecond\": ").fixed(static_cast<double>(ingestBytes) * ingestRate, 1).raw("},\n");
+    buf.raw("  \"tables\": [");
+    for (std::size_t i = 0; i < tables.size(); ++i) {
+      const Table &t = tables[i];
+      buf.raw(i > 0 ? ",\n" : "\n").raw("    {\"name\": \"").escaped(t.name);
+      buf.raw("\", \"entries\": ").integer(t.entries).raw(", \"buckets\": ").integer(t.buckets);
+      buf.raw(", \"loadFactor\": ").fixed(t.buckets ? static_cast<double>(t.entries) / t.buckets : 0.0, 4);
+      buf.raw(", \"bytes\": ").integer(t.bytes).raw("}");
+    }
+    buf.raw("\n  ],\n");
+    buf.raw("  \"kmeans\": {\"distanceEvaluations\": ").integer(kmeansDistanceEvaluations).raw("},\n");
+    buf.raw("  \"peakRssKb\": ").integer(peakRssKb()).raw("\n}\n");
+    buf.flushTo(out);
+  }
+
+  void save() const {
+    if (metricsPath.empty())
+      return;
+    std::ofstream out(metricsPath, std::ios::trunc);
+    if (!out) {
+      throw std::runtime_error("Failed to write metrics file: " + metricsPath);
+    }
+    write(out);
+  }
+};
+
+// Runs fn as stage `name`, recording it when profiling is on (profiler is null otherwise).
+template <typename Fn> void profileStage(Profiler *profiler, const char *name, Fn fn) {
+  if (!profiler) {
+    fn();
+    return;
+  }
+  const auto wallStart = std::chrono::steady_clock::now();
+  const double cpuStart = Profiler::cpuSeconds();
+  fn();
+  const std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wallStart;
+  profiler->stages.push_back({name, wall.count(), Profiler::cpuSeconds() - cpuStart, Profiler::peakRssKb()});
+  profiler->save();
+}
+
+// Inverted index from token id to the phrases whose contexts contain it, in CSR layout:
+// postings[offsets[t] .. offsets[t + 1]) holds (phrase id, co-occurrence count) sorted by phrase id.
+struct TokenIndex {
+  std::vector<std::size_t> offsets;
+  std::vector<IdCount> postings;
+};
+
+using RelatedList = std::vector<std::pair<std::uint32_t, double>>;
+
+// Moments of a phrase's positive token PMIs. Per-token PMIs are not kept: the few that are output
+// (top tokens, embedding columns) are recomputed by tokenPmi() where they are used.
+struct PhraseFeatureSummary {
+  double meanPositivePmi = 0.0;
+  double variancePositivePmi = 0.0;
+  double maxPositivePmi = 0.0;
+  double positiveCount = 0.0;
+};
+
+enum class EmbeddingStorage { Dense, Int8, Sparse };
+
+struct EmbeddingFormat {
+  EmbeddingStorage storage = EmbeddingStorage::Dense;
+  std::size_t projection = 0; // random projection to this many dimensions; 0 keeps one per token
+  std::uint64_t seed = 42;
+};
+
+// One PMI feature vector per phrase above minCount: row i belongs to phrases[i]. k-means, the ANN
+// index and the delta model read rows only through distance(), decode() and accumulate(), so each
+// storage is used as is; Dense rows go through the vector squaredDistance kernel.
+struct Embeddings {
+  std::size_t dim = 0;
+  EmbeddingStorage storage = EmbeddingStorage::Dense;
+  std::vector<std::uint32_t> phrases;
+  std::vector<float> values;         // Dense: size() * dim, row-major; Sparse: the non-zero values
+  std::vector<std::int8_t> codes;    // Int8: size() * dim, row-major
+  std::vector<float> scales;         // Int8: one per row
+  std::vector<std::uint64_t> offsets; // Sparse: size() + 1, row i is [offsets[i], offsets[i + 1])
+  std::vector<std::uint32_t> columns; // Sparse: ascending within a row
+
+  std::size_t size() const { return phrases.size(); }
+
+  // Squared distance from row i to a dense point; `pointNorm` is the point's squared norm, which
+  // lets Sparse rows skip the point's zero-row columns.
+  float distance(std::size_t i, const float *point, float pointNorm) const;
+
+  void decode(std::size_t i, float *out) const {
+    if (storage == EmbeddingStorage::Dense) {
+      std::copy(values.data() + i * dim, values.data() + (i + 1) * dim, out);
+    } else if (storage == EmbeddingStorage::Int8) {
+      for (std::size_t d = 0; d < dim; ++d) {
+        out[d] = scales[i] * static_cast<float>(codes[i * dim + d]);
+      }
+    } else {
+      std::fill(out, out + dim, 0.0f);
+      for (std::uint64_t k = offsets[i]; k < offsets[i + 1]; ++k) {
+        out[columns[k]] = values[k];
+      }
+    }
+  }
+
+  // Adds row i's columns [begin, end) to target[begin, end).
+  void accumulate(std::size_t i, double *target, std::size_t begin, std::size_t end) const {
+    if (storage == EmbeddingStorage::Dense) {
+      const float *row = values.data() + i * dim;
+      for (std::size_t d = begin; d < end; ++d) {
+        target[d] += row[d];
+      }
+    } else if (storage == EmbeddingStorage::Int8) {
+      const std::int8_t *row = codes.data() + i * dim;
+      for (std::size_t d = begin; d < end; ++d) {
+        target[d] += scales[i] * static_cast<float>(row[d]);
+      }
+    } else {
+      auto first = columns.begin() + static_cast<std::ptrdiff_t>(offsets[i]);
+      auto last = columns.begin() + static_cast<std::ptrdiff_t>(offsets[i + 1]);
+      for (auto it = std::lower_bound(first, last, begin); it != last && *it < end; ++it) {
+        target[*it] += values[static_cast<std::size_t>(it - columns.begin())];
+      }
+    }
+  }
+
+  std::uint64_t bytes() const {
+    return phrases.capacity() * sizeof(std::uint32_t) + values.capacity() * sizeof(float) + codes.capacity() +
+           scales.capacity() * sizeof(float) + offsets.capacity() * sizeof(std::uint64_t) +
+           columns.capacity() * sizeof(std::uint32_t);
+  }
+};
+
+struct KMeansResult {
+  bool valid = false;
+  std::size_t dim = 0;
+  std::vector<int> assignments;
+  std::vector<float> centroids; // row-major, clusterCount() x dim
+  std::vector<std::uint32_t> phrases;
+  std::uint64_t distanceEvaluations = 0;
+
+  std::size_t clusterCount() const { return dim ? centroids.size() / dim : 0; }
+};
+
+// Hierarchical navigable small world graph (Malkov & Yashunin) over unit-length embedding rows, so
+// squared distance is 2 - 2 * cosine similarity. Every node has up to ANN_BASE_LINKS neighbours on
+// level 0 and ANN_LINKS on each level above it; a link list is a count followed by its slots.
+constexpr std::size_t ANN_LINKS = 16;
+constexpr std::size_t ANN_BASE_LINKS = 2 * ANN_LINKS;
+
+struct AnnIndex {
+  std::size_t dim = 0;
+  std::vector<float> vectors;                        // unit-length rows, one per node
+  std::vector<std::uint32_t> phrases;                // phrase id per node
+  std::vector<std::uint8_t> levels;                  // top level per node
+  std::vector<std::uint32_t> baseLinks;              // level 0, ANN_BASE_LINKS + 1 words per node
+  std::vector<std::vector<std::uint32_t>> upperLinks; // levels 1..level, ANN_LINKS + 1 words each
+  std::uint32_t entryPoint = NO_ID;
+  int maxLevel = -1;
+
+  std::size_t size() const { return phrases.size(); }
+  const float *vector(std::uint32_t node) const { return vectors.data() + std::size_t{node} * dim; }
+  std::uint32_t *links(std::uint32_t node, int level) {
+    return level == 0 ? baseLinks.data() + std::size_t{node} * (ANN_BASE_LINKS + 1)
+                      : upperLinks[node].data() + static_cast<std::size_t>(level - 1) * (ANN_LINKS + 1);
+  }
+  const std::uint32_t *links(std::uint32_t node, int level) const {
+    return const_cast<AnnIndex *>(this)->links(node, level);
+  }
+  float distance(const float *query, std::uint32_t node) const;
+};
+
+// Everything the model outputs are written from, built stage by stage from the corpus.
+struct Model {
+  std::vector<PhraseFeatureSummary> features; // by phrase id
+  std::vector<std::uint32_t> embeddingTokens;
+  Embeddings embeddings;
+  KMeansResult clusters;
+  std::vector<RelatedList> related; // by phrase id
+  AnnIndex annIndex;
+  std::vector<RelatedList> embeddingNeighbors; // by phrase id, empty unless --embedding-neighbors
+};
+
+// Counts before an ingest, so the run can tell which phrases and tokens it changed (--delta-output).
+struct IngestSnapshot {
+  std::uint64_t totalContexts = 0;
+  std::vector<std::uint64_t> phraseCounts; // by phrase id
+  std::vector<std::uint64_t> tokenTotals;  // by token id
+  std::uint64_t evictedTokens = 0;         // token ids are renumbered when this moves
+};
+
+enum class DaemonAction { Continue, Close, Shutdown };
+
+bool writeAll(int fd, std::string_view data);
+
+// Feeds each line of an input stream to `handle(line, reply)`, writing back non-empty replies, until
+// EOF or until the handler asks to close or shut down. Returns the action that ended the stream.
+template <typename Handler> DaemonAction serveLines(int inFd, int replyFd, Handler handle) {
+  std::string buffer;
+  std::string reply;
+  char chunk[1 << 16];
+  for (;;) {
+    ssize_t got = ::read(inFd, chunk, sizeof(chunk));
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      break;
+    buffer.append(chunk, static_cast<std::size_t>(got));
+    std::size_t start = 0;
+    for (std::size_t newline; (newline = buffer.find('\n', start)) != std::string::npos; start = newline + 1) {
+      reply.clear();
+      DaemonAction action = handle(std::string_view(buffer).substr(start, newline - start), reply);
+      if (!reply.empty() && !writeAll(replyFd, reply + "\n"))
+        return DaemonAction::Close;
+      if (action != DaemonAction::Continue)
+        return action;
+    }
+    buffer.erase(0, start);
+  }
+  if (!buffer.empty()) {
+    reply.clear();
+    DaemonAction action = handle(std::string_view(buffer), reply);
+    if (!reply.empty())
+      writeAll(replyFd, reply + "\n");
+    return action == DaemonAction::Shutdown ? action : DaemonAction::Close;
+  }
+  return DaemonAction::Close;
+}
+
+// Command line and state files.
+Options parseOptions(int argc, char **argv);
+bool loadState(const std::string &path, CorpusStats &corpus); // false when there is no file to load
+void saveState(const std::string &path, const CorpusStats &corpus, const std::string &format);
+void runMerge(int argc, char **argv); // slang_trainer merge --state-out out.dat in.dat...
+std::vector<std::uint32_t> sortedPhraseIds(const CorpusStats &corpus); // in string order
+
+// Ingest. ingestFile returns the bytes read.
+std::uint64_t ingestFile(const std::string &path, std::size_t threads, CorpusStats &corpus,
+                         std::uint64_t memoryBudget = 0);
+void enforceMemoryBudget(CorpusStats &corpus, std::uint64_t budget);
+IngestSnapshot snapshotCorpus(const CorpusStats &corpus);
+void profileCorpusTables(Profiler &profiler, const CorpusStats &corpus);
+void mineCandidates(const Options &options, const CorpusStats &corpus, std::ostream &log);
+
+// Model stages, in the order writeModel runs them.
+std::vector<PhraseFeatureSummary> summarizeAll(const CorpusStats &corpus, std::uint64_t minCount, std::size_t threads);
+std::vector<std::uint32_t> selectEmbeddingTokens(const CorpusStats &corpus, std::size_t limit);
+EmbeddingFormat embeddingFormat(const Options &options);
+Embeddings buildEmbeddings(const CorpusStats &corpus, const std::vector<std::uint32_t> &vocab, std::uint64_t minCount,
+                           double minPmi, std::size_t threads, const EmbeddingFormat &format = {},
+                           const std::vector<std::uint8_t> *only = nullptr);
+KMeansResult clusterEmbeddings(const Options &options, const CorpusStats &corpus, const Model &model);
+TokenIndex buildTokenIndex(const CorpusStats &corpus, const std::vector<std::uint8_t> *only = nullptr);
+std::vector<RelatedList> buildRelatedGraph(const CorpusStats &corpus, const TokenIndex &index, std::uint64_t minCount,
+                                           std::size_t limit, std::size_t threads);
+void buildEmbeddingNeighbors(const Options &options, const CorpusStats &corpus, Model &model);
+void writeModelOutputs(const Options &options, const CorpusStats &corpus, const Model &model, std::ostream &log);
+
+// Whole runs: the model (returning its centroids for the state), the delta model, per-region models
+// and the resident daemons.
+ClusterCentroids writeModel(const Options &options, const CorpusStats &corpus, std::ostream &log,
+                            Profiler *profiler = nullptr, const IngestSnapshot *before = nullptr);
+void writeDelta(const Options &options, const CorpusStats &corpus, const IngestSnapshot &before,
+                const Model *full, std::ostream &log, Profiler *profiler = nullptr);
+void writeRegionModels(const Options &options, const CorpusStats &corpus, std::ostream &log);
+void runDaemon(const Options &options, CorpusStats &corpus);
+void runQueryServer(const Options &options, CorpusStats &corpus);
+
+} // namespace slang
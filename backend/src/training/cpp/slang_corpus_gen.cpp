@@ -0,0 +1,262 @@
+// Deterministic synthetic contexts.tsv generator for benchmarking slang_trainer.
+//
+// Tokens, phrases and regions follow Zipf distributions. The most frequent tokens are common English
+// words, so stop-word filtering does real work; each phrase belongs to a topic whose tokens show up
+// in its contexts more often than chance, so PMI, clustering and related phrases see structure.
+// Only the engine's raw output is used, so a given seed gives the same file on every platform.
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct GeneratorOptions {
+  std::string outputPath;
+  std::uint64_t rows = 100000;
+  std::size_t phrases = 5000;
+  std::size_t regions = 60;
+  std::size_t vocabulary = 50000;
+  std::size_t topics = 64;
+  std::size_t minTokens = 6;
+  std::size_t maxTokens = 30;
+  double tokenSkew = 1.07;
+  double phraseSkew = 1.0;
+  double regionSkew = 1.2;
+  double topicShare = 0.3;
+  std::size_t scoreDecimals = 0; // digits after the point in scores; 0 writes whole numbers
+  std::uint64_t seed = 1;
+};
+
+const char *const COMMON_WORDS[] = {
+    "the",   "to",    "and",   "a",     "i",     "of",    "is",    "that",  "it",    "you",   "in",   "this",
+    "for",   "was",   "on",    "but",   "my",    "so",    "be",    "like",  "just",  "have",  "not",  "with",
+    "are",   "they",  "me",    "he",    "all",   "what",  "at",    "if",    "when",  "she",   "we",   "your",
+    "one",   "out",   "about", "up",    "lol",   "get",   "can",   "now",   "people","really","then", "do",
+    "know",  "how",   "got",   "time",  "good",  "there", "been",  "no",    "going", "think", "too",  "even",
+    "fr",    "bro",   "literally", "honestly", "vibe", "post", "video", "comment", "chat", "thread"};
+constexpr std::size_t COMMON_WORD_COUNT = sizeof(COMMON_WORDS) / sizeof(COMMON_WORDS[0]);
+
+const char *const SYLLABLES[] = {"ba", "ko", "ri", "zu", "mi", "ta", "ne", "lo", "sha", "vi", "de", "pu",
+                                 "gra", "fle", "yo", "ix", "qua", "dri", "mo", "sna", "te", "ly", "bu", "zo"};
+constexpr std::size_t SYLLABLE_COUNT = sizeof(SYLLABLES) / sizeof(SYLLABLES[0]);
+
+const char *const REGION_NAMES[] = {"toronto", "london", "nyc", "la", "atlanta", "chicago", "houston", "uk",
+                                    "aave", "sydney", "manchester", "dublin", "lagos", "mumbai", "manila",
+                                    "vancouver", "montreal", "glasgow", "auckland", "singapore"};
+constexpr std::size_t REGION_NAME_COUNT = sizeof(REGION_NAMES) / sizeof(REGION_NAMES[0]);
+
+const char *const PLATFORMS[] = {"reddit", "x", "tiktok", "youtube", "twitch"};
+const double PLATFORM_WEIGHTS[] = {0.45, 0.25, 0.15, 0.1, 0.05};
+
+std::size_t randomIndex(std::mt19937_64 &rng, std::size_t bound) { return static_cast<std::size_t>(rng() % bound); }
+double randomUnit(std::mt19937_64 &rng) { return static_cast<double>(rng() >> 11) * (1.0 / 9007199254740992.0); }
+
+// Samples ranks 0..size-1 with probability proportional to 1 / (rank + 1)^skew.
+struct ZipfSampler {
+  std::vector<double> cumulative;
+
+  ZipfSampler(std::size_t size, double skew) : cumulative(size) {
+    double total = 0.0;
+    for (std::size_t rank = 0; rank < size; ++rank) {
+      total += 1.0 / std::pow(static_cast<double>(rank + 1), skew);
+      cumulative[rank] = total;
+    }
+  }
+
+  std::size_t operator()(std::mt19937_64 &rng) const {
+    double target = randomUnit(rng) * cumulative.back();
+    auto it = std::upper_bound(cumulative.begin(), cumulative.end(), target);
+    return std::min(static_cast<std::size_t>(it - cumulative.begin()), cumulative.size() - 1);
+  }
+};
+
+// A pronounceable word for `index`: its base-SYLLABLE_COUNT digits spelled as syllables.
+std::string syntheticWord(std::size_t index) {
+  std::string word;
+  do {
+    word += SYLLABLES[index % SYLLABLE_COUNT];
+    index /= SYLLABLE_COUNT;
+  } while (index > 0);
+  return word;
+}
+
+GeneratorOptions parseOptions(int argc, char **argv) {
+  GeneratorOptions opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--output" && i + 1 < argc) {
+      opts.outputPath = argv[++i];
+    } else if (arg == "--rows" && i + 1 < argc) {
+      opts.rows = static_cast<std::uint64_t>(std::stoull(argv[++i]));
+    } else if (arg == "--phrases" && i + 1 < argc) {
+      opts.phrases = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--regions" && i + 1 < argc) {
+      opts.regions = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--vocabulary" && i + 1 < argc) {
+      opts.vocabulary = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--topics" && i + 1 < argc) {
+      opts.topics = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--min-tokens" && i + 1 < argc) {
+      opts.minTokens = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--max-tokens" && i + 1 < argc) {
+      opts.maxTokens = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--token-skew" && i + 1 < argc) {
+      opts.tokenSkew = std::stod(argv[++i]);
+    } else if (arg == "--topic-share" && i + 1 < argc) {
+      opts.topicShare = std::stod(argv[++i]);
+    } else if (arg == "--score-decimals" && i + 1 < argc) {
+      opts.scoreDecimals = static_cast<std::size_t>(std::stoull(argv[++i]));
+    } else if (arg == "--seed" && i + 1 < argc) {
+      opts.seed = static_cast<std::uint64_t>(std::stoull(argv[++i]));
+    } else if (arg == "--help" || arg == "-h") {
+      std::cout << "Usage: slang_corpus_gen --output contexts.tsv [--rows 100000] [--phrases 5000] [--regions 60] "
+                   "[--vocabulary 50000] [--topics 64] [--min-tokens 6] [--max-tokens 30] [--token-skew 1.07] "
+                   "[--topic-share 0.3] [--score-decimals 0] [--seed 1]\n";
+      std::exit(0);
+    } else {
+      throw std::runtime_error("Unknown argument: " + arg);
+    }
+  }
+  if (opts.outputPath.empty()) {
+    throw std::runtime_error("Missing required --output contexts.tsv argument.");
+  }
+  if (opts.phrases == 0 || opts.regions == 0 || opts.topics == 0 || opts.vocabulary <= COMMON_WORD_COUNT) {
+    throw std::runtime_error("--phrases, --regions and --topics must be positive and --vocabulary must exceed " +
+                             std::to_string(COMMON_WORD_COUNT) + ".");
+  }
+  if (opts.minTokens == 0 || opts.maxTokens < opts.minTokens) {
+    throw std::runtime_error("--min-tokens must be positive and no larger than --max-tokens.");
+  }
+  if (opts.scoreDecimals > 6) {
+    throw std::runtime_error("--score-decimals must be at most 6.");
+  }
+  return opts;
+}
+
+void generate(const GeneratorOptions &opts, std::ostream &out) {
+  std::mt19937_64 rng(opts.seed);
+
+  // Token rank r is a common word while they last, then a synthetic word.
+  std::vector<std::string> vocabulary(opts.vocabulary);
+  for (std::size_t rank = 0; rank < vocabulary.size(); ++rank) {
+    vocabulary[rank] = rank < COMMON_WORD_COUNT ? COMMON_WORDS[rank] : syntheticWord(rank * 7 + 3);
+  }
+  std::vector<std::string> regions(opts.regions);
+  for (std::size_t r = 0; r < regions.size(); ++r) {
+    regions[r] = r < REGION_NAME_COUNT ? REGION_NAMES[r] : "region" + std::to_string(r);
+  }
+
+  // Phrases are one or two synthetic words (kept apart from the vocabulary by an odd offset) and
+  // belong to one topic each; a topic is a few hundred mid-frequency vocabulary tokens.
+  constexpr std::size_t TOPIC_TOKENS = 200;
+  std::vector<std::string> phrases(opts.phrases);
+  std::vector<std::size_t> phraseTopic(opts.phrases);
+  for (std::size_t p = 0; p < phrases.size(); ++p) {
+    phrases[p] = syntheticWord(p * 7 + 1);
+    if (randomUnit(rng) < 0.3)
+      phrases[p] += " " + syntheticWord(p * 7 + 5);
+    phraseTopic[p] = randomIndex(rng, opts.topics);
+  }
+  const std::size_t topicFloor = std::min(opts.vocabulary - 1, COMMON_WORD_COUNT * 2);
+  std::vector<std::size_t> topicTokens(opts.topics * TOPIC_TOKENS);
+  for (auto &token : topicTokens) {
+    token = topicFloor + randomIndex(rng, opts.vocabulary - topicFloor);
+  }
+
+  ZipfSampler tokenRank(opts.vocabulary, opts.tokenSkew);
+  ZipfSampler topicRank(TOPIC_TOKENS, 1.0);
+  ZipfSampler phraseRank(opts.phrases, opts.phraseSkew);
+  ZipfSampler regionRank(opts.regions, opts.regionSkew);
+
+  std::string buffer = "phrase\tplatform\tregionHint\tscore\tcontext\n";
+  for (std::uint64_t row = 0; row < opts.rows; ++row) {
+    const std::size_t phrase = phraseRank(rng);
+    buffer += phrases[phrase];
+    buffer += '\t';
+
+    double pick = randomUnit(rng);
+    std::size_t platform = 0;
+    while (platform + 1 < sizeof(PLATFORMS) / sizeof(PLATFORMS[0]) && pick >= PLATFORM_WEIGHTS[platform]) {
+      pick -= PLATFORM_WEIGHTS[platform];
+      ++platform;
+    }
+    buffer += PLATFORMS[platform];
+    buffer += '\t';
+
+    if (randomUnit(rng) >= 0.1)
+      buffer += regions[regionRank(rng)];
+    buffer += '\t';
+
+    if (randomUnit(rng) >= 0.2) {
+      buffer += std::to_string(static_cast<std::uint64_t>(std::exp(randomUnit(rng) * 8.0)));
+      if (opts.scoreDecimals > 0) {
+        // Drawn only when asked for, so whole-number corpora stay as they were.
+        const auto scale = static_cast<std::size_t>(std::pow(10.0, static_cast<double>(opts.scoreDecimals)));
+        const std::string digits = std::to_string(randomIndex(rng, scale));
+        buffer += '.';
+        buffer.append(opts.scoreDecimals - digits.size(), '0');
+        buffer += digits;
+      }
+    }
+    buffer += '\t';
+
+    const std::size_t length = opts.minTokens + randomIndex(rng, opts.maxTokens - opts.minTokens + 1);
+    const std::size_t phraseAt = randomIndex(rng, length);
+    for (std::size_t t = 0; t < length; ++t) {
+      if (t > 0)
+        buffer += ' ';
+      if (t == phraseAt) {
+        buffer += phrases[phrase];
+      } else if (randomUnit(rng) < opts.topicShare) {
+        buffer += vocabulary[topicTokens[phraseTopic[phrase] * TOPIC_TOKENS + topicRank(rng)]];
+      } else {
+        const std::string &word = vocabulary[tokenRank(rng)];
+        if (t == 0 && randomUnit(rng) < 0.5) {
+          buffer += static_cast<char>(std::toupper(static_cast<unsigned char>(word[0])));
+          buffer.append(word, 1, std::string::npos);
+        } else {
+          buffer += word;
+        }
+      }
+    }
+    if (randomUnit(rng) < 0.25)
+      buffer += randomUnit(rng) < 0.5 ? "!" : "?";
+    buffer += '\n';
+
+    if (buffer.size() >= (1u << 20)) {
+      out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+      buffer.clear();
+    }
+  }
+  out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  try {
+    GeneratorOptions options = parseOptions(argc, argv);
+    std::ofstream out(options.outputPath, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      throw std::runtime_error("Failed to open output file: " + options.outputPath);
+    }
+    generate(options, out);
+    out.close();
+    if (!out) {
+      throw std::runtime_error("Failed to write output file: " + options.outputPath);
+    }
+    std::cout << "Wrote " << options.rows << " rows to " << options.outputPath << "\n";
+  } catch (const std::exception &ex) {
+    std::cerr << "Error: " << ex.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,625 @@
+// Multi-pattern slang detector. The seed dictionary (and, optionally, the phrases of a trained state)
+// are compiled into one Aho-Corasick automaton, so each message is matched in a single pass whatever
+// the dictionary size. Results follow detectSlang in backend/src/lib/detect.js:
+//  - a variant matches case-insensitively where it is not preceded or followed by a word character;
+//  - an entry without variants matches on its phrase;
+//  - one entry per phrase, preferring one listed for the requested region;
+//  - a phrase is dropped when a longer detected phrase containing it also appears in the message.
+// Trained phrases follow the last two rules among themselves only, so they never drop a dictionary hit.
+// Case folding is ASCII-only (detect.js folds all of Unicode), and non-ASCII bytes are non-word
+// characters, as they are for \W.
+//
+// Batch mode reads one message per line (--input, default stdin) and writes one JSON array per line
+// (--output, default stdout). --serve answers "region<TAB>message" lines on stdin as they arrive; this
+// is how backend/src/lib/nativeDetect.js drives it.
+#include "slang_core.h"
+
+#include <array>
+#include <cctype>
+#include <csignal>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace slang;
+
+namespace {
+
+struct DetectOptions {
+  std::string dictionaryPath;
+  std::string stateInputPath;
+  std::uint64_t minCount = 2;
+  std::string inputPath;
+  std::string outputPath;
+  std::string region;
+  bool serve = false;
+};
+
+struct SlangEntry {
+  std::string phrase; // as written in the dictionary or the trained state
+  std::string key;    // lower-cased phrase, for de-duplication and subsumption
+  std::vector<std::string> regions;
+  std::uint64_t count = 0; // trained phrases only
+  bool trained = false;
+};
+
+bool isWordByte(unsigned char ch) { return std::isalnum(ch) || ch == '_'; }
+
+std::string asciiLower(std::string_view text) {
+  std::string lower(text);
+  for (char &ch : lower) {
+    if (ch >= 'A' && ch <= 'Z')
+      ch = static_cast<char>(ch - 'A' + 'a');
+  }
+  return lower;
+}
+
+// Just enough JSON to read the seed dictionary: an array of objects whose "phrase" is a string and whose
+// "variants" and "regions" are arrays of strings. Every other value is skipped.
+struct JsonCursor {
+  std::string_view text;
+  std::size_t pos = 0;
+
+  [[noreturn]] void fail(const char *what) const {
+    throw std::runtime_error(std::string("Malformed dictionary JSON (") + what + ") at byte " + std::to_string(pos));
+  }
+
+  char peek() {
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+      ++pos;
+    return pos < text.size() ? text[pos] : '\0';
+  }
+
+  void expect(char ch) {
+    if (peek() != ch)
+      fail("unexpected character");
+    ++pos;
+  }
+
+  // Consumes `ch` if it is next; used for the separators of arrays and objects.
+  bool accept(char ch) {
+    if (peek() != ch)
+      return false;
+    ++pos;
+    return true;
+  }
+
+  static void appendUtf8(std::string &out, std::uint32_t code) {
+    if (code < 0x80) {
+      out.push_back(static_cast<char>(code));
+    } else if (code < 0x800) {
+      out.push_back(static_cast<char>(0xC0 | (code >> 6)));
+      out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else if (code < 0x10000) {
+      out.push_back(static_cast<char>(0xE0 | (code >> 12)));
+      out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else {
+      out.push_back(static_cast<char>(0xF0 | (code >> 18)));
+      out.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+  }
+
+  std::uint32_t hex4() {
+    std::uint32_t value = 0;
+    if (pos + 4 > text.size() ||
+        std::from_chars(text.data() + pos, text.data() + pos + 4, value, 16).ptr != text.data() + pos + 4)
+      fail("bad \\u escape");
+    pos += 4;
+    return value;
+  }
+
+  std::string string() {
+    expect('"');
+    std::string out;
+    while (pos < text.size() && text[pos] != '"') {
+      char ch = text[pos++];
+      if (ch != '\\') {
+        out.push_back(ch);
+        continue;
+      }
+      if (pos >= text.size())
+        break;
+      char escape = text[pos++];
+      switch (escape) {
+      case 'b': out.push_back('\b'); break;
+      case 'f': out.push_back('\f'); break;
+      case 'n': out.push_back('\n'); break;
+      case 'r': out.push_back('\r'); break;
+      case 't': out.push_back('\t'); break;
+      case 'u': {
+        std::uint32_t code = hex4();
+        if (code >= 0xD800 && code < 0xDC00 && text.substr(pos, 2) == "\\u") {
+          pos += 2;
+          std::uint32_t low = hex4();
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        }
+        appendUtf8(out, code);
+        break;
+      }
+      default: out.push_back(escape); break;
+      }
+    }
+    expect('"');
+    return out;
+  }
+
+  void skipValue() {
+    char ch = peek();
+    if (ch == '"') {
+      string();
+    } else if (ch == '[' || ch == '{') {
+      const char close = ch == '[' ? ']' : '}';
+      ++pos;
+      if (accept(close))
+        return;
+      do {
+        if (close == '}') {
+          string();
+          expect(':');
+        }
+        skipValue();
+      } while (accept(','));
+      expect(close);
+    } else {
+      std::size_t start = pos;
+      while (pos < text.size() && (std::isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '-' ||
+                                   text[pos] == '+' || text[pos] == '.'))
+        ++pos;
+      if (pos == start)
+        fail("expected a value");
+    }
+  }
+
+  // Strings of an array; non-string items are skipped.
+  std::vector<std::string> stringArray() {
+    std::vector<std::string> values;
+    if (peek() != '[') {
+      skipValue();
+      return values;
+    }
+    ++pos;
+    if (accept(']'))
+      return values;
+    do {
+      if (peek() == '"')
+        values.push_back(string());
+      else
+        skipValue();
+    } while (accept(','));
+    expect(']');
+    return values;
+  }
+};
+
+std::string readFile(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Failed to open file: " + path);
+  }
+  std::ostringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+// Appends the dictionary's entries to `entries` and the lower-cased variants each one matches on to
+// `patterns`, index for index.
+void loadDictionary(const std::string &path, std::vector<SlangEntry> &entries,
+                    std::vector<std::vector<std::string>> &patterns) {
+  const std::string json = readFile(path);
+  JsonCursor cursor{json};
+  cursor.expect('[');
+  if (cursor.accept(']'))
+    return;
+  do {
+    SlangEntry entry;
+    std::vector<std::string> variants;
+    if (cursor.peek() != '{') {
+      cursor.skipValue();
+      continue;
+    }
+    ++cursor.pos;
+    if (!cursor.accept('}')) {
+      do {
+        std::string field = cursor.string();
+        cursor.expect(':');
+        if (field == "phrase" && cursor.peek() == '"') {
+          entry.phrase = cursor.string();
+        } else if (field == "variants") {
+          variants = cursor.stringArray();
+        } else if (field == "regions") {
+          entry.regions = cursor.stringArray();
+        } else {
+          cursor.skipValue();
+        }
+      } while (cursor.accept(','));
+      cursor.expect('}');
+    }
+    if (variants.empty())
+      variants.push_back(entry.phrase);
+    std::vector<std::string> lowered;
+    for (const auto &variant : variants) {
+      if (!variant.empty())
+        lowered.push_back(asciiLower(variant));
+    }
+    entry.key = asciiLower(entry.phrase);
+    entries.push_back(std::move(entry));
+    patterns.push_back(std::move(lowered));
+  } while (cursor.accept(','));
+  cursor.expect(']');
+}
+
+// Adds the phrases of a trained state seen at least `minCount` times, except those the dictionary
+// already matches on.
+void loadTrainedPhrases(const std::string &path, std::uint64_t minCount, std::vector<SlangEntry> &entries,
+                        std::vector<std::vector<std::string>> &patterns) {
+  CorpusStats corpus;
+  if (!loadState(path, corpus)) {
+    throw std::runtime_error("Failed to open state file: " + path);
+  }
+  std::unordered_set<std::string> known;
+  for (std::size_t e = 0; e < entries.size(); ++e) {
+    known.insert(entries[e].key);
+    known.insert(patterns[e].begin(), patterns[e].end());
+  }
+  for (std::uint32_t phraseId : sortedPhraseIds(corpus)) {
+    const PhraseStats &stat = corpus.stats[phraseId];
+    std::string key = asciiLower(corpus.phrases.str(phraseId));
+    if (stat.count < minCount || key.empty() || !known.insert(key).second)
+      continue;
+    SlangEntry entry;
+    entry.phrase = corpus.phrases.str(phraseId);
+    entry.key = key;
+    entry.count = stat.count;
+    entry.trained = true;
+    entries.push_back(std::move(entry));
+    patterns.push_back({std::move(key)});
+  }
+}
+
+// Aho-Corasick automaton over byte strings. States are numbered breadth-first and their children are
+// stored in CSR form, sorted by byte; the root keeps a full transition table since every mismatch
+// ends up there.
+struct PhraseAutomaton {
+  std::vector<std::uint32_t> childStart; // children of s: edges [childStart[s], childStart[s + 1])
+  std::vector<std::uint8_t> edgeBytes;
+  std::vector<std::uint32_t> edgeTargets;
+  std::array<std::uint32_t, 256> rootNext{}; // 0 (the root itself) where the root has no child
+  std::vector<std::uint32_t> fail;
+  std::vector<std::uint32_t> outputLink; // nearest state along the fail links that ends a pattern
+  std::vector<std::uint32_t> patternAt;  // pattern ending at each state, or NO_ID
+  std::vector<std::uint32_t> patternLength;
+  std::vector<std::uint32_t> ownerStart; // entries matching on pattern p: owners [ownerStart[p], ownerStart[p + 1])
+  std::vector<std::uint32_t> owners;
+
+  std::size_t stateCount() const { return fail.size(); }
+
+  std::uint32_t child(std::uint32_t state, std::uint8_t byte) const {
+    auto begin = edgeBytes.begin() + childStart[state];
+    auto end = edgeBytes.begin() + childStart[state + 1];
+    auto it = std::lower_bound(begin, end, byte);
+    return it != end && *it == byte ? edgeTargets[static_cast<std::size_t>(it - edgeBytes.begin())] : NO_ID;
+  }
+
+  std::uint32_t step(std::uint32_t state, std::uint8_t byte) const {
+    while (state != 0) {
+      std::uint32_t next = child(state, byte);
+      if (next != NO_ID)
+        return next;
+      state = fail[state];
+    }
+    return rootNext[byte];
+  }
+
+  // Calls fn(pattern, begin, end) for every occurrence of every pattern in `text`.
+  template <typename Fn> void forEachMatch(std::string_view text, Fn fn) const {
+    std::uint32_t state = 0;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+      state = step(state, static_cast<std::uint8_t>(text[i]));
+      std::uint32_t match = patternAt[state] != NO_ID ? state : outputLink[state];
+      for (; match != NO_ID; match = outputLink[match]) {
+        const std::uint32_t pattern = patternAt[match];
+        fn(pattern, i + 1 - patternLength[pattern], i + 1);
+      }
+    }
+  }
+};
+
+PhraseAutomaton buildAutomaton(const std::vector<std::vector<std::string>> &patterns) {
+  // Distinct patterns and the entries matching on each.
+  std::unordered_map<std::string_view, std::uint32_t> patternIds;
+  std::vector<std::string_view> patternText;
+  std::vector<std::vector<std::uint32_t>> patternOwners;
+  for (std::uint32_t e = 0; e < patterns.size(); ++e) {
+    for (const auto &pattern : patterns[e]) {
+      auto inserted = patternIds.emplace(pattern, static_cast<std::uint32_t>(patternText.size()));
+      if (inserted.second) {
+        patternText.push_back(pattern);
+        patternOwners.emplace_back();
+      }
+      auto &owners = patternOwners[inserted.first->second];
+      if (owners.empty() || owners.back() != e)
+        owners.push_back(e);
+    }
+  }
+
+  // Plain trie first, then renumbered breadth-first into the CSR arrays.
+  std::vector<std::vector<std::pair<std::uint8_t, std::uint32_t>>> trie(1);
+  std::vector<std::uint32_t> terminal(1, NO_ID);
+  for (std::uint32_t p = 0; p < patternText.size(); ++p) {
+    std::uint32_t state = 0;
+    for (char ch : patternText[p]) {
+      const auto byte = static_cast<std::uint8_t>(ch);
+      auto &children = trie[state];
+      auto it = std::find_if(children.begin(), children.end(), [&](const auto &edge) { return edge.first == byte; });
+      if (it != children.end()) {
+        state = it->second;
+        continue;
+      }
+      const auto next = static_cast<std::uint32_t>(trie.size());
+      children.push_back({byte, next});
+      trie.emplace_back();
+      terminal.push_back(NO_ID);
+      state = next;
+    }
+    terminal[state] = p;
+  }
+
+  PhraseAutomaton automaton;
+  const std::size_t states = trie.size();
+  std::vector<std::uint32_t> order{0}; // old ids in breadth-first order
+  std::vector<std::uint32_t> renumbered(states, 0);
+  order.reserve(states);
+  for (std::size_t head = 0; head < order.size(); ++head) {
+    auto &children = trie[order[head]];
+    std::sort(children.begin(), children.end());
+    for (const auto &edge : children) {
+      renumbered[edge.second] = static_cast<std::uint32_t>(order.size());
+      order.push_back(edge.second);
+    }
+  }
+  automaton.childStart.assign(states + 1, 0);
+  automaton.patternAt.assign(states, NO_ID);
+  automaton.edgeBytes.reserve(states - 1);
+  automaton.edgeTargets.reserve(states - 1);
+  for (std::size_t s = 0; s < states; ++s) {
+    for (const auto &edge : trie[order[s]]) {
+      automaton.edgeBytes.push_back(edge.first);
+      automaton.edgeTargets.push_back(renumbered[edge.second]);
+    }
+    automaton.childStart[s + 1] = static_cast<std::uint32_t>(automaton.edgeBytes.size());
+    automaton.patternAt[s] = terminal[order[s]];
+  }
+  for (std::uint32_t e = automaton.childStart[0]; e < automaton.childStart[1]; ++e) {
+    automaton.rootNext[automaton.edgeBytes[e]] = automaton.edgeTargets[e];
+  }
+
+  // Fail links in breadth-first order, so a state's fail target is always finished before it.
+  automaton.fail.assign(states, 0);
+  automaton.outputLink.assign(states, NO_ID);
+  for (std::uint32_t s = 0; s < states; ++s) {
+    for (std::uint32_t e = automaton.childStart[s]; e < automaton.childStart[s + 1]; ++e) {
+      const std::uint32_t target = automaton.edgeTargets[e];
+      const std::uint32_t fail = s == 0 ? 0 : automaton.step(automaton.fail[s], automaton.edgeBytes[e]);
+      automaton.fail[target] = fail;
+      automaton.outputLink[target] = automaton.patternAt[fail] != NO_ID ? fail : automaton.outputLink[fail];
+    }
+  }
+
+  automaton.patternLength.resize(patternText.size());
+  automaton.ownerStart.assign(patternText.size() + 1, 0);
+  for (std::uint32_t p = 0; p < patternText.size(); ++p) {
+    automaton.patternLength[p] = static_cast<std::uint32_t>(patternText[p].size());
+    automaton.owners.insert(automaton.owners.end(), patternOwners[p].begin(), patternOwners[p].end());
+    automaton.ownerStart[p + 1] = static_cast<std::uint32_t>(automaton.owners.size());
+  }
+  return automaton;
+}
+
+struct Detector {
+  std::vector<SlangEntry> entries;
+  PhraseAutomaton automaton;
+};
+
+// Per-caller buffers, so detection allocates nothing once warmed up.
+struct DetectScratch {
+  std::string lower;
+  std::vector<std::uint32_t> seenEpoch;
+  std::uint32_t epoch = 0;
+  std::vector<std::uint32_t> hits;
+  std::vector<std::uint32_t> kept;
+};
+
+bool prefersRegion(const SlangEntry &entry, std::string_view region) {
+  return !region.empty() && std::find(entry.regions.begin(), entry.regions.end(), region) != entry.regions.end();
+}
+
+// Entry ids detected in `message`, in the order detectSlang would report them.
+const std::vector<std::uint32_t> &detect(const Detector &detector, std::string_view message, std::string_view region,
+                                         DetectScratch &scratch) {
+  scratch.lower.assign(message);
+  for (char &ch : scratch.lower) {
+    if (ch >= 'A' && ch <= 'Z')
+      ch = static_cast<char>(ch - 'A' + 'a');
+  }
+  const std::string_view lower = scratch.lower;
+  if (scratch.seenEpoch.size() != detector.entries.size())
+    scratch.seenEpoch.assign(detector.entries.size(), 0);
+  if (++scratch.epoch == 0) {
+    std::fill(scratch.seenEpoch.begin(), scratch.seenEpoch.end(), 0);
+    scratch.epoch = 1;
+  }
+
+  scratch.hits.clear();
+  const PhraseAutomaton &automaton = detector.automaton;
+  automaton.forEachMatch(lower, [&](std::uint32_t pattern, std::size_t begin, std::size_t end) {
+    if ((begin > 0 && isWordByte(static_cast<unsigned char>(lower[begin - 1]))) ||
+        (end < lower.size() && isWordByte(static_cast<unsigned char>(lower[end]))))
+      return;
+    for (std::uint32_t o = automaton.ownerStart[pattern]; o < automaton.ownerStart[pattern + 1]; ++o) {
+      const std::uint32_t entry = automaton.owners[o];
+      if (scratch.seenEpoch[entry] != scratch.epoch) {
+        scratch.seenEpoch[entry] = scratch.epoch;
+        scratch.hits.push_back(entry);
+      }
+    }
+  });
+  std::sort(scratch.hits.begin(), scratch.hits.end());
+
+  // Dictionary entries and trained phrases are de-duplicated and subsumed each among their own kind,
+  // so the dictionary hits are exactly detectSlang's whatever the trained state holds.
+  auto sameKind = [&](std::uint32_t a, std::uint32_t b) {
+    return detector.entries[a].trained == detector.entries[b].trained;
+  };
+
+  // One entry per phrase, in first-seen order, switching to a later one that prefers the region.
+  scratch.kept.clear();
+  for (std::uint32_t entry : scratch.hits) {
+    const SlangEntry &candidate = detector.entries[entry];
+    auto it = std::find_if(scratch.kept.begin(), scratch.kept.end(), [&](std::uint32_t kept) {
+      return sameKind(kept, entry) && detector.entries[kept].key == candidate.key;
+    });
+    if (it == scratch.kept.end()) {
+      scratch.kept.push_back(entry);
+    } else if (!prefersRegion(detector.entries[*it], region) && prefersRegion(candidate, region)) {
+      *it = entry;
+    }
+  }
+
+  // Drop a phrase when a longer detected phrase containing it also appears in the message.
+  scratch.hits.clear();
+  for (std::uint32_t entry : scratch.kept) {
+    const std::string &key = detector.entries[entry].key;
+    bool subsumed = std::any_of(scratch.kept.begin(), scratch.kept.end(), [&](std::uint32_t other) {
+      const std::string &longer = detector.entries[other].key;
+      return sameKind(entry, other) && longer != key && longer.find(key) != std::string::npos && lower.find(longer) != std::string_view::npos;
+    });
+    if (!subsumed)
+      scratch.hits.push_back(entry);
+  }
+  return scratch.hits;
+}
+
+// One JSON array per message: {"entry": i, "phrase": ...} for dictionary entry i, {"phrase": ...,
+// "count": n} for a trained phrase.
+void appendMatches(OutputBuffer &out, const Detector &detector, const std::vector<std::uint32_t> &found) {
+  out.raw("[");
+  for (std::size_t i = 0; i < found.size(); ++i) {
+    const SlangEntry &entry = detector.entries[found[i]];
+    out.raw(i > 0 ? ", {" : "{");
+    if (!entry.trained)
+      out.raw("\"entry\": ").integer(found[i]).raw(", ");
+    out.raw("\"phrase\": \"").escaped(entry.phrase).raw("\"");
+    if (entry.trained)
+      out.raw(", \"count\": ").integer(entry.count);
+    out.raw("}");
+  }
+  out.raw("]\n");
+}
+
+DetectOptions parseDetectOptions(int argc, char **argv) {
+  DetectOptions opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--dictionary" && i + 1 < argc) {
+      opts.dictionaryPath = argv[++i];
+    } else if (arg == "--state-in" && i + 1 < argc) {
+      opts.stateInputPath = argv[++i];
+    } else if (arg == "--min-count" && i + 1 < argc) {
+      opts.minCount = static_cast<std::uint64_t>(std::stoull(argv[++i]));
+    } else if (arg == "--input" && i + 1 < argc) {
+      opts.inputPath = argv[++i];
+    } else if (arg == "--output" && i + 1 < argc) {
+      opts.outputPath = argv[++i];
+    } else if (arg == "--region" && i + 1 < argc) {
+      opts.region = argv[++i];
+    } else if (arg == "--serve") {
+      opts.serve = true;
+    } else if (arg == "--help" || arg == "-h") {
+      std::cout << "Usage: slang_detect --dictionary slang.seed.json [--state-in stats.dat] [--min-count 2] "
+                   "[--input messages.txt] [--output matches.jsonl] [--region toronto]\n"
+                   "       slang_detect --serve --dictionary slang.seed.json [--state-in stats.dat]\n";
+      std::exit(0);
+    } else {
+      throw std::runtime_error("Unknown argument: " + arg);
+    }
+  }
+  if (opts.dictionaryPath.empty() && opts.stateInputPath.empty()) {
+    throw std::runtime_error("Pass --dictionary slang.seed.json and/or --state-in stats.dat.");
+  }
+  return opts;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  try {
+    DetectOptions options = parseDetectOptions(argc, argv);
+    Detector detector;
+    std::vector<std::vector<std::string>> patterns;
+    if (!options.dictionaryPath.empty())
+      loadDictionary(options.dictionaryPath, detector.entries, patterns);
+    if (!options.stateInputPath.empty())
+      loadTrainedPhrases(options.stateInputPath, options.minCount, detector.entries, patterns);
+    detector.automaton = buildAutomaton(patterns);
+    std::cerr << "Compiled " << detector.entries.size() << " entries into " << detector.automaton.stateCount()
+              << " automaton states\n";
+
+    DetectScratch scratch;
+    if (options.serve) {
+      std::signal(SIGPIPE, SIG_IGN);
+      serveLines(STDIN_FILENO, STDOUT_FILENO, [&](std::string_view line, std::string &reply) {
+        if (!line.empty() && line.back() == '\r')
+          line.remove_suffix(1);
+        std::size_t tab = line.find('\t');
+        std::string_view region = tab == std::string_view::npos ? std::string_view() : line.substr(0, tab);
+        std::string_view message = tab == std::string_view::npos ? line : line.substr(tab + 1);
+        OutputBuffer out;
+        appendMatches(out, detector, detect(detector, message, region, scratch));
+        out.data.pop_back(); // serveLines adds the newline
+        reply = std::move(out.data);
+        return DaemonAction::Continue;
+      });
+      return 0;
+    }
+
+    std::ifstream file;
+    if (!options.inputPath.empty()) {
+      file.open(options.inputPath, std::ios::binary);
+      if (!file) {
+        throw std::runtime_error("Failed to open input file: " + options.inputPath);
+      }
+    }
+    std::istream &in = options.inputPath.empty() ? std::cin : file;
+    std::ofstream outFile;
+    if (!options.outputPath.empty()) {
+      outFile.open(options.outputPath, std::ios::binary | std::ios::trunc);
+      if (!outFile) {
+        throw std::runtime_error("Failed to open output file: " + options.outputPath);
+      }
+    }
+    std::ostream &out = options.outputPath.empty() ? std::cout : outFile;
+
+    OutputBuffer buffer;
+    std::string line;
+    while (std::getline(in, line)) {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      appendMatches(buffer, detector, detect(detector, line, options.region, scratch));
+      if (buffer.data.size() >= (1u << 20))
+        buffer.flushTo(out);
+    }
+    buffer.flushTo(out);
+    out.flush();
+    if (!out) {
+      throw std::runtime_error("Failed to write matches");
+    }
+  } catch (const std::exception &ex) {
+    std::cerr << "Error: " << ex.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,20 @@
+# Sends each argument after the socket path as one command line to a slang_trainer query socket and
+# prints the reply lines, waiting up to 10 s for the server to start listening.
+import socket
+import sys
+import time
+
+sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+for attempt in range(200):
+    try:
+        sock.connect(sys.argv[1])
+        break
+    except OSError:
+        time.sleep(0.05)
+else:
+    sys.exit("No query server on " + sys.argv[1])
+server = sock.makefile("rw", encoding="utf-8", newline="\n")
+for command in sys.argv[2:]:
+    server.write(command + "\n")
+    server.flush()
+    sys.stdout.write(server.readline())
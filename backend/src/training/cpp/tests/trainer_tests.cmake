@@ -0,0 +1,391 @@
+# One slang_trainer / slang_detect test case, run by ctest as
+#   cmake -DCASE=<name> -DWORK=<dir> -DTRAINER=<path> -DCORPUS_GEN=<path> ... -P trainer_tests.cmake
+# (see CMakeLists.txt). The "corpus" case writes the fixture corpus the other cases read; they run the
+# tools on it and compare what they write byte for byte (model JSON without its "generatedAt").
+
+function(run)
+  execute_process(COMMAND ${ARGN} WORKING_DIRECTORY "${WORK}" RESULT_VARIABLE status OUTPUT_QUIET
+                  ERROR_VARIABLE errors)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "${ARGN} failed (${status}):\n${errors}")
+  endif()
+endfunction()
+
+function(same_files a b)
+  execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${WORK}/${a}" "${WORK}/${b}" RESULT_VARIABLE status)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "${a} and ${b} differ")
+  endif()
+endfunction()
+
+function(same_models a b)
+  file(READ "${WORK}/${a}" left)
+  file(READ "${WORK}/${b}" right)
+  string(REGEX REPLACE "\"generatedAt\": \"[^\"]*\"" "" left "${left}")
+  string(REGEX REPLACE "\"generatedAt\": \"[^\"]*\"" "" right "${right}")
+  if(NOT left STREQUAL right)
+    message(FATAL_ERROR "${a} and ${b} differ")
+  endif()
+endfunction()
+
+# Model options shared by the cases, small enough for the fixture.
+set(MODEL --clusters 6 --embedding-features 24 --related-limit 5)
+
+if(CASE STREQUAL "corpus")
+  file(MAKE_DIRECTORY "${WORK}")
+  # Fractional scores, so cases also see whether score sums depend on the order they are added in.
+  run("${CORPUS_GEN}" --output corpus.tsv --rows 30000 --phrases 800 --vocabulary 6000 --regions 12
+      --score-decimals 3 --seed 7)
+
+elseif(CASE STREQUAL "threads")
+  # Sharded ingest and the parallel model stages must give what one thread gives.
+  foreach(threads 1 4)
+    run("${TRAINER}" --input corpus.tsv ${MODEL} --embedding-neighbors 3 --threads ${threads}
+        --output threads${threads}.json --model-bin threads${threads}.bin --state-out threads${threads}.dat)
+  endforeach()
+  same_models(threads1.json threads4.json)
+  same_files(threads1.bin threads4.bin)
+  same_files(threads1.dat threads4.dat)
+
+elseif(CASE STREQUAL "state")
+  # A v2 state re-saves byte for byte, and a v1 text state (in ingest order) or a v2 one converted to
+  # v1 and back loads to the same v2 file.
+  run("${TRAINER}" --input corpus.tsv --state-only --state-out state.dat)
+  run("${TRAINER}" --state-in state.dat --state-only --state-out state.resaved.dat)
+  same_files(state.dat state.resaved.dat)
+  run("${TRAINER}" --input corpus.tsv --state-only --state-format v1 --state-out state.v1.txt)
+  run("${TRAINER}" --state-in state.v1.txt --state-only --state-out state.from_v1.dat)
+  same_files(state.dat state.from_v1.dat)
+  run("${TRAINER}" --state-in state.dat --state-only --state-format v1 --state-out state.to_v1.txt)
+  run("${TRAINER}" --state-in state.to_v1.txt --state-only --state-out state.round_trip.dat)
+  same_files(state.dat state.round_trip.dat)
+
+elseif(CASE STREQUAL "detect")
+  # slang_detect on a fixed dictionary and messages, with and without a region and trained phrases. A
+  # trained phrase containing a dictionary phrase ("no cap fr") must not drop the dictionary hit.
+  file(WRITE "${WORK}/detect.dictionary.json" [=[
+[{"id": "1", "phrase": "no cap", "variants": ["no cap", "nocap"], "regions": ["us"]},
+ {"id": "2", "phrase": "cap", "variants": ["cap"], "regions": ["us"]},
+ {"id": "3", "phrase": "wagwan", "variants": ["wagwan", "wagwaan"], "regions": ["toronto", "uk"]},
+ {"id": "4", "phrase": "wagwan", "variants": ["wagwan"], "regions": ["jamaica"]},
+ {"id": "5", "phrase": "mandem", "regions": ["toronto"]}]
+]=])
+  file(WRITE "${WORK}/detect.messages.txt" "that fit is fire no cap\nWagwan mandem, you good?\ncapital letters only\n"
+       "nocap, the ting was peak\n\nthat was no cap fr\n")
+  file(WRITE "${WORK}/detect.tsv" "phrase\tplatform\tregionHint\tscore\tcontext\n"
+       "the ting\tx\ttoronto\t1\tmandem said the ting was peak\n"
+       "the ting\tx\ttoronto\t2\tthe ting again\n"
+       "rare one\tx\tus\t1\tonly once\n"
+       "no cap fr\tx\tus\t1\tthat was no cap fr\n"
+       "no cap fr\tx\tus\t1\tno cap fr fr\n")
+  run("${TRAINER}" --input detect.tsv --state-only --state-out detect.dat)
+  set(dictionary --dictionary detect.dictionary.json --input detect.messages.txt)
+  run("${DETECT}" ${dictionary} --output detected.default.jsonl)
+  run("${DETECT}" ${dictionary} --region jamaica --output detected.jamaica.jsonl)
+  run("${DETECT}" ${dictionary} --state-in detect.dat --output detected.trained.jsonl)
+  set(no_cap "[{\"entry\": 0, \"phrase\": \"no cap\"}]")
+  set(wagwan "[{\"entry\": 2, \"phrase\": \"wagwan\"}, {\"entry\": 4, \"phrase\": \"mandem\"}]")
+  set(expected_default "${no_cap}\n${wagwan}\n[]\n${no_cap}\n[]\n${no_cap}\n")
+  set(expected_jamaica
+      "${no_cap}\n[{\"entry\": 3, \"phrase\": \"wagwan\"}, {\"entry\": 4, \"phrase\": \"mandem\"}]\n[]\n${no_cap}\n[]\n"
+      "${no_cap}\n")
+  set(expected_trained "${no_cap}\n${wagwan}\n[]\n"
+      "[{\"entry\": 0, \"phrase\": \"no cap\"}, {\"phrase\": \"the ting\", \"count\": 2}]\n[]\n"
+      "[{\"entry\": 0, \"phrase\": \"no cap\"}, {\"phrase\": \"no cap fr\", \"count\": 2}]\n")
+  foreach(run default jamaica trained)
+    string(CONCAT expected ${expected_${run}})
+    file(READ "${WORK}/detected.${run}.jsonl" detected)
+    if(NOT detected STREQUAL expected)
+      message(FATAL_ERROR "Unexpected ${run} detections:\n${detected}")
+    endif()
+  endforeach()
+
+elseif(CASE STREQUAL "compressed")
+  # A gzip copy is streamed in windows and a plain file is mapped whole (or in --memory-budget
+  # windows); both must give the same model and state. 1 MB windows make several of them.
+  execute_process(COMMAND "${GZIP}" -c corpus.tsv WORKING_DIRECTORY "${WORK}" OUTPUT_FILE "${WORK}/corpus.tsv.gz"
+                  RESULT_VARIABLE status)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "gzip failed (${status})")
+  endif()
+  foreach(input corpus.tsv corpus.tsv.gz)
+    run("${TRAINER}" --input ${input} ${MODEL} --threads 4 --output ${input}.json --state-out ${input}.dat)
+    run("${TRAINER}" --input ${input} ${MODEL} --threads 4 --memory-budget 2 --output ${input}.budget.json
+        --state-out ${input}.budget.dat)
+  endforeach()
+  same_models(corpus.tsv.json corpus.tsv.gz.json)
+  same_files(corpus.tsv.dat corpus.tsv.gz.dat)
+  same_models(corpus.tsv.budget.json corpus.tsv.gz.budget.json)
+  same_files(corpus.tsv.budget.dat corpus.tsv.gz.budget.dat)
+
+elseif(CASE STREQUAL "merge")
+  # Shards ingested on their own and merged must re-save to the state of one ingest of them all.
+  set(all "")
+  foreach(shard 1 2 3)
+    run("${CORPUS_GEN}" --output shard${shard}.tsv --rows 8000 --phrases 600 --vocabulary 5000 --regions 10
+        --score-decimals 3 --seed 1${shard})
+    run("${TRAINER}" --input shard${shard}.tsv --state-only --state-out shard${shard}.dat)
+    file(READ "${WORK}/shard${shard}.tsv" rows)
+    if(shard GREATER 1)
+      string(FIND "${rows}" "\n" header)
+      math(EXPR header "${header} + 1")
+      string(SUBSTRING "${rows}" ${header} -1 rows)
+    endif()
+    string(APPEND all "${rows}")
+  endforeach()
+  file(WRITE "${WORK}/shards.tsv" "${all}")
+  run("${TRAINER}" merge --state-out merged.dat shard1.dat shard2.dat shard3.dat)
+  run("${TRAINER}" --state-in merged.dat --state-only --state-out resaved.dat)
+  run("${TRAINER}" --input shards.tsv --state-only --state-out full.dat)
+  same_files(resaved.dat full.dat)
+  run("${TRAINER}" --state-in merged.dat ${MODEL} --output merged.json)
+  run("${TRAINER}" --input shards.tsv ${MODEL} --output full.json)
+  same_models(merged.json full.json)
+
+elseif(CASE STREQUAL "daemon")
+  # Rows piped into --serve on top of a state, then FLUSH and CHECKPOINT, must write the model and
+  # state of one batch run over the same state and rows.
+  run("${CORPUS_GEN}" --output daemon.tsv --rows 8000 --phrases 600 --vocabulary 5000 --regions 10
+      --score-decimals 3 --seed 21)
+  run("${TRAINER}" --input corpus.tsv --state-only --state-out daemon.base.dat)
+  file(READ "${WORK}/daemon.tsv" rows)
+  file(WRITE "${WORK}/daemon.commands" "${rows}FLUSH daemon.flushed.json\nCHECKPOINT daemon.checkpoint.dat\n")
+  execute_process(COMMAND "${TRAINER}" --serve --state-in daemon.base.dat ${MODEL} WORKING_DIRECTORY "${WORK}"
+                  INPUT_FILE "${WORK}/daemon.commands" OUTPUT_VARIABLE replies RESULT_VARIABLE status
+                  ERROR_VARIABLE errors)
+  if(NOT status EQUAL 0 OR NOT replies STREQUAL "OK flushed daemon.flushed.json\nOK checkpoint daemon.checkpoint.dat\n")
+    message(FATAL_ERROR "slang_trainer --serve failed (${status}):\n${replies}${errors}")
+  endif()
+  run("${TRAINER}" --state-in daemon.base.dat --input daemon.tsv ${MODEL} --output daemon.batch.json
+      --state-out daemon.batch.dat)
+  same_models(daemon.flushed.json daemon.batch.json)
+  same_files(daemon.checkpoint.dat daemon.batch.dat)
+
+elseif(CASE STREQUAL "delta")
+  # Every record of a --delta-only delta must be the phrase's record in the full model of the same
+  # state and rows. A delta is only partial while nothing is evicted; under a --memory-budget that
+  # evicts tokens it covers every phrase.
+  run("${CORPUS_GEN}" --output delta.tsv --rows 500 --phrases 800 --vocabulary 6000 --regions 12
+      --score-decimals 3 --seed 8)
+  run("${TRAINER}" --input corpus.tsv ${MODEL} --output delta.base.json --state-out delta.base.dat)
+  run("${TRAINER}" --state-in delta.base.dat --input delta.tsv ${MODEL} --delta-only --delta-output delta.json)
+  run("${TRAINER}" --state-in delta.base.dat --input delta.tsv ${MODEL} --output delta.full.json)
+  file(READ "${WORK}/delta.json" delta)
+  file(READ "${WORK}/delta.full.json" full)
+  set(record_pattern "    {\n(      [^\n]*\n)+    }")
+  string(REGEX MATCHALL "${record_pattern}" records "${delta}")
+  list(LENGTH records refreshed)
+  string(REGEX MATCHALL "${record_pattern}" phrases "${full}")
+  list(LENGTH phrases emitted)
+  if(refreshed EQUAL 0 OR NOT refreshed LESS emitted OR NOT delta MATCHES "\"delta\": {\"full\": false,")
+    message(FATAL_ERROR "Expected a partial delta, got ${refreshed} of ${emitted} phrases")
+  endif()
+  foreach(record IN LISTS records)
+    string(FIND "${full}" "${record}" found)
+    if(found EQUAL -1)
+      message(FATAL_ERROR "Delta record differs from the full model's:\n${record}")
+    endif()
+  endforeach()
+  run("${TRAINER}" --state-in delta.base.dat --input delta.tsv ${MODEL} --memory-budget 1 --delta-only
+      --delta-output delta.evicted.json)
+  file(READ "${WORK}/delta.evicted.json" evicted)
+  if(NOT evicted MATCHES "\"delta\": {\"full\": true,")
+    message(FATAL_ERROR "Expected a full delta after eviction")
+  endif()
+
+elseif(CASE STREQUAL "large_scores")
+  # Score sums are kept whole past one row's clamp, past int64 score units and through state files:
+  # 3 rows of 9e11 and 12 rows of 1e12 average their own score after ingest, --state-in and merge.
+  set(header "phrase\tplatform\tregionHint\tscore\tcontext\n")
+  string(REPEAT "big\tx\ttokyo\t900000000000\thello world there\n" 3 big)
+  string(REPEAT "cap\tx\ttokyo\t1e12\thello world there\n" 12 cap)
+  file(WRITE "${WORK}/large.big.tsv" "${header}${big}")
+  file(WRITE "${WORK}/large.cap.tsv" "${header}${cap}")
+  foreach(part big cap)
+    run("${TRAINER}" --input large.${part}.tsv --min-count 1 --output large.${part}.json
+        --state-out large.${part}.dat)
+    run("${TRAINER}" --state-in large.${part}.dat --min-count 1 --output large.${part}.reloaded.json)
+  endforeach()
+  run("${TRAINER}" merge --state-out large.merged.dat large.big.dat large.cap.dat)
+  run("${TRAINER}" --state-in large.merged.dat --min-count 1 --output large.merged.json)
+  foreach(model large.big.json large.cap.json large.big.reloaded.json large.cap.reloaded.json large.merged.json)
+    file(READ "${WORK}/${model}" text)
+    string(REGEX MATCHALL "\"avgScore\": [^,]*" scores "${text}")
+    if(NOT scores)
+      message(FATAL_ERROR "No avgScore in ${model}")
+    endif()
+    list(REMOVE_DUPLICATES scores)
+    foreach(score IN LISTS scores)
+      if(NOT score MATCHES "^\"avgScore\": (900000000000|1000000000000)\\.0000$")
+        message(FATAL_ERROR "Unexpected ${score} in ${model}")
+      endif()
+    endforeach()
+  endforeach()
+
+elseif(CASE STREQUAL "per_region")
+  # A --per-region model is the model of the region's rows alone, and regions.tsv lists its context
+  # and emitted phrase counts.
+  run("${TRAINER}" --input corpus.tsv ${MODEL} --output per_region.json --per-region per_region)
+  file(STRINGS "${WORK}/corpus.tsv" rows)
+  list(GET rows 1 first)
+  string(REGEX MATCH "^[^\t]*\t[^\t]*\t([^\t]+)\t" first "${first}")
+  set(region "${CMAKE_MATCH_1}")
+  file(STRINGS "${WORK}/corpus.tsv" rows REGEX "^[^\t]*\t[^\t]*\t${region}\t")
+  list(LENGTH rows contexts)
+  string(REPLACE ";" "\n" rows "${rows}")
+  file(WRITE "${WORK}/per_region.${region}.tsv" "phrase\tplatform\tregionHint\tscore\tcontext\n${rows}\n")
+  run("${TRAINER}" --input per_region.${region}.tsv ${MODEL} --output per_region.${region}.json)
+  same_models(per_region.${region}.json per_region/${region}.json)
+  file(READ "${WORK}/per_region.${region}.json" model)
+  string(REGEX MATCHALL "\n    {\n      \"phrase\": " records "${model}")
+  list(LENGTH records phrases)
+  file(STRINGS "${WORK}/per_region/regions.tsv" listed)
+  list(GET listed 0 header)
+  list(FIND listed "${region}\t${contexts}\t${phrases}\t${region}.json" found)
+  if(NOT header STREQUAL "region\tcontexts\tphrases\tmodel" OR found EQUAL -1)
+    message(FATAL_ERROR "regions.tsv does not list ${region} with ${contexts} contexts and ${phrases} phrases")
+  endif()
+
+elseif(CASE STREQUAL "kmeans")
+  # Mini-batch k-means must not depend on the thread count, and a run warm-started from its state's
+  # centroids, with new rows added, must keep every phrase in its cluster.
+  set(kmeans --kmeans mini-batch --batch-size 256)
+  foreach(threads 1 4)
+    run("${TRAINER}" --input corpus.tsv ${MODEL} ${kmeans} --threads ${threads} --output kmeans${threads}.json
+        --state-out kmeans${threads}.dat)
+  endforeach()
+  same_models(kmeans1.json kmeans4.json)
+  same_files(kmeans1.dat kmeans4.dat)
+  run("${CORPUS_GEN}" --output kmeans.more.tsv --rows 500 --phrases 800 --vocabulary 6000 --regions 12
+      --score-decimals 3 --seed 9)
+  run("${TRAINER}" --state-in kmeans1.dat --input kmeans.more.tsv ${MODEL} ${kmeans} --output kmeans.warm.json)
+  foreach(model kmeans1 kmeans.warm)
+    file(READ "${WORK}/${model}.json" text)
+    string(REGEX REPLACE "\"count\": [^\n]*\n *\"avgScore\": [^\n]*\n *" "" text "${text}")
+    string(REGEX MATCHALL "\"phrase\": \"[^\"]*\",\n *\"cluster\": [0-9]+" ${model} "${text}")
+  endforeach()
+  if(NOT kmeans1)
+    message(FATAL_ERROR "No clustered phrases in kmeans1.json")
+  endif()
+  foreach(assignment IN LISTS kmeans1)
+    list(FIND kmeans.warm "${assignment}" found)
+    if(found EQUAL -1)
+      string(REPLACE "\n" " " assignment "${assignment}")
+      message(FATAL_ERROR "Warm-started run moved ${assignment}")
+    endif()
+  endforeach()
+
+elseif(CASE STREQUAL "embeddings")
+  # Every --embedding-storage and --embedding-projection must not depend on the thread count, and
+  # sparse rows hold the same values as dense ones, so they give the same model.
+  foreach(storage "dense" "int8" "sparse" "projection")
+    if(storage STREQUAL "projection")
+      set(embedding --embedding-projection 8)
+    else()
+      set(embedding --embedding-storage ${storage})
+    endif()
+    foreach(threads 1 4)
+      run("${TRAINER}" --input corpus.tsv ${MODEL} --embedding-neighbors 3 ${embedding} --threads ${threads}
+          --output embeddings.${storage}${threads}.json)
+    endforeach()
+    same_models(embeddings.${storage}1.json embeddings.${storage}4.json)
+  endforeach()
+  same_models(embeddings.dense1.json embeddings.sparse1.json)
+
+elseif(CASE STREQUAL "query")
+  # The query server, started from the state or from the --model-bin file, answers PHRASE with the
+  # phrase's model JSON record on one line and a miss with an error, and SHUTDOWN makes it exit 0.
+  run("${TRAINER}" --input corpus.tsv ${MODEL} --output query.json --model-bin query.bin --state-out query.dat)
+  file(READ "${WORK}/query.json" model)
+  string(REGEX MATCH "    {\n(      [^\n]*\n)+    }" record "${model}")
+  string(REGEX MATCH "\"phrase\": \"([^\"]*)\"" phrase "${record}")
+  set(phrase "${CMAKE_MATCH_1}")
+  string(REGEX REPLACE ",\n *" ", " record "${record}")
+  string(REGEX REPLACE "\n *" "" record "${record}")
+  string(STRIP "${record}" record)
+  foreach(source "--state-in;query.dat;${MODEL}" "--model-in;query.bin")
+    file(REMOVE "${WORK}/query.sock")
+    execute_process(COMMAND "${TRAINER}" --query-socket query.sock ${source}
+                    COMMAND "${PYTHON}" "${CMAKE_CURRENT_LIST_DIR}/query_client.py" query.sock "PHRASE ${phrase}"
+                            "PHRASE no such phrase" SHUTDOWN
+                    WORKING_DIRECTORY "${WORK}" TIMEOUT 60 OUTPUT_VARIABLE replies RESULTS_VARIABLE status
+                    ERROR_VARIABLE errors)
+    set(expected "${record}\n{\"error\": \"unknown phrase\"}\n{\"shutdown\": true}\n")
+    if(NOT status STREQUAL "0;0" OR NOT replies STREQUAL expected)
+      message(FATAL_ERROR "Query server from ${source} failed (${status}):\n${replies}${errors}")
+    endif()
+  endforeach()
+  # An --ann-index file read back with --ann-in answers NEAREST with the neighbours the trainer found
+  # through the same index for the model's embeddingNeighbors.
+  run("${TRAINER}" --input corpus.tsv ${MODEL} --embedding-neighbors 3 --output query.ann.json
+      --model-bin query.ann.bin --ann-index query.ann)
+  file(READ "${WORK}/query.ann.json" model)
+  string(REGEX MATCHALL "    {\n(      [^\n]*\n)+    }" records "${model}")
+  set(neighbors "")
+  foreach(record IN LISTS records)
+    if(record MATCHES "\"embeddingNeighbors\": (\\[{[^\n]*\\])")
+      set(neighbors "${CMAKE_MATCH_1}")
+      string(REGEX MATCH "\"phrase\": \"([^\"]*)\"" phrase "${record}")
+      set(phrase "${CMAKE_MATCH_1}")
+      break()
+    endif()
+  endforeach()
+  if(neighbors STREQUAL "")
+    message(FATAL_ERROR "No phrase with embedding neighbours in query.ann.json")
+  endif()
+  file(REMOVE "${WORK}/query.sock")
+  execute_process(COMMAND "${TRAINER}" --query-socket query.sock --model-in query.ann.bin --ann-in query.ann
+                  COMMAND "${PYTHON}" "${CMAKE_CURRENT_LIST_DIR}/query_client.py" query.sock "NEAREST ${phrase} 3"
+                          SHUTDOWN
+                  WORKING_DIRECTORY "${WORK}" TIMEOUT 60 OUTPUT_VARIABLE replies RESULTS_VARIABLE status
+                  ERROR_VARIABLE errors)
+  set(expected "{\"phrase\": \"${phrase}\", \"embeddingNeighbors\": ${neighbors}}\n{\"shutdown\": true}\n")
+  if(NOT status STREQUAL "0;0" OR NOT replies STREQUAL expected)
+    message(FATAL_ERROR "Query server with --ann-in failed (${status}):\n${replies}${errors}")
+  endif()
+
+elseif(CASE STREQUAL "context_tokens")
+  # The three-letter minimum for context tokens counts code points; lone Han characters count, lone
+  # kana and two-letter words in any script do not.
+  set(row "yabai\tx\ttokyo\t1\tこれはやばいですね 本当 ゲーム да ok 친구 hello\n")
+  file(WRITE "${WORK}/scripts.tsv" "phrase\tplatform\tregionHint\tscore\tcontext\n${row}${row}")
+  run("${TRAINER}" --input scripts.tsv --min-count 1 --output scripts.json)
+  file(READ "${WORK}/scripts.json" model)
+  string(REGEX MATCHALL "\"token\": \"[^\"]*\"" tokens "${model}")
+  string(REPLACE "\"token\": " "" tokens "${tokens}")
+  if(NOT tokens STREQUAL "\"hello\";\"ゲーム\";\"当\";\"本\";\"친구\"")
+    message(FATAL_ERROR "Unexpected context tokens: ${tokens}")
+  endif()
+
+elseif(CASE STREQUAL "mine")
+  # Mined candidates are scored from the input alone, so state of another corpus carried in with
+  # --state-in must not change them.
+  run("${CORPUS_GEN}" --output history.tsv --rows 5000 --phrases 300 --vocabulary 2000 --regions 4 --seed 99)
+  run("${TRAINER}" --input history.tsv --state-only --state-out history.dat)
+  run("${TRAINER}" --input corpus.tsv ${MODEL} --mine-output mined.json --output mined.model.json)
+  run("${TRAINER}" --state-in history.dat --input corpus.tsv ${MODEL} --mine-output mined.history.json
+      --output mined.history.model.json)
+  same_files(mined.json mined.history.json)
+  # Planted collocations in 15 contexts of 35 tokens: "qux quux" (10 of 10 and 10) scores log(10 * 35 /
+  # (10 * 10)) and "foo bar" (5 of 5 and 5) log(5 * 35 / (5 * 5)).
+  set(rows "phrase\tplatform\tregionHint\tscore\tcontext\n")
+  foreach(i RANGE 1 10)
+    string(APPEND rows "x\tx\tus\t1\tqux quux\n")
+  endforeach()
+  foreach(i RANGE 1 5)
+    string(APPEND rows "x\tx\tus\t1\tfoo bar baz\n")
+  endforeach()
+  file(WRITE "${WORK}/planted.tsv" "${rows}")
+  run("${TRAINER}" --input planted.tsv --mine-output planted.json --mine-min-count 2 --output planted.model.json)
+  file(READ "${WORK}/planted.json" mined)
+  foreach(expected "{\"phrase\": \"qux quux\", \"length\": 2, \"count\": 10, \"pmi\": 1.2528}"
+                   "{\"phrase\": \"foo bar\", \"length\": 2, \"count\": 5, \"pmi\": 1.9459}")
+    string(FIND "${mined}" "${expected}" found)
+    if(found EQUAL -1)
+      message(FATAL_ERROR "Missing ${expected} in mined candidates:\n${mined}")
+    endif()
+  endforeach()
+
+else()
+  message(FATAL_ERROR "Unknown test case: ${CASE}")
+endif()
@@ -28,6 +28,7 @@ function buildOptions(argv) {
   if (argv.out) options.outFile = argv.out;
   if (argv.tsv) options.tsvFile = argv.tsv;
   if (argv.region) options.regionPref = argv.region;
+  if (argv["trainer-socket"]) options.trainerSocket = argv["trainer-socket"];
   if (argv["max-contexts"]) options.maxContextsPerPhrase = parseIntStrict(argv["max-contexts"]);
   if (argv["max-candidate-contexts"]) options.maxContextsPerCandidate = parseIntStrict(argv["max-candidate-contexts"]);
   if (argv["min-candidate-count"]) options.minCandidateCount = parseIntStrict(argv["min-candidate-count"]);
@@ -158,6 +159,7 @@ Options:
   --max-contexts 8             Max contexts stored per known phrase.
   --max-candidate-contexts 6   Max contexts stored per unknown candidate.
   --min-candidate-count 2      Minimum hits before including a candidate.
+  --trainer-socket path.sock   Also stream contexts to a resident slang_trainer --socket daemon.
 
 Reddit specific:
   --reddit-subs slang,teenagers    Subreddits to crawl.
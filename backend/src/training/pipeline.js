@@ -2,13 +2,15 @@ import { promises as fs } from "node:fs";
 import path from "node:path";
 
 import { normalizeText } from "../lib/normalize.js";
-import { detectSlang, dict as loadDictionary } from "../lib/detect.js";
+import { dict as loadDictionary } from "../lib/detect.js";
+import { closeDetector, detectSlangBatch } from "../lib/nativeDetect.js";
 import { collectFromReddit } from "./collectors/reddit.js";
 import { collectFromTwitter } from "./collectors/twitter.js";
 import { collectFromYouTube } from "./collectors/youtube.js";
 import { collectFromDiscord } from "./collectors/discord.js";
 import { COMMON_WORDS } from "./commonWords.js";
 import { extractUnknownTokens, makeSnippet } from "./tokenize.js";
+import { sendToTrainer } from "./trainerClient.js";
 
 const collectors = {
   reddit: collectFromReddit,
@@ -26,6 +28,7 @@ export async function runTrainingPipeline(options = {}) {
     maxContextsPerCandidate = 6,
     minCandidateCount = 2,
     regionPref = null,
+    trainerSocket = null,
   } = options;
 
   const collectorList = resolveCollectors(requestedCollectors);
@@ -58,13 +61,18 @@ export async function runTrainingPipeline(options = {}) {
   const phraseMap = new Map();
   const candidateMap = new Map();
 
-  for (const doc of documents) {
+  // Detect over the whole batch at once, so the compiled matcher (SLANG_DETECT_BIN) sees one stream.
+  const normalizedTexts = documents.map((doc) => (doc.text ? normalizeText(doc.text) : ""));
+  const detections = await detectSlangBatch(normalizedTexts, { regionPref });
+  closeDetector();
+
+  for (const [index, doc] of documents.entries()) {
     const platform = doc.platform || "unknown";
     sourceCounts.set(platform, (sourceCounts.get(platform) || 0) + 1);
     if (!doc.text) continue;
 
-    const normalized = normalizeText(doc.text);
-    const hits = detectSlang(normalized, { regionPref });
+    const normalized = normalizedTexts[index];
+    const hits = detections[index];
     const recognized = new Set(hits.map((h) => (h.phrase || "").toLowerCase()).filter(Boolean));
 
     if (hits.length) {
@@ -138,11 +146,21 @@ export async function runTrainingPipeline(options = {}) {
 
   await fs.mkdir(path.dirname(outPath), { recursive: true });
   await fs.writeFile(outPath, JSON.stringify(payload, null, 2), "utf8");
-  await writeContextsTsv(existingPhrases, tsvPath);
+  const rows = buildContextRows(existingPhrases);
+  await writeContextsTsv(rows, tsvPath);
 
   console.log(`[training] Wrote corpus to ${path.relative(process.cwd(), outPath)}`);
   console.log(`[training] Wrote context TSV to ${path.relative(process.cwd(), tsvPath)}`);
 
+  if (trainerSocket) {
+    try {
+      const replies = await sendToTrainer(trainerSocket, rows.slice(1));
+      console.log(`[training] Trainer daemon: ${replies.join("; ")}`);
+    } catch (err) {
+      console.warn(`[training] Trainer daemon at ${trainerSocket} failed: ${err.message}`);
+    }
+  }
+
   return { ...payload, outPath, tsvPath };
 }
 
@@ -186,7 +204,7 @@ function scoreDocument(doc = {}) {
   return base + Math.log1p(Math.max(0, score)) + commentBonus;
 }
 
-async function writeContextsTsv(existingPhrases, filePath) {
+function buildContextRows(existingPhrases) {
   const rows = ["phrase\tplatform\tregionHint\tscore\tcontext"];
   for (const entry of existingPhrases) {
     for (const ctx of entry.contexts) {
@@ -201,6 +219,10 @@ async function writeContextsTsv(existingPhrases, filePath) {
       );
     }
   }
+  return rows;
+}
+
+async function writeContextsTsv(rows, filePath) {
   await fs.mkdir(path.dirname(filePath), { recursive: true });
   await fs.writeFile(filePath, rows.join("\n"), "utf8");
 }
@@ -0,0 +1,28 @@
+import net from "node:net";
+
+/**
+ * Streams contexts TSV rows to a resident `slang_trainer --socket` daemon, then sends the given
+ * commands (FLUSH, CHECKPOINT, ...) and resolves with the daemon's reply lines.
+ */
+export function sendToTrainer(socketPath, rows, { commands = ["FLUSH", "CHECKPOINT"], timeoutMs = 120000 } = {}) {
+  return new Promise((resolve, reject) => {
+    const socket = net.createConnection(socketPath);
+    let received = "";
+    socket.setEncoding("utf8");
+    socket.setTimeout(timeoutMs, () => socket.destroy(new Error(`[trainer] No reply from ${socketPath}`)));
+    socket.on("data", (chunk) => {
+      received += chunk;
+    });
+    socket.on("error", reject);
+    socket.on("end", () => {
+      const replies = received.split("\n").filter(Boolean);
+      const failed = replies.find((line) => line.startsWith("ERR"));
+      if (failed) reject(new Error(`[trainer] ${failed}`));
+      else resolve(replies);
+    });
+    socket.on("connect", () => {
+      const payload = rows.length ? `${rows.join("\n")}\n` : "";
+      socket.end(`${payload}${[...commands, "CLOSE"].join("\n")}\n`);
+    });
+  });
+}
@@ -0,0 +1,102 @@
+// tests/nativeDetect.test.js
+import fs from "node:fs";
+import os from "node:os";
+import path from "node:path";
+import { execFileSync } from "node:child_process";
+import { afterEach, beforeAll, describe, expect, it, vi } from "vitest";
+
+// detect.js reads src/data/slang.seed.json from the working directory, so the tests run from a
+// directory holding a small fixture dictionary.
+const DICTIONARY = [
+  { id: "1", phrase: "no cap", variants: ["no cap", "nocap"], regions: ["us"] },
+  { id: "2", phrase: "cap", variants: ["cap"], regions: ["us"] },
+  { id: "3", phrase: "wagwan", variants: ["wagwan", "wagwaan"], regions: ["toronto", "uk"] },
+  { id: "4", phrase: "wagwan", variants: ["wagwan"], regions: ["jamaica"] },
+  { id: "5", phrase: "mandem", variants: ["mandem"], regions: ["toronto"] },
+];
+const MESSAGES = [
+  ["that fit is fire no cap", undefined],
+  ["Wagwan mandem, you good?", "toronto"],
+  ["wagwan", "jamaica"],
+  ["nocap\tthat was\nwild", undefined],
+  ["capital letters only", undefined],
+  ["", undefined],
+];
+const NATIVE_BIN = path.resolve("src/training/cpp/build/slang_detect");
+const TRAINER_BIN = path.resolve("src/training/cpp/build/slang_trainer");
+
+let detectSlang;
+let nativeDetect;
+let scratch;
+
+beforeAll(async () => {
+  scratch = fs.mkdtempSync(path.join(os.tmpdir(), "native-detect-"));
+  fs.mkdirSync(path.join(scratch, "src/data"), { recursive: true });
+  fs.writeFileSync(path.join(scratch, "src/data/slang.seed.json"), JSON.stringify(DICTIONARY));
+  // A matcher that reads messages and never answers.
+  fs.writeFileSync(path.join(scratch, "stall.sh"), "#!/bin/sh\nexec cat > /dev/null\n", { mode: 0o755 });
+  process.chdir(scratch);
+  ({ detectSlang } = await import("../src/lib/detect.js"));
+  nativeDetect = await import("../src/lib/nativeDetect.js");
+  vi.spyOn(console, "warn").mockImplementation(() => {});
+});
+
+afterEach(() => {
+  nativeDetect.closeDetector();
+  delete process.env.SLANG_DETECT_BIN;
+  delete process.env.SLANG_DETECT_STATE;
+});
+
+async function expectSameAsDetectSlang(opts = {}) {
+  for (const [text, regionPref] of MESSAGES) {
+    expect(await nativeDetect.detectSlangAsync(text, { regionPref, ...opts })).toEqual(
+      detectSlang(text, { regionPref })
+    );
+  }
+  const texts = MESSAGES.map(([text]) => text);
+  expect(await nativeDetect.detectSlangBatch(texts, opts)).toEqual(texts.map((text) => detectSlang(text)));
+}
+
+describe("detectSlangAsync", () => {
+  it("uses detectSlang without SLANG_DETECT_BIN", async () => {
+    await expectSameAsDetectSlang();
+  });
+
+  it("falls back to detectSlang when the matcher is missing", async () => {
+    process.env.SLANG_DETECT_BIN = path.join(scratch, "missing");
+    await expectSameAsDetectSlang();
+  });
+
+  it("falls back to detectSlang when the matcher exits", async () => {
+    process.env.SLANG_DETECT_BIN = "/bin/false";
+    await expectSameAsDetectSlang();
+  });
+
+  it("falls back to detectSlang when the matcher does not answer", async () => {
+    process.env.SLANG_DETECT_BIN = path.join(scratch, "stall.sh");
+    await expectSameAsDetectSlang({ timeoutMs: 50 });
+  });
+
+  it.skipIf(!fs.existsSync(NATIVE_BIN))("matches detectSlang through slang_detect", async () => {
+    process.env.SLANG_DETECT_BIN = NATIVE_BIN;
+    await expectSameAsDetectSlang();
+  });
+
+  it.skipIf(!fs.existsSync(NATIVE_BIN) || !fs.existsSync(TRAINER_BIN))(
+    "keeps dictionary hits inside trained phrases",
+    async () => {
+      fs.writeFileSync(
+        path.join(scratch, "trained.tsv"),
+        "phrase\tplatform\tregionHint\tscore\tcontext\n" +
+          "no cap fr\tx\tus\t1\tthat was no cap fr\n" +
+          "no cap fr\tx\tus\t1\tno cap fr fr\n"
+      );
+      execFileSync(TRAINER_BIN, ["--input", "trained.tsv", "--state-only", "--state-out", "trained.dat"]);
+      process.env.SLANG_DETECT_BIN = NATIVE_BIN;
+      process.env.SLANG_DETECT_STATE = path.join(scratch, "trained.dat");
+      const text = "that was no cap fr";
+      expect(await nativeDetect.detectSlangAsync(text)).toEqual(detectSlang(text));
+      expect(detectSlang(text)).not.toEqual([]);
+    }
+  );
+});